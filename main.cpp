@@ -1,20 +1,90 @@
+// Builds without GLFW (-DHAVE_GLFW=0) have no window and run headless only
+#ifndef HAVE_GLFW
+#define HAVE_GLFW 1
+#endif
+#if HAVE_GLFW
+#define GLFW_INCLUDE_GLEXT
 #include <GLFW/glfw3.h>
+#else
+#include <GL/gl.h>
+#include <GL/glext.h>
+#endif
+#ifdef HAVE_EGL
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+#if RAIN_SCENE_BENCH && !defined(HAVE_EGL)
+#error "scene_bench renders headless and needs EGL (-DHAVE_EGL)"
+#endif
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cctype>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <ctime>
 #include <iostream>
 #include <cmath>
+#include <map>
+#include <memory>
+#include <string>
+#include <mutex>
+#include <new>
+#include <thread>
 #include <vector>
+#include <chrono>
+#ifdef _WIN32
+#include <malloc.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#if (defined(__x86_64__) || defined(_M_X64)) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+// SIMD paths for the particle kernels and mat4Multiply. SSE is part of
+// x86-64; AVX2 is compiled per function and checked at run time.
+#define RAIN_SSE 1
+#define RAIN_AVX2 1
+#endif
 
-const int MAX_PARTICLES = 3500;  // Rain particles
+const int MAX_PARTICLES = 3500;  // Default rain particle count (--particles)
 const int NUM_CLOUDS = 10;     // Number of clouds
 const int PUFFS_PER_CLOUD = 6; // Reduced for a simpler cloud shape
-const int RIPPLES = 10;       // Number of pond ripples
+const int RIPPLES = 10;       // Default number of pond ripples (--ripples)
 
-struct Particle {
-    float x, y, z;
-    float speed;
+// Rain is stored as separate, 32-byte aligned arrays so the update kernels
+// can stream through y and speed in full SIMD lanes. capacity is count
+// rounded up to the widest lane count; padding lanes never fall below zero.
+struct ParticleStore {
+    float* x;
+    float* y;
+    float* z;
+    float* speed;
+    float* landY;         // Height of the surface each drop will land on
+    int count;
+    int capacity;
+    uint32_t tick;        // Kernel runs so far; part of the respawn counter
+    uint64_t respawnKey;  // RNG_PARTICLE_RESPAWN stream key
+    bool makesRipples;    // Drops landing in the pond start ripples (the simulation's store only)
+};
+
+enum ParticleKernel {
+    KERNEL_SCALAR,
+    KERNEL_SSE,
+    KERNEL_AVX2,
+    KERNEL_COUNT
 };
 
+const char* particleKernelNames[KERNEL_COUNT] = { "scalar", "sse", "avx2" };
+const int PARTICLE_LANES = 8;
+
 struct CloudPuff {
     float x, y, z;
     float size;
@@ -29,7 +99,7 @@ struct Cloud {
 };
 
 struct Ripple {
-    float x, z;
+    float x, y, z;
     float radius;
     float maxRadius;
     float speed;
@@ -42,547 +112,7017 @@ struct Sphere {
     float speed;
 };
 
-Particle particles[MAX_PARTICLES];
-Cloud clouds[NUM_CLOUDS];
-Ripple ripples[RIPPLES];
+struct TreePlacement {
+    float x, y, z;
+};
+
+// Objects that come and go during a run (ripples today) live in a pool of
+// fixed capacity, packed at the front of storage allocated once by
+// reserve(). acquire() hands out the slot after the last live object, or
+// null when the pool is full; release(i) moves the last live object into
+// slot i. Spawning and retiring are O(1), loops never visit dead slots, and
+// a running pool never touches the heap. Order is not stable.
+template <typename T>
+struct Pool {
+    std::vector<T> slots;   // Capacity; [0, count) are live
+    size_t count = 0;
+
+    void reserve(size_t capacity) {
+        slots.assign(capacity, T());
+        count = 0;
+    }
+    T* acquire() { return count < slots.size() ? &slots[count++] : nullptr; }
+    void release(size_t i) { slots[i] = slots[--count]; }
+    size_t size() const { return count; }
+    T& operator[](size_t i) { return slots[i]; }
+    const T& operator[](size_t i) const { return slots[i]; }
+    const T* begin() const { return slots.data(); }
+    const T* end() const { return slots.data() + count; }
+};
+
+// Random numbers are counter based: value n of a stream is a hash of the
+// stream key and n, with no hidden state. Each subsystem (and each worker
+// thread, via the thread index) gets its own key derived from --seed, so
+// values can be generated out of order or in parallel and a seed always
+// replays the same scene.
+enum RngStreamId {
+    RNG_PARTICLE_INIT,
+    RNG_PARTICLE_RESPAWN,
+    RNG_CLOUDS,
+    RNG_RIPPLES,
+    RNG_TREES,
+    RNG_TILES
+};
+
+struct Rng {
+    uint64_t key;
+    uint64_t counter;
+};
+
+uint64_t rngSeed = 0;  // --seed; defaults to the start time
+
+// splitmix64 finalizer
+inline uint64_t rngMix(uint64_t z) {
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+inline uint64_t rngAt(uint64_t key, uint64_t counter) {
+    return rngMix(key + counter * 0x9e3779b97f4a7c15ULL);
+}
+
+// Top 24 bits as a float in [0, 1).
+inline float rngUnit(uint64_t bits) {
+    return (float)(bits >> 40) * (1.0f / 16777216.0f);
+}
+
+Rng rngStream(RngStreamId id, uint32_t thread = 0) {
+    Rng rng = { rngMix(rngSeed ^ rngMix(((uint64_t)id << 32) | thread)), 0 };
+    return rng;
+}
+
+inline float rngRange(Rng& rng, float lo, float hi) {
+    return lo + (hi - lo) * rngUnit(rngAt(rng.key, rng.counter++));
+}
+
+Rng cloudRng;
+Rng rippleRng;
+
+int numParticles = MAX_PARTICLES;
+ParticleStore particles = {};
+ParticleKernel particleKernel = KERNEL_SCALAR;
+int numClouds = NUM_CLOUDS;          // --clouds
+std::vector<Cloud> clouds;
+uint32_t placementGeneration = 0;    // Bumped when clouds or trees are placed anew
+int numTrees = 1;                    // --trees; the scene's own trees come first
+const TreePlacement* trees = nullptr; // The scene's trees in place, or treeStorage when some are scattered
+int treeCount = 0;
+std::vector<TreePlacement> treeStorage;
+int numRipples = RIPPLES;            // --ripples
+Pool<Ripple> ripples;
 Sphere sphere = { -2.0f, 0.0f, -2.0f, 0.3f, 0.1f }; // Sphere starts at (-2, 0, -2)
 bool doorOpen = false;
-const float houseX = 0.0f, houseY = 0.75f, houseZ = 0.0f; // House position
-const float pondX = 3.0f, pondY = 0.01f, pondZ = 3.0f; // Pond position
+const double SIM_TICK_RATE = 60.0;   // Simulation ticks per second; one tick advances as far as one frame used to
+bool useSimThread = true;            // Step the simulation on its own thread (--no-sim-thread)
 float cameraDistance = 15.0f; // Distance from camera to center
 float cameraAngleX = 45.0f;  // Horizontal angle (degrees)
 float cameraAngleY = 18.0f;  // Vertical angle (degrees)
 const float cameraSpeed = 0.1f; // Camera movement speed
 const float angleSpeed = 2.0f;  // Camera rotation speed (degrees)
+bool useMeshCache = true;       // false = original immediate-mode geometry (--immediate, M key)
+bool showStats = false;         // Print frame time and draw call counts (--stats)
+bool useInstancing = true;      // Batch clouds and trees into instanced draws (--no-instancing, N key)
+bool useCulling = true;         // Skip what is out of view and pick sphere detail by size (--no-culling, L key)
+bool useGpuRain = false;        // Simulate and draw rain on the GPU with transform feedback (--gpu-rain)
+bool useCloudImpostors = false; // Clouds as depth-sorted billboards instead of spheres (--cloud-impostors)
+bool useWorld = false;          // Tiled ground around the garden, loaded as the camera moves (--world)
+std::string worldDir;           // Where tile files are looked for (--world-dir)
+float worldFocusX = 0.0f;       // Camera focus offset from the garden's, moved by the T/F/G/H keys
+float worldFocusZ = 0.0f;
+float worldDrift = 0.0f;        // Units the focus moves along +x each frame (--world-drift)
 
-void initParticles() {
-    for (int i = 0; i < MAX_PARTICLES; ++i) {
-        particles[i].x = ((rand() % 200) - 100) / 50.0f;
-        particles[i].y = (rand() % 100) / 10.0f + 2.0f;
-        particles[i].z = ((rand() % 200) - 100) / 50.0f;
-        particles[i].speed = 0.02f + (rand() % 10) / 500.0f;
+// Scene files. A garden is a small header followed by flat arrays of
+// houses, ponds, trees and clouds. The binary form is mapped read-only and
+// its arrays are used where they lie, with no parse step, so a garden of
+// tens of thousands of objects starts at once and every process that maps
+// it shares the pages. The text form has one record per line (see
+// defaultSceneText); --compile-scene turns it into the binary form and
+// --scene also takes it directly, compiling it in memory. Both are in the
+// machine's native byte order.
+const char SCENE_MAGIC[4] = { 'R', 'S', 'C', 'N' };
+const uint32_t SCENE_VERSION = 1;
+const uint32_t MAX_SCENE_COUNT = 100000000;  // Most particles, clouds, ripples or trees a scene may ask for
+
+struct SceneHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t particles, clouds, ripples, trees; // Counts to simulate; trees and clouds past the listed ones are scattered
+    float groundSize;                            // Half-width of the ground square and radius of the sky
+    uint32_t houseCount, pondCount, treeCount, cloudCount;
+    uint32_t houseOffset, pondOffset, treeOffset, cloudOffset; // Bytes from the start of the file
+};
+
+struct SceneHouse {
+    float x, y, z;        // Centre of the 2 x 1.5 x 2 walls; the roof sits on top
+};
+
+struct ScenePond {
+    float x, y, z;        // Centre of the water surface
+    float radius;
+};
+
+struct SceneCloud {
+    float x, y, z;
+    float speed;
+    float width;
+};
+
+struct Scene {
+    const SceneHeader* header;
+    const SceneHouse* houses;
+    const ScenePond* ponds;
+    const TreePlacement* trees;  // The first header->treeCount trees; initTrees scatters the rest
+    const SceneCloud* clouds;
+    std::vector<uint32_t> owned; // Text scenes and the built-in garden, compiled; 4-byte aligned
+    void* mapped;                // Binary scene file, or null
+    size_t mappedSize;
+};
+
+Scene scene = {};
+
+// The built-in garden, used without --scene.
+const char* defaultSceneText =
+    "particles 3500\n"
+    "clouds 10\n"
+    "ripples 10\n"
+    "trees 1\n"
+    "ground 50\n"
+    "house 0 0.75 0\n"
+    "pond 3 0.01 3 2\n"
+    "tree 2.5 0.75 -0.5      # beside the house\n"
+    "cloud -5 4 2 0.002 2    # x y z speed width\n"
+    "cloud -4 7 -3 0.001 1.5\n";
+
+// Where the camera looks: the first house, or the origin.
+void sceneFocus(float& x, float& y, float& z) {
+    x = y = z = 0.0f;
+    if (scene.header && scene.header->houseCount > 0) {
+        x = scene.houses[0].x;
+        y = scene.houses[0].y;
+        z = scene.houses[0].z;
     }
 }
 
-void initClouds() {
-    clouds[0].x = -5.0f;
-    clouds[0].y = 4.0f;
-    clouds[0].z = 2.0f;
-    clouds[0].speed = 0.002f;
-    clouds[0].width = 2.0f;
-    
-    clouds[1].x = -4.0f;
-    clouds[1].y = 7.0f;
-    clouds[1].z = -3.0f;
-    clouds[1].speed = 0.001f;
-    clouds[1].width = 1.5f;
-    
-    for (int i = 2; i < NUM_CLOUDS; ++i) {
-        clouds[i].x = -15.0f + (rand() % 300) / 10.0f;
-        clouds[i].y = 4.0f + (rand() % 40) / 10.0f;
-        clouds[i].z = -15.0f + (rand() % 300) / 10.0f;
-        clouds[i].speed = (rand() % 8) / 2000.0f;
-        clouds[i].width = 1.5f + (rand() % 10) / 10.0f;
+struct RenderStats {
+    int drawCalls;  // glBegin/glEnd pairs or glDrawArrays calls issued by the primitives
+    int vertices;   // Vertices those calls submitted
+};
+
+RenderStats renderStats = { 0, 0 };
+
+// Buffer objects are GL 1.5, which not every platform's GL library exports
+// directly, so the entry points are looked up once a context is current.
+#ifndef APIENTRY
+#define APIENTRY
+#endif
+typedef void (*GLProc)(void);
+typedef GLProc (*GLProcLoader)(const char* name);
+typedef void (APIENTRY* GenBuffersProc)(GLsizei n, GLuint* buffers);
+typedef void (APIENTRY* DeleteBuffersProc)(GLsizei n, const GLuint* buffers);
+typedef void (APIENTRY* BindBufferProc)(GLenum target, GLuint buffer);
+typedef void (APIENTRY* BufferDataProc)(GLenum target, GLsizeiptr size, const void* data, GLenum usage);
+typedef void (APIENTRY* BufferSubDataProc)(GLenum target, GLintptr offset, GLsizeiptr size, const void* data);
+typedef GLuint (APIENTRY* CreateShaderProc)(GLenum type);
+typedef void (APIENTRY* ShaderSourceProc)(GLuint shader, GLsizei count, const GLchar* const* string, const GLint* length);
+typedef void (APIENTRY* CompileShaderProc)(GLuint shader);
+typedef void (APIENTRY* GetShaderivProc)(GLuint shader, GLenum pname, GLint* params);
+typedef void (APIENTRY* GetShaderInfoLogProc)(GLuint shader, GLsizei bufSize, GLsizei* length, GLchar* infoLog);
+typedef void (APIENTRY* DeleteShaderProc)(GLuint shader);
+typedef GLuint (APIENTRY* CreateProgramProc)(void);
+typedef void (APIENTRY* AttachShaderProc)(GLuint program, GLuint shader);
+typedef void (APIENTRY* BindAttribLocationProc)(GLuint program, GLuint index, const GLchar* name);
+typedef void (APIENTRY* LinkProgramProc)(GLuint program);
+typedef void (APIENTRY* GetProgramivProc)(GLuint program, GLenum pname, GLint* params);
+typedef void (APIENTRY* GetProgramInfoLogProc)(GLuint program, GLsizei bufSize, GLsizei* length, GLchar* infoLog);
+typedef void (APIENTRY* DeleteProgramProc)(GLuint program);
+typedef void (APIENTRY* UseProgramProc)(GLuint program);
+typedef GLint (APIENTRY* GetUniformLocationProc)(GLuint program, const GLchar* name);
+typedef void (APIENTRY* Uniform3fProc)(GLint location, GLfloat v0, GLfloat v1, GLfloat v2);
+typedef void (APIENTRY* VertexAttribPointerProc)(GLuint index, GLint size, GLenum type, GLboolean normalized, GLsizei stride, const void* pointer);
+typedef void (APIENTRY* EnableVertexAttribArrayProc)(GLuint index);
+typedef void (APIENTRY* DisableVertexAttribArrayProc)(GLuint index);
+typedef void (APIENTRY* VertexAttribDivisorProc)(GLuint index, GLuint divisor);
+typedef void (APIENTRY* DrawArraysInstancedProc)(GLenum mode, GLint first, GLsizei count, GLsizei instancecount);
+typedef void (APIENTRY* Uniform1fProc)(GLint location, GLfloat v0);
+typedef void (APIENTRY* Uniform1uiProc)(GLint location, GLuint v0);
+typedef void (APIENTRY* TransformFeedbackVaryingsProc)(GLuint program, GLsizei count, const GLchar* const* varyings, GLenum bufferMode);
+typedef void (APIENTRY* BeginTransformFeedbackProc)(GLenum primitiveMode);
+typedef void (APIENTRY* EndTransformFeedbackProc)(void);
+typedef void (APIENTRY* BindBufferBaseProc)(GLenum target, GLuint index, GLuint buffer);
+typedef void (APIENTRY* GenQueriesProc)(GLsizei n, GLuint* ids);
+typedef void (APIENTRY* DeleteQueriesProc)(GLsizei n, const GLuint* ids);
+typedef void (APIENTRY* BeginQueryProc)(GLenum target, GLuint id);
+typedef void (APIENTRY* EndQueryProc)(GLenum target);
+typedef void (APIENTRY* GetQueryObjectivProc)(GLuint id, GLenum pname, GLint* params);
+typedef void (APIENTRY* GetQueryObjectui64vProc)(GLuint id, GLenum pname, GLuint64* params);
+typedef void* (APIENTRY* MapBufferProc)(GLenum target, GLenum access);
+typedef GLboolean (APIENTRY* UnmapBufferProc)(GLenum target);
+typedef void (APIENTRY* GenFramebuffersProc)(GLsizei n, GLuint* framebuffers);
+typedef void (APIENTRY* DeleteFramebuffersProc)(GLsizei n, const GLuint* framebuffers);
+typedef void (APIENTRY* BindFramebufferProc)(GLenum target, GLuint framebuffer);
+typedef GLenum (APIENTRY* CheckFramebufferStatusProc)(GLenum target);
+typedef void (APIENTRY* GenRenderbuffersProc)(GLsizei n, GLuint* renderbuffers);
+typedef void (APIENTRY* DeleteRenderbuffersProc)(GLsizei n, const GLuint* renderbuffers);
+typedef void (APIENTRY* BindRenderbufferProc)(GLenum target, GLuint renderbuffer);
+typedef void (APIENTRY* RenderbufferStorageProc)(GLenum target, GLenum internalformat, GLsizei width, GLsizei height);
+typedef void (APIENTRY* FramebufferRenderbufferProc)(GLenum target, GLenum attachment, GLenum renderbuffertarget, GLuint renderbuffer);
+typedef void* (APIENTRY* MapBufferRangeProc)(GLenum target, GLintptr offset, GLsizeiptr length, GLbitfield access);
+typedef void (APIENTRY* BufferStorageProc)(GLenum target, GLsizeiptr size, const void* data, GLbitfield flags);
+typedef GLsync (APIENTRY* FenceSyncProc)(GLenum condition, GLbitfield flags);
+typedef GLenum (APIENTRY* ClientWaitSyncProc)(GLsync sync, GLbitfield flags, GLuint64 timeout);
+typedef void (APIENTRY* DeleteSyncProc)(GLsync sync);
+typedef void (APIENTRY* TexImage3DProc)(GLenum target, GLint level, GLint internalformat, GLsizei width, GLsizei height, GLsizei depth, GLint border, GLenum format, GLenum type, const void* pixels);
+typedef void (APIENTRY* FramebufferTextureLayerProc)(GLenum target, GLenum attachment, GLuint texture, GLint level, GLint layer);
+
+struct GLFunctions {
+    GenBuffersProc GenBuffers;
+    DeleteBuffersProc DeleteBuffers;
+    BindBufferProc BindBuffer;
+    BufferDataProc BufferData;
+    BufferSubDataProc BufferSubData;
+    CreateShaderProc CreateShader;
+    ShaderSourceProc ShaderSource;
+    CompileShaderProc CompileShader;
+    GetShaderivProc GetShaderiv;
+    GetShaderInfoLogProc GetShaderInfoLog;
+    DeleteShaderProc DeleteShader;
+    CreateProgramProc CreateProgram;
+    AttachShaderProc AttachShader;
+    BindAttribLocationProc BindAttribLocation;
+    LinkProgramProc LinkProgram;
+    GetProgramivProc GetProgramiv;
+    GetProgramInfoLogProc GetProgramInfoLog;
+    DeleteProgramProc DeleteProgram;
+    UseProgramProc UseProgram;
+    GetUniformLocationProc GetUniformLocation;
+    Uniform3fProc Uniform3f;
+    VertexAttribPointerProc VertexAttribPointer;
+    EnableVertexAttribArrayProc EnableVertexAttribArray;
+    DisableVertexAttribArrayProc DisableVertexAttribArray;
+    VertexAttribDivisorProc VertexAttribDivisor;
+    DrawArraysInstancedProc DrawArraysInstanced;
+    Uniform1fProc Uniform1f;
+    Uniform1uiProc Uniform1ui;
+    TransformFeedbackVaryingsProc TransformFeedbackVaryings;
+    BeginTransformFeedbackProc BeginTransformFeedback;
+    EndTransformFeedbackProc EndTransformFeedback;
+    BindBufferBaseProc BindBufferBase;
+    GenQueriesProc GenQueries;
+    DeleteQueriesProc DeleteQueries;
+    BeginQueryProc BeginQuery;
+    EndQueryProc EndQuery;
+    GetQueryObjectivProc GetQueryObjectiv;
+    GetQueryObjectui64vProc GetQueryObjectui64v;
+    MapBufferProc MapBuffer;
+    UnmapBufferProc UnmapBuffer;
+    GenFramebuffersProc GenFramebuffers;
+    DeleteFramebuffersProc DeleteFramebuffers;
+    BindFramebufferProc BindFramebuffer;
+    CheckFramebufferStatusProc CheckFramebufferStatus;
+    GenRenderbuffersProc GenRenderbuffers;
+    DeleteRenderbuffersProc DeleteRenderbuffers;
+    BindRenderbufferProc BindRenderbuffer;
+    RenderbufferStorageProc RenderbufferStorage;
+    FramebufferRenderbufferProc FramebufferRenderbuffer;
+    MapBufferRangeProc MapBufferRange;
+    BufferStorageProc BufferStorage;
+    FenceSyncProc FenceSync;
+    ClientWaitSyncProc ClientWaitSync;
+    DeleteSyncProc DeleteSync;
+    TexImage3DProc TexImage3D;
+    FramebufferTextureLayerProc FramebufferTextureLayer;
+    bool hasBuffers;
+    bool hasShaders;
+    bool hasInstancing;
+    bool hasPixelBuffers;
+    bool hasFramebuffers;
+    bool hasTimerQueries;
+    bool hasTransformFeedback;
+    bool hasMapBufferRange;
+    bool hasSync;
+    bool hasBufferStorage;
+    bool hasTextureArrays;
+};
+
+GLFunctions gl = {};
+
+GLProc loadGLProc(GLProcLoader getProc, const char* name, const char* arbName) {
+    GLProc proc = getProc(name);
+    if (!proc && arbName)
+        proc = getProc(arbName);
+    return proc;
+}
+
+void loadGLFunctions(GLProcLoader getProc) {
+    gl.GenBuffers = (GenBuffersProc)loadGLProc(getProc, "glGenBuffers", "glGenBuffersARB");
+    gl.DeleteBuffers = (DeleteBuffersProc)loadGLProc(getProc, "glDeleteBuffers", "glDeleteBuffersARB");
+    gl.BindBuffer = (BindBufferProc)loadGLProc(getProc, "glBindBuffer", "glBindBufferARB");
+    gl.BufferData = (BufferDataProc)loadGLProc(getProc, "glBufferData", "glBufferDataARB");
+    gl.BufferSubData = (BufferSubDataProc)loadGLProc(getProc, "glBufferSubData", "glBufferSubDataARB");
+    gl.hasBuffers = gl.GenBuffers && gl.DeleteBuffers && gl.BindBuffer && gl.BufferData && gl.BufferSubData;
+
+    gl.CreateShader = (CreateShaderProc)loadGLProc(getProc, "glCreateShader", nullptr);
+    gl.ShaderSource = (ShaderSourceProc)loadGLProc(getProc, "glShaderSource", nullptr);
+    gl.CompileShader = (CompileShaderProc)loadGLProc(getProc, "glCompileShader", nullptr);
+    gl.GetShaderiv = (GetShaderivProc)loadGLProc(getProc, "glGetShaderiv", nullptr);
+    gl.GetShaderInfoLog = (GetShaderInfoLogProc)loadGLProc(getProc, "glGetShaderInfoLog", nullptr);
+    gl.DeleteShader = (DeleteShaderProc)loadGLProc(getProc, "glDeleteShader", nullptr);
+    gl.CreateProgram = (CreateProgramProc)loadGLProc(getProc, "glCreateProgram", nullptr);
+    gl.AttachShader = (AttachShaderProc)loadGLProc(getProc, "glAttachShader", nullptr);
+    gl.BindAttribLocation = (BindAttribLocationProc)loadGLProc(getProc, "glBindAttribLocation", nullptr);
+    gl.LinkProgram = (LinkProgramProc)loadGLProc(getProc, "glLinkProgram", nullptr);
+    gl.GetProgramiv = (GetProgramivProc)loadGLProc(getProc, "glGetProgramiv", nullptr);
+    gl.GetProgramInfoLog = (GetProgramInfoLogProc)loadGLProc(getProc, "glGetProgramInfoLog", nullptr);
+    gl.DeleteProgram = (DeleteProgramProc)loadGLProc(getProc, "glDeleteProgram", nullptr);
+    gl.UseProgram = (UseProgramProc)loadGLProc(getProc, "glUseProgram", nullptr);
+    gl.GetUniformLocation = (GetUniformLocationProc)loadGLProc(getProc, "glGetUniformLocation", nullptr);
+    gl.Uniform3f = (Uniform3fProc)loadGLProc(getProc, "glUniform3f", nullptr);
+    gl.VertexAttribPointer = (VertexAttribPointerProc)loadGLProc(getProc, "glVertexAttribPointer", nullptr);
+    gl.EnableVertexAttribArray = (EnableVertexAttribArrayProc)loadGLProc(getProc, "glEnableVertexAttribArray", nullptr);
+    gl.DisableVertexAttribArray = (DisableVertexAttribArrayProc)loadGLProc(getProc, "glDisableVertexAttribArray", nullptr);
+    gl.hasShaders = gl.CreateShader && gl.ShaderSource && gl.CompileShader && gl.GetShaderiv &&
+                    gl.GetShaderInfoLog && gl.DeleteShader && gl.CreateProgram && gl.AttachShader &&
+                    gl.BindAttribLocation && gl.LinkProgram && gl.GetProgramiv && gl.GetProgramInfoLog &&
+                    gl.DeleteProgram && gl.UseProgram && gl.GetUniformLocation && gl.Uniform3f &&
+                    gl.VertexAttribPointer && gl.EnableVertexAttribArray && gl.DisableVertexAttribArray;
+
+    gl.VertexAttribDivisor = (VertexAttribDivisorProc)loadGLProc(getProc, "glVertexAttribDivisor", "glVertexAttribDivisorARB");
+    gl.DrawArraysInstanced = (DrawArraysInstancedProc)loadGLProc(getProc, "glDrawArraysInstanced", "glDrawArraysInstancedARB");
+    gl.hasInstancing = gl.hasBuffers && gl.hasShaders && gl.VertexAttribDivisor && gl.DrawArraysInstanced;
+
+    // Transform feedback and GLSL 1.30 integers are GL 3.0
+    const char* version = (const char*)glGetString(GL_VERSION);
+    gl.Uniform1f = (Uniform1fProc)loadGLProc(getProc, "glUniform1f", nullptr);
+    gl.Uniform1ui = (Uniform1uiProc)loadGLProc(getProc, "glUniform1ui", "glUniform1uiEXT");
+    gl.TransformFeedbackVaryings = (TransformFeedbackVaryingsProc)loadGLProc(getProc, "glTransformFeedbackVaryings", "glTransformFeedbackVaryingsEXT");
+    gl.BeginTransformFeedback = (BeginTransformFeedbackProc)loadGLProc(getProc, "glBeginTransformFeedback", "glBeginTransformFeedbackEXT");
+    gl.EndTransformFeedback = (EndTransformFeedbackProc)loadGLProc(getProc, "glEndTransformFeedback", "glEndTransformFeedbackEXT");
+    gl.BindBufferBase = (BindBufferBaseProc)loadGLProc(getProc, "glBindBufferBase", "glBindBufferBaseEXT");
+    gl.hasTransformFeedback = version && atof(version) >= 3.0 && gl.hasBuffers && gl.hasShaders && gl.Uniform1f && gl.Uniform1ui &&
+                              gl.TransformFeedbackVaryings && gl.BeginTransformFeedback &&
+                              gl.EndTransformFeedback && gl.BindBufferBase;
+
+    gl.GenQueries = (GenQueriesProc)loadGLProc(getProc, "glGenQueries", "glGenQueriesARB");
+    gl.DeleteQueries = (DeleteQueriesProc)loadGLProc(getProc, "glDeleteQueries", "glDeleteQueriesARB");
+    gl.BeginQuery = (BeginQueryProc)loadGLProc(getProc, "glBeginQuery", "glBeginQueryARB");
+    gl.EndQuery = (EndQueryProc)loadGLProc(getProc, "glEndQuery", "glEndQueryARB");
+    gl.GetQueryObjectiv = (GetQueryObjectivProc)loadGLProc(getProc, "glGetQueryObjectiv", "glGetQueryObjectivARB");
+    gl.GetQueryObjectui64v = (GetQueryObjectui64vProc)loadGLProc(getProc, "glGetQueryObjectui64v", "glGetQueryObjectui64vEXT");
+    // GL_TIME_ELAPSED queries are core in 3.3 and otherwise need ARB_timer_query
+    const char* extensions = (const char*)glGetString(GL_EXTENSIONS);
+    bool timerQuery = (version && atof(version) >= 3.3) ||
+                      (extensions && (strstr(extensions, "GL_ARB_timer_query") || strstr(extensions, "GL_EXT_timer_query")));
+    gl.hasTimerQueries = timerQuery && gl.GenQueries && gl.DeleteQueries && gl.BeginQuery && gl.EndQuery &&
+                         gl.GetQueryObjectiv && gl.GetQueryObjectui64v;
+
+    gl.MapBuffer = (MapBufferProc)loadGLProc(getProc, "glMapBuffer", "glMapBufferARB");
+    gl.UnmapBuffer = (UnmapBufferProc)loadGLProc(getProc, "glUnmapBuffer", "glUnmapBufferARB");
+    gl.hasPixelBuffers = gl.hasBuffers && gl.MapBuffer && gl.UnmapBuffer;
+
+    gl.GenFramebuffers = (GenFramebuffersProc)loadGLProc(getProc, "glGenFramebuffers", "glGenFramebuffersEXT");
+    gl.DeleteFramebuffers = (DeleteFramebuffersProc)loadGLProc(getProc, "glDeleteFramebuffers", "glDeleteFramebuffersEXT");
+    gl.BindFramebuffer = (BindFramebufferProc)loadGLProc(getProc, "glBindFramebuffer", "glBindFramebufferEXT");
+    gl.CheckFramebufferStatus = (CheckFramebufferStatusProc)loadGLProc(getProc, "glCheckFramebufferStatus", "glCheckFramebufferStatusEXT");
+    gl.GenRenderbuffers = (GenRenderbuffersProc)loadGLProc(getProc, "glGenRenderbuffers", "glGenRenderbuffersEXT");
+    gl.DeleteRenderbuffers = (DeleteRenderbuffersProc)loadGLProc(getProc, "glDeleteRenderbuffers", "glDeleteRenderbuffersEXT");
+    gl.BindRenderbuffer = (BindRenderbufferProc)loadGLProc(getProc, "glBindRenderbuffer", "glBindRenderbufferEXT");
+    gl.RenderbufferStorage = (RenderbufferStorageProc)loadGLProc(getProc, "glRenderbufferStorage", "glRenderbufferStorageEXT");
+    gl.FramebufferRenderbuffer = (FramebufferRenderbufferProc)loadGLProc(getProc, "glFramebufferRenderbuffer", "glFramebufferRenderbufferEXT");
+    gl.hasFramebuffers = gl.GenFramebuffers && gl.DeleteFramebuffers && gl.BindFramebuffer &&
+                         gl.CheckFramebufferStatus && gl.GenRenderbuffers && gl.DeleteRenderbuffers &&
+                         gl.BindRenderbuffer && gl.RenderbufferStorage && gl.FramebufferRenderbuffer;
+
+    // Mapped ranges are GL 3.0, fences 3.2 and immutable storage 4.4
+    double glVersion = version ? atof(version) : 0.0;
+    gl.MapBufferRange = (MapBufferRangeProc)loadGLProc(getProc, "glMapBufferRange", nullptr);
+    gl.hasMapBufferRange = (glVersion >= 3.0 || (extensions && strstr(extensions, "GL_ARB_map_buffer_range"))) &&
+                           gl.hasBuffers && gl.MapBufferRange && gl.UnmapBuffer;
+    gl.FenceSync = (FenceSyncProc)loadGLProc(getProc, "glFenceSync", nullptr);
+    gl.ClientWaitSync = (ClientWaitSyncProc)loadGLProc(getProc, "glClientWaitSync", nullptr);
+    gl.DeleteSync = (DeleteSyncProc)loadGLProc(getProc, "glDeleteSync", nullptr);
+    gl.hasSync = (glVersion >= 3.2 || (extensions && strstr(extensions, "GL_ARB_sync"))) &&
+                 gl.FenceSync && gl.ClientWaitSync && gl.DeleteSync;
+    gl.BufferStorage = (BufferStorageProc)loadGLProc(getProc, "glBufferStorage", "glBufferStorageEXT");
+    gl.hasBufferStorage = (glVersion >= 4.4 || (extensions && strstr(extensions, "GL_ARB_buffer_storage"))) &&
+                          gl.hasMapBufferRange && gl.hasSync && gl.BufferStorage;
+
+    // Layered render targets (2D texture arrays) are GL 3.0
+    gl.TexImage3D = (TexImage3DProc)loadGLProc(getProc, "glTexImage3D", "glTexImage3DEXT");
+    gl.FramebufferTextureLayer = (FramebufferTextureLayerProc)loadGLProc(getProc, "glFramebufferTextureLayer", "glFramebufferTextureLayerEXT");
+    gl.hasTextureArrays = (glVersion >= 3.0 || (extensions && strstr(extensions, "GL_EXT_texture_array"))) &&
+                          gl.hasFramebuffers && gl.TexImage3D && gl.FramebufferTextureLayer;
+}
+
+// Wall-clock seconds that, unlike glfwGetTime, work before glfwInit.
+double nowSeconds() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Heap allocation counter. Replacing the global operator new counts every
+// allocation made through new, new[] and the standard containers, on any
+// thread, so a stretch of the frame loop can check it made none (see
+// endFrameAllocations). It is on by default in debug builds and in
+// scene_bench, which reports the count; -DRAIN_ALLOC_COUNTER=0 leaves the
+// library's operator new alone.
+#ifndef RAIN_ALLOC_COUNTER
+#if RAIN_SCENE_BENCH || !defined(NDEBUG)
+#define RAIN_ALLOC_COUNTER 1
+#else
+#define RAIN_ALLOC_COUNTER 0
+#endif
+#endif
+
+std::atomic<uint64_t> heapAllocations(0);
+
+#if RAIN_ALLOC_COUNTER
+// Kept out of line so GCC doesn't see malloc() or free() inlined at a call
+// site and warn that they don't match operator new and delete.
+#if defined(__GNUC__) || defined(__clang__)
+#define ALLOC_NOINLINE __attribute__((noinline))
+#else
+#define ALLOC_NOINLINE __declspec(noinline)
+#endif
+
+ALLOC_NOINLINE void* operator new(size_t size) {
+    heapAllocations.fetch_add(1, std::memory_order_relaxed);
+    void* p = malloc(size ? size : 1);
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+ALLOC_NOINLINE void operator delete(void* p) noexcept {
+    free(p);
+}
+
+ALLOC_NOINLINE void operator delete(void* p, size_t) noexcept {
+    free(p);
+}
+
+ALLOC_NOINLINE void* operator new(size_t size, std::align_val_t align) {
+    heapAllocations.fetch_add(1, std::memory_order_relaxed);
+    size_t alignment = std::max((size_t)align, sizeof(void*));
+#ifdef _WIN32
+    void* p = _aligned_malloc(size ? size : 1, alignment);
+#else
+    void* p = nullptr;
+    if (posix_memalign(&p, alignment, size ? size : 1) != 0)
+        p = nullptr;
+#endif
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+ALLOC_NOINLINE void operator delete(void* p, std::align_val_t) noexcept {
+#ifdef _WIN32
+    _aligned_free(p);
+#else
+    free(p);
+#endif
+}
+
+ALLOC_NOINLINE void operator delete(void* p, size_t, std::align_val_t align) noexcept {
+    operator delete(p, align);
+}
+#endif
+
+// Once the first frames have sized every pool, arena and buffer, a frame
+// should not touch the heap at all. The frame loops bracket each frame with
+// these; debug builds assert the count is zero after ALLOC_WARMUP_FRAMES.
+// Anything that changes what is drawn (the M, N and L keys, a new scene
+// scale) calls restartAllocWarmup.
+const int ALLOC_WARMUP_FRAMES = 3;
+int allocWarmup = ALLOC_WARMUP_FRAMES;
+uint64_t frameAllocStart = 0;
+
+void restartAllocWarmup() {
+    allocWarmup = ALLOC_WARMUP_FRAMES;
+}
+
+void beginFrameAllocations() {
+    frameAllocStart = heapAllocations.load(std::memory_order_relaxed);
+}
+
+// Returns the allocations made since beginFrameAllocations, on any thread.
+uint64_t endFrameAllocations() {
+    uint64_t count = heapAllocations.load(std::memory_order_relaxed) - frameAllocStart;
+    if (allocWarmup > 0)
+        allocWarmup--;
+    else if (RAIN_ALLOC_COUNTER)
+        assert(count == 0 && "steady-state frame allocated on the heap");
+    return count;
+}
+
+// Log messages are formatted on the calling thread into a slot of a fixed
+// ring and written out by a background thread, so the window, render and
+// simulation threads never wait on the terminal. Any thread may log: slots
+// are claimed with a compare-and-swap and published through a per-slot
+// sequence number. A message that finds the ring full is dropped and
+// counted rather than waited for. Messages below RAIN_LOG_LEVEL are compiled
+// out; -DRAIN_LOG_LEVEL=4 removes logging entirely.
+enum LogLevel {
+    LOG_DEBUG,
+    LOG_INFO,
+    LOG_WARN,
+    LOG_ERROR,
+    LOG_OFF
+};
+
+#ifndef RAIN_LOG_LEVEL
+#define RAIN_LOG_LEVEL 1
+#endif
+
+#define LOG(level, ...) \
+    do { \
+        if ((level) >= RAIN_LOG_LEVEL) \
+            logMessage(level, __VA_ARGS__); \
+    } while (0)
+
+const char* logLevelNames[] = {"debug", "info", "warn", "error"};
+const uint32_t LOG_SLOTS = 256;  // Power of two
+const int LOG_LINE = 200;
+
+struct LogSlot {
+    std::atomic<uint32_t> sequence;  // == position once written, position + 1 once published
+    LogLevel level;
+    char text[LOG_LINE];
+};
+
+struct Logger {
+    LogSlot slots[LOG_SLOTS];
+    std::atomic<uint32_t> writePos;   // Next position a producer claims
+    uint32_t readPos;                 // Writer thread only
+    std::atomic<uint32_t> dropped;
+    std::atomic<bool> running;
+    std::thread writer;
+    std::mutex wakeMutex;
+    std::condition_variable wake;
+};
+
+Logger logger;
+std::once_flag loggerStarted;
+
+// Writes out everything published so far. Returns the number of lines.
+int drainLog() {
+    int lines = 0;
+    for (;;) {
+        LogSlot& slot = logger.slots[logger.readPos % LOG_SLOTS];
+        if (slot.sequence.load(std::memory_order_acquire) != logger.readPos + 1)
+            break;
+        if (slot.level >= LOG_WARN)
+            std::cout << "[" << logLevelNames[slot.level] << "] ";
+        std::cout << slot.text << '\n';
+        slot.sequence.store(logger.readPos + LOG_SLOTS, std::memory_order_release);
+        logger.readPos++;
+        lines++;
     }
-    
-    for (int i = 0; i < NUM_CLOUDS; ++i) {
-        for (int j = 0; j < PUFFS_PER_CLOUD; ++j) {
-            clouds[i].puffs[j].x = (rand() % 100 - 50) / 100.0f * clouds[i].width * 0.5f;
-            clouds[i].puffs[j].y = (rand() % 50 - 25) / 100.0f * 0.5f;
-            clouds[i].puffs[j].z = (rand() % 100 - 50) / 100.0f * clouds[i].width * 0.5f;
-            clouds[i].puffs[j].size = 0.5f + (rand() % 10) / 20.0f;
-            clouds[i].puffs[j].alpha = 0.8f + (rand() % 20) / 100.0f;
+    uint32_t dropped = logger.dropped.exchange(0, std::memory_order_relaxed);
+    if (dropped > 0)
+        std::cout << "[warn] log ring full, " << dropped << " messages dropped\n";
+    if (lines > 0 || dropped > 0)
+        std::cout.flush();
+    return lines;
+}
+
+void logWriter() {
+    while (logger.running.load(std::memory_order_acquire)) {
+        if (drainLog() == 0) {
+            // Producers notify without the lock, so a wakeup can be missed;
+            // the timeout bounds how late such a message appears.
+            std::unique_lock<std::mutex> lock(logger.wakeMutex);
+            logger.wake.wait_for(lock, std::chrono::milliseconds(20));
         }
     }
+    drainLog();
 }
 
-void initRipples() {
-    for (int i = 0; i < RIPPLES; ++i) {
-        ripples[i].x = ((rand() % 100) - 50) / 100.0f * 1.5f;
-        ripples[i].z = ((rand() % 100) - 50) / 100.0f * 1.5f;
-        ripples[i].radius = 0.1f * (rand() % 10) / 10.0f;
-        ripples[i].maxRadius = 0.5f + (rand() % 100) / 200.0f;
-        ripples[i].speed = 0.01f + (rand() % 5) / 500.0f;
-        ripples[i].alpha = 0.8f;
-    }
+// Flushes what is queued and stops the writer. Registered with atexit.
+void stopLogger() {
+    if (!logger.running.exchange(false))
+        return;
+    logger.wake.notify_one();
+    logger.writer.join();
+}
 
-void updateParticles() {
-    for (int i = 0; i < MAX_PARTICLES; ++i) {
-        particles[i].y -= particles[i].speed;
-        if (particles[i].y < 0.0f) {
-            particles[i].y = 5.0f;
-            particles[i].x = ((rand() % 600) - 200) / 50.0f;
-            particles[i].z = ((rand() % 600) - 200) / 50.0f;
+void startLogger() {
+    for (uint32_t i = 0; i < LOG_SLOTS; ++i)
+        logger.slots[i].sequence.store(i, std::memory_order_relaxed);
+    logger.writePos.store(0, std::memory_order_relaxed);
+    logger.readPos = 0;
+    logger.running.store(true, std::memory_order_release);
+    logger.writer = std::thread(logWriter);
+    std::atexit(stopLogger);
+}
+
+void logMessage(LogLevel level, const char* format, ...) {
+    std::call_once(loggerStarted, startLogger);
+    uint32_t pos = logger.writePos.load(std::memory_order_relaxed);
+    LogSlot* slot;
+    for (;;) {
+        slot = &logger.slots[pos % LOG_SLOTS];
+        int32_t lag = (int32_t)(slot->sequence.load(std::memory_order_acquire) - pos);
+        if (lag == 0) {
+            if (logger.writePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                break;
+        } else if (lag < 0) {
+            logger.dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        } else {
+            pos = logger.writePos.load(std::memory_order_relaxed);
         }
     }
+    slot->level = level;
+    va_list args;
+    va_start(args, format);
+    vsnprintf(slot->text, LOG_LINE, format, args);
+    va_end(args);
+    slot->sequence.store(pos + 1, std::memory_order_release);
+    logger.wake.notify_one();
 }
 
-void updateClouds() {
-    for (int i = 0; i < NUM_CLOUDS; ++i) {
-        clouds[i].x += clouds[i].speed;
-        if (clouds[i].x > 15.0f) {
-            clouds[i].x = -15.0f;
-            clouds[i].y = 8.0f + (rand() % 40) / 10.0f;
-            clouds[i].z = ((rand() % 500) - 250) / 50.0f;
+// Frame profiler. Each stage of a render frame or simulation tick is timed
+// by a scoped timer, and render stages also by a GL_TIME_ELAPSED query when
+// the driver has them. Completed frames go into a fixed ring per lane
+// (render thread, simulation thread), so recording never allocates or
+// locks. Build with -DRAIN_PROFILER=0 to compile the timers out.
+#ifndef RAIN_PROFILER
+#define RAIN_PROFILER 1
+#endif
+
+enum ProfileLaneId {
+    LANE_RENDER,
+    LANE_SIM,
+    PROFILE_LANE_COUNT
+};
+
+enum ProfileStage {
+    STAGE_VIEW,
+    STAGE_CULL,
+    STAGE_STREAM,
+    STAGE_WORLD,
+    STAGE_TRANSFORMS,
+    STAGE_CLEAR,
+    STAGE_STATIC,
+    STAGE_SKY,
+    STAGE_GROUND,
+    STAGE_TILES,
+    STAGE_CLOUDS,
+    STAGE_HOUSE,
+    STAGE_TREES,
+    STAGE_POND,
+    STAGE_RAIN_STEP,
+    STAGE_PARTICLES,
+    STAGE_SPHERE,
+    STAGE_PRESENT,
+    STAGE_SIM_INPUT,
+    STAGE_SIM_CLOUDS,
+    STAGE_SIM_PARTICLES,
+    STAGE_SIM_RIPPLES,
+    STAGE_SIM_PUBLISH,
+    STAGE_COUNT
+};
+
+const char* profileLaneNames[PROFILE_LANE_COUNT] = { "render", "simulation" };
+const char* profileStageNames[STAGE_COUNT] = {
+    "buildRenderView", "cullScene", "streamFrame", "updateWorld", "updateSceneGraph", "clear", "drawStatic", "drawSky", "drawGround", "drawTiles",
+    "drawClouds", "drawHouse", "drawTrees",
+    "drawPond", "stepGpuRain", "drawParticles", "drawControllableSphere", "present", "input", "updateClouds",
+    "updateParticles", "updateRipples",
+    "publishSnapshot"
+};
+
+const int PROFILE_HISTORY = 2048;   // Frames kept per lane
+const int GPU_QUERY_LATENCY = 4;    // Frames before a timer query result is read
+const int GPU_QUERIES_PER_FRAME = 256;  // Timed scopes per frame; batch mode times each view's stages
+
+struct ProfileFrame {
+    uint64_t index;
+    double start;                   // nowSeconds() at the start of the frame
+    float total;                    // ms
+    float stageStart[STAGE_COUNT];  // ms after start; -1 if the stage did not run
+    float cpu[STAGE_COUNT];         // ms
+    float gpu[STAGE_COUNT];         // ms; -1 if not measured (yet)
+};
+
+struct ProfileLane {
+    ProfileFrame frames[PROFILE_HISTORY];
+    ProfileFrame current;
+    uint64_t frameCount;
+};
+
+// Each frame slot hands out queries in order, one per timed scope, so a
+// stage entered once per batch view gets a query per view and the results
+// are summed like its CPU time.
+struct GpuTimers {
+    GLuint queries[GPU_QUERY_LATENCY][GPU_QUERIES_PER_FRAME];
+    ProfileStage stage[GPU_QUERY_LATENCY][GPU_QUERIES_PER_FRAME];
+    int issued[GPU_QUERY_LATENCY];
+    bool missed[GPU_QUERY_LATENCY][STAGE_COUNT];  // Ran out of queries; the sum would be short
+    uint64_t frame[GPU_QUERY_LATENCY];
+    bool enabled;
+};
+
+ProfileLane profileLanes[PROFILE_LANE_COUNT];
+GpuTimers gpuTimers = {};
+bool showProfile = false;           // Periodic summary on stdout and in the title (--profile)
+std::string profileCsvPath;         // --profile-csv
+std::string profileTracePath;       // --profile-trace
+
+void initGpuTimers() {
+    if (!gl.hasTimerQueries || gpuTimers.enabled)
+        return;
+    for (int i = 0; i < GPU_QUERY_LATENCY; ++i)
+        gl.GenQueries(GPU_QUERIES_PER_FRAME, gpuTimers.queries[i]);
+    gpuTimers.enabled = true;
+}
+
+void destroyGpuTimers() {
+    if (!gpuTimers.enabled)
+        return;
+    for (int i = 0; i < GPU_QUERY_LATENCY; ++i)
+        gl.DeleteQueries(GPU_QUERIES_PER_FRAME, gpuTimers.queries[i]);
+    gpuTimers = GpuTimers();
+}
+
+ProfileFrame* findProfileFrame(ProfileLane& lane, uint64_t index) {
+    if (index >= lane.frameCount || lane.frameCount - index > PROFILE_HISTORY)
+        return nullptr;
+    ProfileFrame* frame = &lane.frames[index % PROFILE_HISTORY];
+    return frame->index == index ? frame : nullptr;
+}
+
+// Copies finished timer queries from GPU_QUERY_LATENCY frames ago into
+// that frame's record, then frees the slot for the frame about to start.
+void collectGpuTimers(uint64_t frameIndex) {
+    int slot = frameIndex % GPU_QUERY_LATENCY;
+    ProfileFrame* frame = findProfileFrame(profileLanes[LANE_RENDER], gpuTimers.frame[slot]);
+    bool complete[STAGE_COUNT];
+    double ms[STAGE_COUNT];
+    for (int s = 0; s < STAGE_COUNT; ++s) {
+        complete[s] = !gpuTimers.missed[slot][s];
+        ms[s] = -1.0;
+        gpuTimers.missed[slot][s] = false;
+    }
+    for (int q = 0; q < gpuTimers.issued[slot] && frame; ++q) {
+        int s = gpuTimers.stage[slot][q];
+        GLint available = 0;
+        gl.GetQueryObjectiv(gpuTimers.queries[slot][q], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available) {
+            complete[s] = false;
+            continue;
+        }
+        GLuint64 ns = 0;
+        gl.GetQueryObjectui64v(gpuTimers.queries[slot][q], GL_QUERY_RESULT, &ns);
+        // Some drivers hand back a raw timestamp for the frame's first query,
+        // begun on an empty command stream; one longer than the frame is bogus
+        if (q == 0 && ns / 1.0e6 > (nowSeconds() - frame->start) * 1000.0) {
+            complete[s] = false;
+            continue;
         }
+        ms[s] = std::max(ms[s], 0.0) + ns / 1.0e6;
     }
+    for (int s = 0; s < STAGE_COUNT && frame; ++s) {
+        if (complete[s] && ms[s] >= 0.0)
+            frame->gpu[s] = (float)ms[s];
+    }
+    gpuTimers.issued[slot] = 0;
+    gpuTimers.frame[slot] = frameIndex;
 }
 
-void updateRipples() {
-    for (int i = 0; i < RIPPLES; ++i) {
-        ripples[i].radius += ripples[i].speed;
-        ripples[i].alpha = 0.8f * (1.0f - ripples[i].radius / ripples[i].maxRadius);
-        if (ripples[i].radius >= ripples[i].maxRadius || ripples[i].alpha <= 0.1f) {
-            ripples[i].radius = 0.0f;
-            ripples[i].x = ((rand() % 100) - 50) / 100.0f * 1.5f;
-            ripples[i].z = ((rand() % 100) - 50) / 100.0f * 1.5f;
-            ripples[i].alpha = 0.8f;
-        }
+void profileBeginFrame(ProfileLaneId laneId) {
+#if RAIN_PROFILER
+    ProfileLane& lane = profileLanes[laneId];
+    ProfileFrame& f = lane.current;
+    f.index = lane.frameCount;
+    f.start = nowSeconds();
+    f.total = 0.0f;
+    for (int s = 0; s < STAGE_COUNT; ++s) {
+        f.stageStart[s] = -1.0f;
+        f.cpu[s] = 0.0f;
+        f.gpu[s] = -1.0f;
     }
+    if (laneId == LANE_RENDER && gpuTimers.enabled)
+        collectGpuTimers(f.index);
+#endif
 }
 
-bool isValidSpherePosition(float newX, float newZ) {
-    if (newX >= -1.0f - sphere.radius && newX <= 1.0f + sphere.radius &&
-        newZ >= -1.0f - sphere.radius && newZ <= 1.0f + sphere.radius) {
-        return false;
+void profileEndFrame(ProfileLaneId laneId) {
+#if RAIN_PROFILER
+    ProfileLane& lane = profileLanes[laneId];
+    lane.current.total = (float)((nowSeconds() - lane.current.start) * 1000.0);
+    lane.frames[lane.frameCount % PROFILE_HISTORY] = lane.current;
+    lane.frameCount++;
+#endif
+}
+
+struct ProfileScope {
+    ProfileLaneId lane;
+    ProfileStage stage;
+    double start;
+    bool gpu;
+
+    ProfileScope(ProfileLaneId laneId, ProfileStage s, bool gpuTimed)
+        : lane(laneId), stage(s), start(nowSeconds()), gpu(gpuTimed && gpuTimers.enabled) {
+        ProfileFrame& f = profileLanes[lane].current;
+        if (f.stageStart[stage] < 0.0f)
+            f.stageStart[stage] = (float)((start - f.start) * 1000.0);
+        if (gpu) {
+            int slot = f.index % GPU_QUERY_LATENCY;
+            int q = gpuTimers.issued[slot];
+            if (q < GPU_QUERIES_PER_FRAME) {
+                gpuTimers.stage[slot][q] = stage;
+                gpuTimers.issued[slot] = q + 1;
+                gl.BeginQuery(GL_TIME_ELAPSED, gpuTimers.queries[slot][q]);
+            } else {
+                gpuTimers.missed[slot][stage] = true;
+                gpu = false;
+            }
+        }
     }
-    float dx = newX - pondX;
-    float dz = newZ - pondZ;
-    if (sqrt(dx * dx + dz * dz) <= 2.0f + sphere.radius) {
-        return false;
+
+    ~ProfileScope() {
+        ProfileFrame& f = profileLanes[lane].current;
+        if (gpu)
+            gl.EndQuery(GL_TIME_ELAPSED);
+        f.cpu[stage] += (float)((nowSeconds() - start) * 1000.0);
     }
-    return true;
+};
+
+#if RAIN_PROFILER
+#define PROFILE_CONCAT2(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT2(a, b)
+#define PROFILE_STAGE(lane, stage) ProfileScope PROFILE_CONCAT(profileScope, __LINE__)(lane, stage, false)
+#define PROFILE_GPU_STAGE(stage) ProfileScope PROFILE_CONCAT(profileScope, __LINE__)(LANE_RENDER, stage, true)
+#else
+#define PROFILE_STAGE(lane, stage)
+#define PROFILE_GPU_STAGE(stage)
+#endif
+
+float percentile(std::vector<float>& values, double p) {
+    if (values.empty())
+        return 0.0f;
+    size_t k = std::min(values.size() - 1, (size_t)(p * values.size()));
+    std::nth_element(values.begin(), values.begin() + k, values.end());
+    return values[k];
 }
 
-void drawParticles() {
-    glColor3f(0.7f, 0.7f, 1.0f);
-    glBegin(GL_LINES);
-    for (int i = 0; i < MAX_PARTICLES; ++i) {
-        float rainLength = 0.1f;
-        glVertex3f(particles[i].x, particles[i].y, particles[i].z);
-        glVertex3f(particles[i].x + rainLength, particles[i].y - rainLength * 0.5f, particles[i].z);
+struct ProfileSummary {
+    int frames;
+    float p50, p95, p99;            // Frame time, ms
+    float share[STAGE_COUNT];       // Fraction of total frame time
+    float gpuMean[STAGE_COUNT];     // ms; -1 if never measured
+};
+
+// Summarises the last 'window' frames of a lane. Read the simulation lane
+// only once its thread has stopped.
+ProfileSummary summarizeProfile(ProfileLaneId laneId, int window) {
+    static std::vector<float> totals;
+    const ProfileLane& lane = profileLanes[laneId];
+    ProfileSummary sum = {};
+    int n = (int)std::min<uint64_t>(lane.frameCount, std::min(window, PROFILE_HISTORY));
+    totals.clear();
+    double totalTime = 0.0;
+    double cpu[STAGE_COUNT] = {}, gpu[STAGE_COUNT] = {};
+    int gpuCount[STAGE_COUNT] = {};
+    for (int i = 0; i < n; ++i) {
+        const ProfileFrame& f = lane.frames[(lane.frameCount - 1 - i) % PROFILE_HISTORY];
+        totals.push_back(f.total);
+        totalTime += f.total;
+        for (int s = 0; s < STAGE_COUNT; ++s) {
+            cpu[s] += f.cpu[s];
+            if (f.gpu[s] >= 0.0f) {
+                gpu[s] += f.gpu[s];
+                gpuCount[s]++;
+            }
+        }
     }
-    glEnd();
+    sum.frames = n;
+    sum.p50 = percentile(totals, 0.50);
+    sum.p95 = percentile(totals, 0.95);
+    sum.p99 = percentile(totals, 0.99);
+    for (int s = 0; s < STAGE_COUNT; ++s) {
+        sum.share[s] = totalTime > 0.0 ? (float)(cpu[s] / totalTime) : 0.0f;
+        sum.gpuMean[s] = gpuCount[s] ? (float)(gpu[s] / gpuCount[s]) : -1.0f;
+    }
+    return sum;
 }
 
-void drawSphere(float radius, int slices, int stacks) {
-    for (int i = 0; i < stacks; ++i) {
-        float phi1 = M_PI * (float)i / stacks - M_PI / 2.0f;
-        float phi2 = M_PI * (float)(i + 1) / stacks - M_PI / 2.0f;
-        
-        glBegin(GL_TRIANGLE_STRIP);
-        for (int j = 0; j <= slices; ++j) {
-            float theta = 2.0f * M_PI * (float)j / slices;
-            
-            float x1 = radius * cos(phi1) * cos(theta);
-            float y1 = radius * sin(phi1);
-            float z1 = radius * cos(phi1) * sin(theta);
-            
-            float x2 = radius * cos(phi2) * cos(theta);
-            float y2 = radius * sin(phi2);
-            float z2 = radius * cos(phi2) * sin(theta);
-            
-            glVertex3f(x1, y1, z1);
-            glVertex3f(x2, y2, z2);
-        }
-        glEnd();
+void printProfileSummary(ProfileLaneId laneId, int window) {
+    ProfileSummary sum = summarizeProfile(laneId, window);
+    if (sum.frames == 0)
+        return;
+    printf("%s: %d frames, p50 %.2f ms, p95 %.2f ms, p99 %.2f ms\n", profileLaneNames[laneId],
+           sum.frames, sum.p50, sum.p95, sum.p99);
+    for (int s = 0; s < STAGE_COUNT; ++s) {
+        if (sum.share[s] <= 0.0f)
+            continue;
+        printf("  %-24s %5.1f%%", profileStageNames[s], sum.share[s] * 100.0f);
+        if (sum.gpuMean[s] >= 0.0f)
+            printf("  gpu %.3f ms", sum.gpuMean[s]);
+        printf("\n");
     }
+    fflush(stdout);
 }
 
-void drawClouds() {
-    glEnable(GL_BLEND);
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-    
-    for (int i = 0; i < NUM_CLOUDS; ++i) {
-        glPushMatrix();
-        glTranslatef(clouds[i].x, clouds[i].y, clouds[i].z);
-        
-        for (int j = 0; j < PUFFS_PER_CLOUD; ++j) {
-            CloudPuff* puff = &clouds[i].puffs[j];
-            glColor4f(1.0f, 1.0f, 1.0f, puff->alpha);
-            glPushMatrix();
-            glTranslatef(puff->x, puff->y, puff->z);
-            drawSphere(puff->size, 12, 12);
-            glPopMatrix();
+// "p50 4.1 / p95 6.0 / p99 8.3 ms | drawClouds 41% drawParticles 22% ..."
+std::string profileTitle(int window) {
+    ProfileSummary sum = summarizeProfile(LANE_RENDER, window);
+    int order[STAGE_COUNT];
+    for (int s = 0; s < STAGE_COUNT; ++s)
+        order[s] = s;
+    std::sort(order, order + STAGE_COUNT, [&](int a, int b) { return sum.share[a] > sum.share[b]; });
+    char buf[256];
+    int len = snprintf(buf, sizeof(buf), "p50 %.1f / p95 %.1f / p99 %.1f ms |", sum.p50, sum.p95, sum.p99);
+    for (int i = 0; i < 3 && sum.share[order[i]] > 0.0f && len < (int)sizeof(buf); ++i)
+        len += snprintf(buf + len, sizeof(buf) - len, " %s %.0f%%", profileStageNames[order[i]], sum.share[order[i]] * 100.0f);
+    return buf;
+}
+
+void writeProfileCsv(const std::string& path) {
+    FILE* f = fopen(path.c_str(), "w");
+    if (!f) {
+        std::cerr << "Cannot write " << path << std::endl;
+        return;
+    }
+    fprintf(f, "lane,frame,start_ms,total_ms");
+    for (int s = 0; s < STAGE_COUNT; ++s)
+        fprintf(f, ",%s_cpu_ms,%s_gpu_ms", profileStageNames[s], profileStageNames[s]);
+    fprintf(f, "\n");
+    double origin = -1.0;
+    for (int l = 0; l < PROFILE_LANE_COUNT; ++l) {
+        const ProfileLane& lane = profileLanes[l];
+        uint64_t first = lane.frameCount > PROFILE_HISTORY ? lane.frameCount - PROFILE_HISTORY : 0;
+        for (uint64_t i = first; i < lane.frameCount; ++i) {
+            const ProfileFrame& fr = lane.frames[i % PROFILE_HISTORY];
+            if (origin < 0.0)
+                origin = fr.start;
+            fprintf(f, "%s,%llu,%.3f,%.3f", profileLaneNames[l], (unsigned long long)fr.index,
+                    (fr.start - origin) * 1000.0, fr.total);
+            for (int s = 0; s < STAGE_COUNT; ++s)
+                fprintf(f, ",%.4f,%.4f", fr.cpu[s], fr.gpu[s]);
+            fprintf(f, "\n");
         }
-        
-        glPopMatrix();
     }
-    glDisable(GL_BLEND);
+    fclose(f);
 }
 
-void keyCallback(GLFWwindow* window, int key, int scancode, int action, int mods) {
-    if (action == GLFW_PRESS || action == GLFW_REPEAT) {
-        if (key == GLFW_KEY_O) {
-            doorOpen = true;
-            std::cout << "O key pressed: Door set to OPEN" << std::endl;
-        } else if (key == GLFW_KEY_C) {
-            doorOpen = false;
-            std::cout << "C key pressed: Door set to CLOSED" << std::endl;
-        } else if (key == GLFW_KEY_W) {
-            cameraDistance = std::max(2.0f, cameraDistance - cameraSpeed);
-            std::cout << "W key pressed: Zoom in" << std::endl;
-        } else if (key == GLFW_KEY_S) {
-            cameraDistance = std::min(20.0f, cameraDistance + cameraSpeed);
-            std::cout << "S key pressed: Zoom out" << std::endl;
-        } else if (key == GLFW_KEY_A) {
-            cameraAngleX += angleSpeed;
-            std::cout << "A key pressed: Rotate left" << std::endl;
-        } else if (key == GLFW_KEY_D) {
-            cameraAngleX -= angleSpeed;
-            std::cout << "D key pressed: Rotate right" << std::endl;
-        } else if (key == GLFW_KEY_Q) {
-            cameraAngleY = std::min(80.0f, cameraAngleY + angleSpeed);
-            std::cout << "Q key pressed: Tilt up" << std::endl;
-        } else if (key == GLFW_KEY_E) {
-            cameraAngleY = std::max(10.0f, cameraAngleY - angleSpeed);
-            std::cout << "E key pressed: Tilt down" << std::endl;
-        } else if (key == GLFW_KEY_LEFT) {
-            float newX = sphere.x - sphere.speed;
-            if (isValidSpherePosition(newX, sphere.z)) {
-                sphere.x = newX;
-                std::cout << "Left key pressed: Sphere moved to (" << sphere.x << ", " << sphere.z << ")" << std::endl;
-            }
-        } else if (key == GLFW_KEY_RIGHT) {
-            float newX = sphere.x + sphere.speed;
-            if (isValidSpherePosition(newX, sphere.z)) {
-                sphere.x = newX;
-                std::cout << "Right key pressed: Sphere moved to (" << sphere.x << ", " << sphere.z << ")" << std::endl;
-            }
-        } else if (key == GLFW_KEY_UP) {
-            float newZ = sphere.z - sphere.speed;
-            if (isValidSpherePosition(sphere.x, newZ)) {
-                sphere.z = newZ;
-                std::cout << "Up key pressed: Sphere moved to (" << sphere.x << ", " << sphere.z << ")" << std::endl;
-            }
-        } else if (key == GLFW_KEY_DOWN) {
-            float newZ = sphere.z + sphere.speed;
-            if (isValidSpherePosition(sphere.x, newZ)) {
-                sphere.z = newZ;
-                std::cout << "Down key pressed: Sphere moved to (" << sphere.x << ", " << sphere.z << ")" << std::endl;
+// Chrome trace event format; open in chrome://tracing or Perfetto.
+void writeProfileTrace(const std::string& path) {
+    FILE* f = fopen(path.c_str(), "w");
+    if (!f) {
+        std::cerr << "Cannot write " << path << std::endl;
+        return;
+    }
+    fprintf(f, "{\"traceEvents\":[\n");
+    bool first = true;
+    double origin = -1.0;
+    for (int l = 0; l < PROFILE_LANE_COUNT; ++l) {
+        const ProfileLane& lane = profileLanes[l];
+        if (lane.frameCount > 0)
+            origin = origin < 0.0 ? lane.frames[0].start : std::min(origin, lane.frames[0].start);
+    }
+    for (int l = 0; l < PROFILE_LANE_COUNT; ++l) {
+        const ProfileLane& lane = profileLanes[l];
+        fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                first ? "" : ",\n", l, profileLaneNames[l]);
+        first = false;
+        uint64_t begin = lane.frameCount > PROFILE_HISTORY ? lane.frameCount - PROFILE_HISTORY : 0;
+        for (uint64_t i = begin; i < lane.frameCount; ++i) {
+            const ProfileFrame& fr = lane.frames[i % PROFILE_HISTORY];
+            double ts = (fr.start - origin) * 1.0e6;
+            fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.1f,\"dur\":%.1f}",
+                    l == LANE_RENDER ? "frame" : "tick", l, ts, fr.total * 1000.0);
+            for (int s = 0; s < STAGE_COUNT; ++s) {
+                if (fr.stageStart[s] < 0.0f)
+                    continue;
+                fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.1f,\"dur\":%.1f",
+                        profileStageNames[s], l, ts + fr.stageStart[s] * 1000.0, fr.cpu[s] * 1000.0);
+                if (fr.gpu[s] >= 0.0f)
+                    fprintf(f, ",\"args\":{\"gpu_ms\":%.4f}", fr.gpu[s]);
+                fprintf(f, "}");
             }
         }
     }
+    fprintf(f, "\n]}\n");
+    fclose(f);
 }
 
-void drawCube(float x, float y, float z, float w, float h, float d) {
-    float hw = w / 2.0f, hh = h / 2.0f, hd = d / 2.0f;
-
-    glPushMatrix();
-    glTranslatef(x, y, z);
-    glBegin(GL_QUADS);
+void finishProfiler() {
+#if RAIN_PROFILER
+    if (showProfile) {
+        printProfileSummary(LANE_RENDER, PROFILE_HISTORY);
+        printProfileSummary(LANE_SIM, PROFILE_HISTORY);
+    }
+    if (!profileCsvPath.empty())
+        writeProfileCsv(profileCsvPath);
+    if (!profileTracePath.empty())
+        writeProfileTrace(profileTracePath);
+#endif
+    destroyGpuTimers();
+}
 
-    glVertex3f(-hw, -hh, hd);
-    glVertex3f(hw, -hh, hd);
-    glVertex3f(hw, hh, hd);
-    glVertex3f(-hw, hh, hd);
+GLuint compileShader(GLenum type, const char* source) {
+    GLuint shader = gl.CreateShader(type);
+    gl.ShaderSource(shader, 1, &source, nullptr);
+    gl.CompileShader(shader);
+    GLint ok = GL_FALSE;
+    gl.GetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+    if (!ok) {
+        char log[1024];
+        gl.GetShaderInfoLog(shader, sizeof(log), nullptr, log);
+        std::cerr << "Shader compile failed: " << log << std::endl;
+        gl.DeleteShader(shader);
+        return 0;
+    }
+    return shader;
+}
 
-    glVertex3f(-hw, -hh, -hd);
-    glVertex3f(hw, -hh, -hd);
-    glVertex3f(hw, hh, -hd);
-    glVertex3f(-hw, hh, -hd);
+// attribNames[i] is bound to attribute location i + 1; location 0 stays
+// with gl_Vertex so meshes keep feeding through glVertexPointer.
+// A null fragmentSource links a vertex-only program, which together with
+// feedbackVaryings captures the vertex shader's outputs, interleaved, with
+// transform feedback.
+GLuint linkProgram(const char* vertexSource, const char* fragmentSource, const char* const* attribNames, int attribCount,
+                   const char* const* feedbackVaryings = nullptr, int feedbackCount = 0) {
+    GLuint vs = compileShader(GL_VERTEX_SHADER, vertexSource);
+    GLuint fs = fragmentSource ? compileShader(GL_FRAGMENT_SHADER, fragmentSource) : 0;
+    if (!vs || (fragmentSource && !fs)) {
+        if (vs) gl.DeleteShader(vs);
+        if (fs) gl.DeleteShader(fs);
+        return 0;
+    }
+    GLuint program = gl.CreateProgram();
+    gl.AttachShader(program, vs);
+    if (fs)
+        gl.AttachShader(program, fs);
+    for (int i = 0; i < attribCount; ++i)
+        gl.BindAttribLocation(program, i + 1, attribNames[i]);
+    if (feedbackCount > 0)
+        gl.TransformFeedbackVaryings(program, feedbackCount, feedbackVaryings, GL_INTERLEAVED_ATTRIBS);
+    gl.LinkProgram(program);
+    gl.DeleteShader(vs);
+    if (fs)
+        gl.DeleteShader(fs);
+    GLint ok = GL_FALSE;
+    gl.GetProgramiv(program, GL_LINK_STATUS, &ok);
+    if (!ok) {
+        char log[1024];
+        gl.GetProgramInfoLog(program, sizeof(log), nullptr, log);
+        std::cerr << "Program link failed: " << log << std::endl;
+        gl.DeleteProgram(program);
+        return 0;
+    }
+    return program;
+}
 
-    glVertex3f(-hw, -hh, -hd);
-    glVertex3f(-hw, -hh, hd);
-    glVertex3f(-hw, hh, hd);
-    glVertex3f(-hw, hh, -hd);
+// Tessellation. Spheres, cylinders, the pond, ripple rings and the sky are
+// all made of points on the unit circle at a few fixed counts. Those points
+// are tabulated at compile time, so generating a vertex (every frame, in
+// immediate mode) is a few multiplies against a table rather than a cos
+// and a sin. Counts without a table fall back to calling them.
+constexpr double TESS_PI = 3.14159265358979323846;
 
-    glVertex3f(hw, -hh, -hd);
-    glVertex3f(hw, -hh, hd);
-    glVertex3f(hw, hh, hd);
-    glVertex3f(hw, hh, -hd);
+// Taylor series after reducing to [-pi, pi], to double precision.
+constexpr double constSin(double x) {
+    while (x > TESS_PI)
+        x -= 2.0 * TESS_PI;
+    while (x < -TESS_PI)
+        x += 2.0 * TESS_PI;
+    double term = x, sum = x;
+    for (int n = 1; n < 18; ++n) {
+        term *= -x * x / ((2.0 * n) * (2.0 * n + 1.0));
+        sum += term;
+    }
+    return sum;
+}
 
-    glVertex3f(-hw, hh, -hd);
-    glVertex3f(hw, hh, -hd);
-    glVertex3f(hw, hh, hd);
-    glVertex3f(-hw, hh, hd);
+constexpr double constCos(double x) {
+    return constSin(x + TESS_PI / 2.0);
+}
 
-    glVertex3f(-hw, -hh, -hd);
-    glVertex3f(hw, -hh, -hd);
-    glVertex3f(hw, -hh, hd);
-    glVertex3f(-hw, -hh, hd);
+// cos and sin at N + 1 angles.
+template<int N>
+struct TrigTable {
+    float cosines[N + 1];
+    float sines[N + 1];
+};
 
-    glEnd();
-    glPopMatrix();
+// Angles i * 2pi / N; entry N repeats entry 0, closing loops and strips.
+template<int N>
+constexpr TrigTable<N> makeUnitCircle() {
+    TrigTable<N> t = {};
+    for (int i = 0; i <= N; ++i) {
+        double angle = 2.0 * TESS_PI * (i % N) / N;
+        t.cosines[i] = (float)constCos(angle);
+        t.sines[i] = (float)constSin(angle);
+    }
+    return t;
 }
 
-void drawCylinder(float baseRadius, float topRadius, float height, int slices) {
-    float angle, x1, y1, x2, y2;
-    float sliceAngle = 2.0f * M_PI / slices;
-    
-    glBegin(GL_TRIANGLE_STRIP);
-    for (int i = 0; i <= slices; ++i) {
-        angle = i * sliceAngle;
-        x1 = cos(angle) * baseRadius;
-        y1 = sin(angle) * baseRadius;
-        x2 = cos(angle) * topRadius;
-        y2 = sin(angle) * topRadius;
-        glVertex3f(x1, 0.0f, y1);
-        glVertex3f(x2, height, y2);
+// Latitudes i * pi / N - pi / 2, south pole to north.
+template<int N>
+constexpr TrigTable<N> makeLatitudes() {
+    TrigTable<N> t = {};
+    for (int i = 0; i <= N; ++i) {
+        double angle = TESS_PI * i / N - TESS_PI / 2.0;
+        t.cosines[i] = (float)constCos(angle);
+        t.sines[i] = (float)constSin(angle);
     }
-    glEnd();
-    
+    return t;
+}
+
+template<int N>
+constexpr TrigTable<N> unitCircle = makeUnitCircle<N>();
+
+template<int N>
+constexpr TrigTable<N> unitLatitudes = makeLatitudes<N>();
+
+const int SKY_SEGMENTS = 40;  // Full circle the sky dome's rim is cut into
+
+// A sphere is 'stacks' triangle strips from the south pole up, each of
+// slices + 1 (lower, upper) vertex pairs.
+inline size_t sphereStripFloats(int slices, int stacks) {
+    return (size_t)stacks * (slices + 1) * 6;
+}
+
+template<int Slices, int Stacks>
+void sphereStripsTable(float* out, float radius) {
+    const TrigTable<Slices>& theta = unitCircle<Slices>;
+    const TrigTable<Stacks>& phi = unitLatitudes<Stacks>;
+    for (int i = 0; i < Stacks; ++i) {
+        float r1 = radius * phi.cosines[i], y1 = radius * phi.sines[i];
+        float r2 = radius * phi.cosines[i + 1], y2 = radius * phi.sines[i + 1];
+        for (int j = 0; j <= Slices; ++j) {
+            float c = theta.cosines[j], s = theta.sines[j];
+            out[0] = r1 * c;
+            out[1] = y1;
+            out[2] = r1 * s;
+            out[3] = r2 * c;
+            out[4] = y2;
+            out[5] = r2 * s;
+            out += 6;
+        }
+    }
+}
+
+// The same with cos and sin per vertex, for counts without a table; also
+// the reference for --bench-tessellation.
+void sphereStripsTrig(float* out, float radius, int slices, int stacks) {
+    for (int i = 0; i < stacks; ++i) {
+        float phi1 = M_PI * (float)i / stacks - M_PI / 2.0f;
+        float phi2 = M_PI * (float)(i + 1) / stacks - M_PI / 2.0f;
+        for (int j = 0; j <= slices; ++j) {
+            float theta = 2.0f * M_PI * (float)j / slices;
+            out[0] = radius * cos(phi1) * cos(theta);
+            out[1] = radius * sin(phi1);
+            out[2] = radius * cos(phi1) * sin(theta);
+            out[3] = radius * cos(phi2) * cos(theta);
+            out[4] = radius * sin(phi2);
+            out[5] = radius * cos(phi2) * sin(theta);
+            out += 6;
+        }
+    }
+}
+
+// Tables cover the LOD slice counts (lodSlices).
+void sphereStrips(float* out, float radius, int slices, int stacks) {
+    if (slices == stacks) {
+        switch (slices) {
+        case 24: sphereStripsTable<24, 24>(out, radius); return;
+        case 12: sphereStripsTable<12, 12>(out, radius); return;
+        case 6:  sphereStripsTable<6, 6>(out, radius); return;
+        }
+    }
+    sphereStripsTrig(out, radius, slices, stacks);
+}
+
+// segments + 1 (x, z) pairs of a circle around the origin.
+template<int Segments>
+void circlePointsTable(float* out, float radius) {
+    const TrigTable<Segments>& circle = unitCircle<Segments>;
+    for (int i = 0; i <= Segments; ++i) {
+        out[i * 2] = radius * circle.cosines[i];
+        out[i * 2 + 1] = radius * circle.sines[i];
+    }
+}
+
+void circlePointsTrig(float* out, float radius, int segments) {
+    for (int i = 0; i <= segments; ++i) {
+        float angle = i * 2.0f * M_PI / segments;
+        out[i * 2] = cos(angle) * radius;
+        out[i * 2 + 1] = sin(angle) * radius;
+    }
+}
+
+// Tables cover the LOD slice counts, the pond (POND_SEGMENTS) and the sky.
+void circlePoints(float* out, float radius, int segments) {
+    switch (segments) {
+    case 6:            circlePointsTable<6>(out, radius); return;
+    case 12:           circlePointsTable<12>(out, radius); return;
+    case 24:           circlePointsTable<24>(out, radius); return;
+    case 36:           circlePointsTable<36>(out, radius); return;
+    case SKY_SEGMENTS: circlePointsTable<SKY_SEGMENTS>(out, radius); return;
+    }
+    circlePointsTrig(out, radius, segments);
+}
+
+// Shapes are generated into this, which grows to the largest once.
+std::vector<float> tessellationScratch;
+
+float* tessellationBuffer(size_t floats) {
+    if (tessellationScratch.size() < floats)
+        tessellationScratch.resize(floats);
+    return tessellationScratch.data();
+}
+
+volatile float tessellationSink;  // Keeps the benchmark's vertices observable
+
+// Vertices per second from the table and the cos/sin versions of each
+// shape the scene draws, and the largest difference between the two.
+void runTessellationBenchmark() {
+    struct Shape {
+        const char* name;
+        int slices, stacks;   // 0 stacks for a circle
+    };
+    const Shape shapes[] = {
+        { "sphere 24x24", 24, 24 }, { "sphere 12x12", 12, 12 }, { "sphere 6x6", 6, 6 },
+        { "circle 6", 6, 0 }, { "circle 12", 12, 0 }, { "circle 24", 24, 0 },
+        { "circle 36", 36, 0 }, { "circle 40", SKY_SEGMENTS, 0 }
+    };
+    std::vector<float> trig, table;
+    std::cout << "shape         vertices  cos/sin Mvert/s  table Mvert/s  speedup  max diff" << std::endl;
+    for (size_t k = 0; k < sizeof(shapes) / sizeof(shapes[0]); ++k) {
+        const Shape& shape = shapes[k];
+        bool sphere = shape.stacks > 0;
+        size_t floats = sphere ? sphereStripFloats(shape.slices, shape.stacks) : (size_t)(shape.slices + 1) * 2;
+        long vertices = (long)(floats / (sphere ? 3 : 2));
+        trig.assign(floats, 0.0f);
+        table.assign(floats, 0.0f);
+
+        double rate[2];
+        for (int pass = 0; pass < 2; ++pass) {
+            float* out = pass == 0 ? trig.data() : table.data();
+            long generated = 0;
+            double start = nowSeconds(), elapsed = 0.0;
+            do {
+                for (int i = 0; i < 1000; ++i) {
+                    float radius = 1.0f + (i & 7) * 0.125f;
+                    if (sphere && pass == 0)
+                        sphereStripsTrig(out, radius, shape.slices, shape.stacks);
+                    else if (sphere)
+                        sphereStrips(out, radius, shape.slices, shape.stacks);
+                    else if (pass == 0)
+                        circlePointsTrig(out, radius, shape.slices);
+                    else
+                        circlePoints(out, radius, shape.slices);
+                    tessellationSink = out[i % floats];
+                }
+                generated += 1000 * vertices;
+                elapsed = nowSeconds() - start;
+            } while (elapsed < 0.5);
+            rate[pass] = generated / elapsed / 1.0e6;
+        }
+
+        float maxDiff = 0.0f;
+        if (sphere) {
+            sphereStripsTrig(trig.data(), 1.0f, shape.slices, shape.stacks);
+            sphereStrips(table.data(), 1.0f, shape.slices, shape.stacks);
+        } else {
+            circlePointsTrig(trig.data(), 1.0f, shape.slices);
+            circlePoints(table.data(), 1.0f, shape.slices);
+        }
+        for (size_t i = 0; i < floats; ++i)
+            maxDiff = std::max(maxDiff, fabsf(trig[i] - table[i]));
+        printf("%-12s  %8ld  %15.1f  %13.1f  %6.1fx  %8.2g\n", shape.name, vertices, rate[0], rate[1],
+               rate[1] / rate[0], maxDiff);
+    }
+}
+
+// Unit-sized primitives are tessellated once and then drawn scaled by the
+// current transform. Vertices live in a buffer object when the driver has
+// them and in client memory otherwise.
+enum MeshKind {
+    MESH_SPHERE,     // Radius 1, keyed by slices and stacks
+    MESH_CYLINDER,   // Base radius 1, height 1, keyed by top/base ratio and slices
+    MESH_CUBE,       // 1x1x1, centred on the origin
+    MESH_DISC,       // Radius 1 in the XZ plane, keyed by segments
+    MESH_POND_RIM,   // Bank around a radius 1 disc, keyed by segments
+    MESH_RING        // Radius 1 line loop in the XZ plane, keyed by segments
+};
+
+struct MeshKey {
+    MeshKind kind;
+    int a, b;
+    float ratio;
+
+    bool operator<(const MeshKey& o) const {
+        if (kind != o.kind) return kind < o.kind;
+        if (a != o.a) return a < o.a;
+        if (b != o.b) return b < o.b;
+        return ratio < o.ratio;
+    }
+};
+
+struct Mesh {
+    GLenum mode;
+    GLuint vbo;
+    GLsizei vertexCount;
+    std::vector<float> vertices; // xyz triples, kept for the client-array path
+};
+
+std::map<MeshKey, Mesh> meshCache;
+
+void pushVertex(std::vector<float>& v, float x, float y, float z) {
+    v.push_back(x);
+    v.push_back(y);
+    v.push_back(z);
+}
+
+// Strip pairs (a0, b0, a1, b1, ...) become independent triangles so a whole
+// sphere or cylinder side goes out in one draw call.
+void pushStripQuad(std::vector<float>& v, const float* a0, const float* b0, const float* a1, const float* b1) {
+    pushVertex(v, a0[0], a0[1], a0[2]);
+    pushVertex(v, b0[0], b0[1], b0[2]);
+    pushVertex(v, a1[0], a1[1], a1[2]);
+    pushVertex(v, a1[0], a1[1], a1[2]);
+    pushVertex(v, b0[0], b0[1], b0[2]);
+    pushVertex(v, b1[0], b1[1], b1[2]);
+}
+
+void buildSphereMesh(Mesh& mesh, int slices, int stacks) {
+    mesh.mode = GL_TRIANGLES;
+    float* strips = tessellationBuffer(sphereStripFloats(slices, stacks));
+    sphereStrips(strips, 1.0f, slices, stacks);
+    for (int i = 0; i < stacks; ++i) {
+        const float* strip = strips + (size_t)i * (slices + 1) * 6;
+        for (int j = 1; j <= slices; ++j) {
+            const float* prev = strip + (j - 1) * 6;
+            const float* p = strip + j * 6;
+            pushStripQuad(mesh.vertices, prev, prev + 3, p, p + 3);
+        }
+    }
+}
+
+void buildCylinderMesh(Mesh& mesh, float topRatio, int slices) {
+    mesh.mode = GL_TRIANGLES;
+    float* circle = tessellationBuffer((slices + 1) * 2);
+    circlePoints(circle, 1.0f, slices);
+    for (int i = 0; i < slices; ++i) {
+        float c0 = circle[i * 2], s0 = circle[i * 2 + 1];
+        float c1 = circle[i * 2 + 2], s1 = circle[i * 2 + 3];
+        float a0[3] = { c0, 0.0f, s0 };
+        float b0[3] = { c0 * topRatio, 1.0f, s0 * topRatio };
+        float a1[3] = { c1, 0.0f, s1 };
+        float b1[3] = { c1 * topRatio, 1.0f, s1 * topRatio };
+        pushStripQuad(mesh.vertices, a0, b0, a1, b1);
+
+        pushVertex(mesh.vertices, 0.0f, 1.0f, 0.0f);
+        pushVertex(mesh.vertices, b0[0], 1.0f, b0[2]);
+        pushVertex(mesh.vertices, b1[0], 1.0f, b1[2]);
+
+        pushVertex(mesh.vertices, 0.0f, 0.0f, 0.0f);
+        pushVertex(mesh.vertices, a1[0], 0.0f, a1[2]);
+        pushVertex(mesh.vertices, a0[0], 0.0f, a0[2]);
+    }
+}
+
+void buildCubeMesh(Mesh& mesh) {
+    static const float faces[6][4][3] = {
+        { { -0.5f, -0.5f,  0.5f }, {  0.5f, -0.5f,  0.5f }, {  0.5f,  0.5f,  0.5f }, { -0.5f,  0.5f,  0.5f } },
+        { { -0.5f, -0.5f, -0.5f }, {  0.5f, -0.5f, -0.5f }, {  0.5f,  0.5f, -0.5f }, { -0.5f,  0.5f, -0.5f } },
+        { { -0.5f, -0.5f, -0.5f }, { -0.5f, -0.5f,  0.5f }, { -0.5f,  0.5f,  0.5f }, { -0.5f,  0.5f, -0.5f } },
+        { {  0.5f, -0.5f, -0.5f }, {  0.5f, -0.5f,  0.5f }, {  0.5f,  0.5f,  0.5f }, {  0.5f,  0.5f, -0.5f } },
+        { { -0.5f,  0.5f, -0.5f }, {  0.5f,  0.5f, -0.5f }, {  0.5f,  0.5f,  0.5f }, { -0.5f,  0.5f,  0.5f } },
+        { { -0.5f, -0.5f, -0.5f }, {  0.5f, -0.5f, -0.5f }, {  0.5f, -0.5f,  0.5f }, { -0.5f, -0.5f,  0.5f } }
+    };
+    mesh.mode = GL_TRIANGLES;
+    for (int f = 0; f < 6; ++f) {
+        static const int corners[6] = { 0, 1, 2, 0, 2, 3 };
+        for (int c = 0; c < 6; ++c) {
+            const float* p = faces[f][corners[c]];
+            pushVertex(mesh.vertices, p[0], p[1], p[2]);
+        }
+    }
+}
+
+void buildDiscMesh(Mesh& mesh, int segments) {
+    mesh.mode = GL_TRIANGLE_FAN;
+    float* circle = tessellationBuffer((segments + 1) * 2);
+    circlePoints(circle, 1.0f, segments);
+    pushVertex(mesh.vertices, 0.0f, 0.0f, 0.0f);
+    for (int i = 0; i <= segments; ++i)
+        pushVertex(mesh.vertices, circle[i * 2], 0.0f, circle[i * 2 + 1]);
+}
+
+void buildPondRimMesh(Mesh& mesh, int segments) {
+    mesh.mode = GL_TRIANGLE_STRIP;
+    float* circle = tessellationBuffer((segments + 1) * 2);
+    circlePoints(circle, 1.0f, segments);
+    for (int i = 0; i <= segments; ++i) {
+        float x = circle[i * 2], z = circle[i * 2 + 1];
+        pushVertex(mesh.vertices, x * 1.1f, 0.05f, z * 1.1f);
+        pushVertex(mesh.vertices, x, 0.01f, z);
+    }
+}
+
+void buildRingMesh(Mesh& mesh, int segments) {
+    mesh.mode = GL_LINE_LOOP;
+    float* circle = tessellationBuffer((segments + 1) * 2);
+    circlePoints(circle, 1.0f, segments);
+    for (int j = 0; j < segments; ++j)
+        pushVertex(mesh.vertices, circle[j * 2], 0.0f, circle[j * 2 + 1]);
+}
+
+const Mesh& getMesh(MeshKind kind, int a = 0, int b = 0, float ratio = 1.0f) {
+    MeshKey key = { kind, a, b, ratio };
+    std::map<MeshKey, Mesh>::iterator it = meshCache.find(key);
+    if (it != meshCache.end())
+        return it->second;
+
+    Mesh& mesh = meshCache[key];
+    mesh.vbo = 0;
+    switch (kind) {
+    case MESH_SPHERE:   buildSphereMesh(mesh, a, b); break;
+    case MESH_CYLINDER: buildCylinderMesh(mesh, ratio, a); break;
+    case MESH_CUBE:     buildCubeMesh(mesh); break;
+    case MESH_DISC:     buildDiscMesh(mesh, a); break;
+    case MESH_POND_RIM: buildPondRimMesh(mesh, a); break;
+    case MESH_RING:     buildRingMesh(mesh, a); break;
+    }
+    mesh.vertexCount = (GLsizei)(mesh.vertices.size() / 3);
+
+    if (gl.hasBuffers) {
+        gl.GenBuffers(1, &mesh.vbo);
+        gl.BindBuffer(GL_ARRAY_BUFFER, mesh.vbo);
+        gl.BufferData(GL_ARRAY_BUFFER, mesh.vertices.size() * sizeof(float), mesh.vertices.data(), GL_STATIC_DRAW);
+        gl.BindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+    return mesh;
+}
+
+void drawMesh(const Mesh& mesh) {
+    if (mesh.vbo) {
+        gl.BindBuffer(GL_ARRAY_BUFFER, mesh.vbo);
+        glVertexPointer(3, GL_FLOAT, 0, nullptr);
+        glDrawArrays(mesh.mode, 0, mesh.vertexCount);
+        gl.BindBuffer(GL_ARRAY_BUFFER, 0);
+    } else {
+        glVertexPointer(3, GL_FLOAT, 0, mesh.vertices.data());
+        glDrawArrays(mesh.mode, 0, mesh.vertexCount);
+    }
+    renderStats.drawCalls++;
+    renderStats.vertices += mesh.vertexCount;
+}
+
+void destroyMeshCache() {
+    for (std::map<MeshKey, Mesh>::iterator it = meshCache.begin(); it != meshCache.end(); ++it) {
+        if (it->second.vbo)
+            gl.DeleteBuffers(1, &it->second.vbo);
+    }
+    meshCache.clear();
+}
+
+// Per-frame geometry (rain streaks and cloud, tree and ripple instances) is
+// written straight into one streaming buffer split into STREAM_REGIONS
+// regions, one per frame in flight. A frame writes only its own region, and
+// a fence placed after its last draw says when the GPU is done with it; by
+// the time the region comes round again two more frames have been queued,
+// so the wait is almost always already over. With GL 4.4 buffer storage the
+// whole buffer stays mapped for its lifetime. On GL 3.x each frame maps its
+// region unsynchronized once the fence has passed, or, without fences,
+// orphans the buffer. Without mapped ranges the ring is client memory.
+// Regions only grow, when a frame needs more than they hold, so streaming
+// allocates nothing once the scene has been seen.
+enum StreamMode {
+    STREAM_PERSISTENT,
+    STREAM_MAPPED,
+    STREAM_CLIENT
+};
+
+const char* streamModeNames[] = { "persistent", "mapped", "client" };
+const int STREAM_REGIONS = 3;
+const size_t STREAM_ALIGN = 64;               // Every allocation starts on a cache line
+const size_t STREAM_MIN_REGION = 1 << 20;
+
+struct StreamRing {
+    StreamMode mode;
+    GLuint vbo;
+    size_t regionSize;
+    int regions;              // STREAM_REGIONS when fences guard them, else 1
+    int region;               // Region the current frame writes
+    size_t used;              // Bytes handed out from it
+    char* mapped;             // The whole buffer, mapped for its lifetime (persistent)
+    char* base;               // The current region while writable
+    GLsync fences[STREAM_REGIONS];
+    std::vector<char> client;
+    long stalls;              // Fence waits that had to block
+};
+
+StreamRing stream = {};
+bool usePersistentMapping = true;   // false = map each frame's range instead (--no-persistent-map)
+
+void waitStreamFence(int region) {
+    GLsync& fence = stream.fences[region];
+    if (!fence)
+        return;
+    if (gl.ClientWaitSync(fence, 0, 0) == GL_TIMEOUT_EXPIRED) {
+        stream.stalls++;
+        LOG(LOG_DEBUG, "Stream region %d still in use, waiting", region);
+        while (gl.ClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED) {
+        }
+    }
+    gl.DeleteSync(fence);
+    fence = 0;
+}
+
+// The GL keeps a deleted buffer alive for draws still queued against it,
+// so resizing neither waits on the fences nor stalls.
+void releaseStreamBuffer() {
+    for (int r = 0; r < STREAM_REGIONS; ++r) {
+        if (stream.fences[r])
+            gl.DeleteSync(stream.fences[r]);
+        stream.fences[r] = 0;
+    }
+    if (stream.vbo) {
+        if (stream.mapped) {
+            gl.BindBuffer(GL_ARRAY_BUFFER, stream.vbo);
+            gl.UnmapBuffer(GL_ARRAY_BUFFER);
+            gl.BindBuffer(GL_ARRAY_BUFFER, 0);
+        }
+        gl.DeleteBuffers(1, &stream.vbo);
+    }
+    stream.vbo = 0;
+    stream.mapped = nullptr;
+}
+
+void allocateStreamBuffer(size_t regionSize) {
+    releaseStreamBuffer();
+    stream.regionSize = regionSize;
+    stream.regions = stream.mode != STREAM_CLIENT && gl.hasSync ? STREAM_REGIONS : 1;
+    stream.region = 0;
+    size_t size = regionSize * stream.regions;
+    if (stream.mode == STREAM_CLIENT) {
+        stream.client.resize(size);
+        return;
+    }
+    gl.GenBuffers(1, &stream.vbo);
+    gl.BindBuffer(GL_ARRAY_BUFFER, stream.vbo);
+    if (stream.mode == STREAM_PERSISTENT) {
+        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        gl.BufferStorage(GL_ARRAY_BUFFER, size, nullptr, flags);
+        stream.mapped = (char*)gl.MapBufferRange(GL_ARRAY_BUFFER, 0, size, flags);
+        gl.BindBuffer(GL_ARRAY_BUFFER, 0);
+        if (!stream.mapped) {
+            LOG(LOG_WARN, "Persistent mapping failed, mapping the stream buffer per frame");
+            stream.mode = STREAM_MAPPED;
+            allocateStreamBuffer(regionSize);
+        }
+        return;
+    }
+    gl.BufferData(GL_ARRAY_BUFFER, size, nullptr, GL_STREAM_DRAW);
+    gl.BindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void initStreamRing() {
+    if (gl.hasBufferStorage && usePersistentMapping)
+        stream.mode = STREAM_PERSISTENT;
+    else if (gl.hasMapBufferRange)
+        stream.mode = STREAM_MAPPED;
+    else
+        stream.mode = STREAM_CLIENT;
+    allocateStreamBuffer(STREAM_MIN_REGION);
+    LOG(LOG_DEBUG, "Streaming dynamic geometry through %s memory", streamModeNames[stream.mode]);
+}
+
+void destroyStreamRing() {
+    if (stream.regionSize > 0)
+        releaseStreamBuffer();
+    std::vector<char>().swap(stream.client);
+    stream.regionSize = 0;
+}
+
+// Opens this frame's region for up to 'bytes' of allocations, counting
+// STREAM_ALIGN of padding for each.
+void beginStreamWrites(size_t bytes) {
+    if (bytes > stream.regionSize) {
+        size_t size = stream.regionSize;
+        while (size < bytes)
+            size *= 2;
+        allocateStreamBuffer(size);
+    }
+    stream.used = 0;
+    size_t offset = stream.region * stream.regionSize;
+    if (stream.mode == STREAM_CLIENT) {
+        stream.base = stream.client.data() + offset;
+    } else if (stream.mode == STREAM_PERSISTENT) {
+        waitStreamFence(stream.region);
+        stream.base = stream.mapped + offset;
+    } else {
+        waitStreamFence(stream.region);
+        GLbitfield flags = GL_MAP_WRITE_BIT;
+        // Fenced regions need no driver sync; unfenced, the buffer is orphaned
+        flags |= stream.regions > 1 ? GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT : GL_MAP_INVALIDATE_BUFFER_BIT;
+        gl.BindBuffer(GL_ARRAY_BUFFER, stream.vbo);
+        stream.base = (char*)gl.MapBufferRange(GL_ARRAY_BUFFER, offset, stream.regionSize, flags);
+        gl.BindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+}
+
+// Returns where to write 'bytes' and sets 'offset' to its place in the
+// buffer, for streamPointer.
+void* streamAlloc(size_t bytes, size_t* offset) {
+    size_t at = (stream.used + STREAM_ALIGN - 1) & ~(STREAM_ALIGN - 1);
+    stream.used = at + bytes;
+    *offset = stream.region * stream.regionSize + at;
+    return stream.base + at;
+}
+
+void endStreamWrites() {
+    if (stream.mode == STREAM_MAPPED) {
+        gl.BindBuffer(GL_ARRAY_BUFFER, stream.vbo);
+        gl.UnmapBuffer(GL_ARRAY_BUFFER);
+        gl.BindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+    stream.base = nullptr;
+}
+
+// Called after the frame's last draw from the ring.
+void endStreamFrame() {
+    if (stream.regions == 1)
+        return;
+    stream.fences[stream.region] = gl.FenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    stream.region = (stream.region + 1) % stream.regions;
+}
+
+// Binds the ring and returns the array pointer for data at 'offset'.
+const void* streamPointer(size_t offset) {
+    if (stream.mode == STREAM_CLIENT)
+        return stream.client.data() + offset;
+    gl.BindBuffer(GL_ARRAY_BUFFER, stream.vbo);
+    return (const void*)offset;
+}
+
+// Every instance of a cached mesh is one entry in a per-instance attribute
+// buffer, so a whole batch goes out in a single draw call however many
+// clouds or trees there are.
+struct Instance {
+    float x, y, z, size;
+    float r, g, b, a;
+};
+
+// Instanced batches live in the stream ring at 'offset'; without
+// instancing they are kept in 'instances' for the CPU to walk.
+struct InstanceBatch {
+    size_t offset;
+    int count;
+    std::vector<Instance> instances;
+};
+
+const char* instanceVertexShader =
+    "#version 120\n"
+    "attribute vec4 instancePosition;\n"
+    "attribute vec4 instanceColor;\n"
+    "uniform vec3 meshScale;\n"
+    "varying vec4 color;\n"
+    "void main() {\n"
+    "    vec3 p = gl_Vertex.xyz * meshScale * instancePosition.w + instancePosition.xyz;\n"
+    "    gl_Position = gl_ModelViewProjectionMatrix * vec4(p, 1.0);\n"
+    "    color = instanceColor;\n"
+    "}\n";
+
+const char* instanceFragmentShader =
+    "#version 120\n"
+    "varying vec4 color;\n"
+    "void main() {\n"
+    "    gl_FragColor = color;\n"
+    "}\n";
+
+GLuint instanceProgram = 0;
+GLint instanceMeshScaleLocation = -1;
+// Clouds and trees are batched per level of detail; see cullScene.
+enum LodLevel {
+    LOD_HIGH,
+    LOD_MEDIUM,
+    LOD_LOW,
+    LOD_COUNT
+};
+
+const int lodSlices[LOD_COUNT] = { 24, 12, 6 };
+
+// What one camera sees of the clouds and trees. Ripples are few and drawn
+// whole, so every camera shares one batch of them.
+struct ViewBatches {
+    InstanceBatch clouds[LOD_COUNT];
+    InstanceBatch trunks[LOD_COUNT];
+    InstanceBatch canopies[LOD_COUNT];
+    size_t impostorOffset;      // Cloud billboards in the stream ring (--cloud-impostors)
+    const Instance* impostorPuffs;  // Or, with --immediate, the sorted puffs in the frame arena
+    int impostorCount;
+};
+
+ViewBatches mainBatches;
+ViewBatches* viewBatches = &mainBatches;  // The camera being culled or drawn
+InstanceBatch rippleBatch;
+
+void initInstancing() {
+    if (!gl.hasInstancing) {
+        std::cout << "Instanced arrays unavailable, drawing instances one by one" << std::endl;
+        return;
+    }
+    const char* attribs[] = { "instancePosition", "instanceColor" };
+    instanceProgram = linkProgram(instanceVertexShader, instanceFragmentShader, attribs, 2);
+    if (instanceProgram)
+        instanceMeshScaleLocation = gl.GetUniformLocation(instanceProgram, "meshScale");
+}
+
+bool instancingActive() {
+    return useInstancing && useMeshCache && instanceProgram != 0;
+}
+
+// Sizes the batch for 'count' instances and returns where to write them.
+Instance* streamInstances(InstanceBatch& batch, int count) {
+    batch.count = count;
+    if (!instancingActive()) {
+        batch.instances.resize(count);
+        return batch.instances.data();
+    }
+    batch.instances.clear();
+    return (Instance*)streamAlloc(count * sizeof(Instance), &batch.offset);
+}
+
+// meshScale applies a fixed, possibly non-uniform, scale to the mesh before
+// the per-instance size, e.g. the tree trunk's radius and height.
+void drawInstanced(const Mesh& mesh, InstanceBatch& batch, float sx, float sy, float sz) {
+    if (batch.count == 0)
+        return;
+    const char* data = (const char*)streamPointer(batch.offset);
+    gl.VertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, sizeof(Instance), data);
+    gl.VertexAttribPointer(2, 4, GL_FLOAT, GL_FALSE, sizeof(Instance), data + 4 * sizeof(float));
+    gl.EnableVertexAttribArray(1);
+    gl.EnableVertexAttribArray(2);
+    gl.VertexAttribDivisor(1, 1);
+    gl.VertexAttribDivisor(2, 1);
+
+    gl.BindBuffer(GL_ARRAY_BUFFER, mesh.vbo);
+    glVertexPointer(3, GL_FLOAT, 0, nullptr);
+
+    gl.UseProgram(instanceProgram);
+    gl.Uniform3f(instanceMeshScaleLocation, sx, sy, sz);
+    gl.DrawArraysInstanced(mesh.mode, 0, mesh.vertexCount, batch.count);
+    gl.UseProgram(0);
+
+    gl.VertexAttribDivisor(1, 0);
+    gl.VertexAttribDivisor(2, 0);
+    gl.DisableVertexAttribArray(1);
+    gl.DisableVertexAttribArray(2);
+    gl.BindBuffer(GL_ARRAY_BUFFER, 0);
+
+    renderStats.drawCalls++;
+    renderStats.vertices += mesh.vertexCount * batch.count;
+}
+
+void destroyInstancing() {
+    if (instanceProgram)
+        gl.DeleteProgram(instanceProgram);
+    instanceProgram = 0;
+}
+
+// Reserves count elements of stride bytes at offset and returns where they go.
+uint32_t placeSceneArray(size_t& offset, size_t count, size_t stride) {
+    uint32_t at = (uint32_t)offset;
+    offset += count * stride;
+    return at;
+}
+
+// Lays out a header and the arrays after it. Every record is a multiple of
+// four bytes, so the arrays stay aligned in memory and in the file.
+void packScene(const SceneHeader& counts, const std::vector<SceneHouse>& houses, const std::vector<ScenePond>& ponds,
+               const std::vector<TreePlacement>& trees, const std::vector<SceneCloud>& clouds,
+               std::vector<uint32_t>& out) {
+    SceneHeader h = counts;
+    memcpy(h.magic, SCENE_MAGIC, sizeof(h.magic));
+    h.version = SCENE_VERSION;
+    h.houseCount = (uint32_t)houses.size();
+    h.pondCount = (uint32_t)ponds.size();
+    h.treeCount = (uint32_t)trees.size();
+    h.cloudCount = (uint32_t)clouds.size();
+    size_t size = sizeof(SceneHeader);
+    h.houseOffset = placeSceneArray(size, houses.size(), sizeof(SceneHouse));
+    h.pondOffset = placeSceneArray(size, ponds.size(), sizeof(ScenePond));
+    h.treeOffset = placeSceneArray(size, trees.size(), sizeof(TreePlacement));
+    h.cloudOffset = placeSceneArray(size, clouds.size(), sizeof(SceneCloud));
+
+    out.assign(size / 4, 0);
+    char* base = (char*)out.data();
+    memcpy(base, &h, sizeof(h));
+    if (!houses.empty())
+        memcpy(base + h.houseOffset, houses.data(), houses.size() * sizeof(SceneHouse));
+    if (!ponds.empty())
+        memcpy(base + h.pondOffset, ponds.data(), ponds.size() * sizeof(ScenePond));
+    if (!trees.empty())
+        memcpy(base + h.treeOffset, trees.data(), trees.size() * sizeof(TreePlacement));
+    if (!clouds.empty())
+        memcpy(base + h.cloudOffset, clouds.data(), clouds.size() * sizeof(SceneCloud));
+}
+
+// Text scenes: one record per line, '#' starts a comment.
+//   particles N | clouds N | ripples N | trees N | ground HALF_WIDTH
+//   house X Y Z | pond X Y Z RADIUS | tree X Y Z | cloud X Y Z SPEED WIDTH
+// Tree and cloud counts left out are the number listed; particles and
+// ripples default to the built-in garden's.
+// The whole number after a count keyword, e.g. "particles 3500". Counts are
+// read as integers, since a float loses them past 2^24.
+bool parseSceneCount(const std::string& line, uint32_t* count) {
+    char keyword[32];
+    int at = 0;
+    if (sscanf(line.c_str(), " %31s %n", keyword, &at) != 1 || !isdigit((unsigned char)line[at]))
+        return false;
+    char* end;
+    errno = 0;
+    unsigned long long value = strtoull(line.c_str() + at, &end, 10);
+    while (isspace((unsigned char)*end))
+        ++end;
+    if (errno != 0 || *end || value > UINT32_MAX)
+        return false;
+    *count = (uint32_t)value;
+    return true;
+}
+
+bool compileSceneText(const char* text, const char* name, std::vector<uint32_t>& out) {
+    SceneHeader counts = {};
+    counts.particles = MAX_PARTICLES;
+    counts.ripples = RIPPLES;
+    counts.groundSize = 50.0f;
+    bool haveTrees = false, haveClouds = false;
+    std::vector<SceneHouse> houses;
+    std::vector<ScenePond> ponds;
+    std::vector<TreePlacement> trees;
+    std::vector<SceneCloud> clouds;
+
+    int lineNumber = 0;
+    for (const char* p = text; *p;) {
+        const char* end = strchr(p, '\n');
+        if (!end)
+            end = p + strlen(p);
+        std::string line(p, end);
+        p = *end ? end + 1 : end;
+        ++lineNumber;
+        line = line.substr(0, line.find('#'));
+
+        char keyword[32];
+        float v[5];
+        int args = sscanf(line.c_str(), " %31s %f %f %f %f %f", keyword, &v[0], &v[1], &v[2], &v[3], &v[4]) - 1;
+        if (args < 0)
+            continue;
+        if (strcmp(keyword, "house") == 0 && args == 3) {
+            SceneHouse house = { v[0], v[1], v[2] };
+            houses.push_back(house);
+        } else if (strcmp(keyword, "pond") == 0 && args == 4 && v[3] > 0.0f) {
+            ScenePond pond = { v[0], v[1], v[2], v[3] };
+            ponds.push_back(pond);
+        } else if (strcmp(keyword, "tree") == 0 && args == 3) {
+            TreePlacement tree = { v[0], v[1], v[2] };
+            trees.push_back(tree);
+        } else if (strcmp(keyword, "cloud") == 0 && args == 5) {
+            SceneCloud cloud = { v[0], v[1], v[2], v[3], v[4] };
+            clouds.push_back(cloud);
+        } else if (strcmp(keyword, "ground") == 0 && args == 1 && v[0] > 0.0f) {
+            counts.groundSize = v[0];
+        } else if (strcmp(keyword, "particles") == 0 && parseSceneCount(line, &counts.particles)) {
+        } else if (strcmp(keyword, "ripples") == 0 && parseSceneCount(line, &counts.ripples)) {
+        } else if (strcmp(keyword, "trees") == 0 && parseSceneCount(line, &counts.trees)) {
+            haveTrees = true;
+        } else if (strcmp(keyword, "clouds") == 0 && parseSceneCount(line, &counts.clouds)) {
+            haveClouds = true;
+        } else {
+            std::cerr << name << ":" << lineNumber << ": bad scene line: " << line << std::endl;
+            return false;
+        }
+    }
+    if (!haveTrees)
+        counts.trees = (uint32_t)trees.size();
+    if (!haveClouds)
+        counts.clouds = (uint32_t)clouds.size();
+    packScene(counts, houses, ponds, trees, clouds, out);
+    return true;
+}
+
+bool sceneArrayFits(size_t size, uint32_t offset, uint32_t count, size_t stride) {
+    return offset % 4 == 0 && offset <= size && (uint64_t)count * stride <= size - offset;
+}
+
+// Points the scene at a compiled or mapped image after checking that every
+// array lies inside it; nothing is copied.
+bool bindScene(const void* data, size_t size, const char* name) {
+    const SceneHeader* h = (const SceneHeader*)data;
+    if (size < sizeof(SceneHeader) || memcmp(h->magic, SCENE_MAGIC, sizeof(h->magic)) != 0 ||
+        h->version != SCENE_VERSION) {
+        std::cerr << name << ": not a version " << SCENE_VERSION << " scene file" << std::endl;
+        return false;
+    }
+    if (!sceneArrayFits(size, h->houseOffset, h->houseCount, sizeof(SceneHouse)) ||
+        !sceneArrayFits(size, h->pondOffset, h->pondCount, sizeof(ScenePond)) ||
+        !sceneArrayFits(size, h->treeOffset, h->treeCount, sizeof(TreePlacement)) ||
+        !sceneArrayFits(size, h->cloudOffset, h->cloudCount, sizeof(SceneCloud))) {
+        std::cerr << name << ": scene file is truncated or corrupt" << std::endl;
+        return false;
+    }
+    // Text and binary scenes meet here, so both get the same limit
+    if (h->particles > MAX_SCENE_COUNT || h->clouds > MAX_SCENE_COUNT || h->ripples > MAX_SCENE_COUNT ||
+        h->trees > MAX_SCENE_COUNT) {
+        std::cerr << name << ": scene counts are limited to " << MAX_SCENE_COUNT << std::endl;
+        return false;
+    }
+    const char* base = (const char*)data;
+    scene.header = h;
+    scene.houses = (const SceneHouse*)(base + h->houseOffset);
+    scene.ponds = (const ScenePond*)(base + h->pondOffset);
+    scene.trees = (const TreePlacement*)(base + h->treeOffset);
+    scene.clouds = (const SceneCloud*)(base + h->cloudOffset);
+    return true;
+}
+
+void unloadScene() {
+#ifndef _WIN32
+    if (scene.mapped)
+        munmap(scene.mapped, scene.mappedSize);
+#endif
+    scene = Scene();
+}
+
+void loadDefaultScene() {
+    unloadScene();
+    compileSceneText(defaultSceneText, "built-in scene", scene.owned);
+    bindScene(scene.owned.data(), scene.owned.size() * 4, "built-in scene");
+}
+
+// Binary scenes are mapped; text scenes (and binary ones where there is no
+// mmap) are read and compiled into scene.owned.
+bool loadScene(const char* path) {
+    unloadScene();
+#ifndef _WIN32
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        std::cerr << "Can't open scene " << path << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(SceneHeader)) {
+        void* map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (map != MAP_FAILED && memcmp(map, SCENE_MAGIC, sizeof(SCENE_MAGIC)) == 0) {
+            close(fd);
+            scene.mapped = map;
+            scene.mappedSize = st.st_size;
+            if (bindScene(map, st.st_size, path))
+                return true;
+            unloadScene();
+            return false;
+        }
+        if (map != MAP_FAILED)
+            munmap(map, st.st_size);
+    }
+    close(fd);
+#endif
+    FILE* f = fopen(path, "rb");
+    if (!f) {
+        std::cerr << "Can't open scene " << path << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    std::string text;
+    char chunk[65536];
+    size_t got;
+    while ((got = fread(chunk, 1, sizeof(chunk), f)) > 0)
+        text.append(chunk, got);
+    fclose(f);
+    if (text.size() >= sizeof(SCENE_MAGIC) && memcmp(text.data(), SCENE_MAGIC, sizeof(SCENE_MAGIC)) == 0) {
+        scene.owned.assign((text.size() + 3) / 4, 0);
+        memcpy(scene.owned.data(), text.data(), text.size());
+    } else if (!compileSceneText(text.c_str(), path, scene.owned)) {
+        return false;
+    }
+    return bindScene(scene.owned.data(), scene.owned.size() * 4, path);
+}
+
+// The scene's counts become the defaults; options after --scene override them.
+void applySceneCounts() {
+    numParticles = (int)scene.header->particles;
+    numClouds = (int)scene.header->clouds;
+    numRipples = (int)scene.header->ripples;
+    numTrees = (int)scene.header->trees;
+}
+
+// --compile-scene IN OUT: writes IN (text or binary) as a binary scene.
+bool compileSceneFile(const char* in, const char* out) {
+    if (!loadScene(in))
+        return false;
+    const void* data = scene.mapped ? scene.mapped : (const void*)scene.owned.data();
+    size_t size = scene.mapped ? scene.mappedSize : scene.owned.size() * 4;
+    FILE* f = fopen(out, "wb");
+    bool ok = f && fwrite(data, 1, size, f) == size;
+    if (f && fclose(f) != 0)
+        ok = false;
+    if (!ok) {
+        std::cerr << "Can't write scene " << out << std::endl;
+        return false;
+    }
+    std::cout << "Wrote " << out << ": " << scene.header->houseCount << " houses, " << scene.header->pondCount
+              << " ponds, " << scene.header->treeCount << " trees, " << scene.header->cloudCount << " clouds, "
+              << size << " bytes" << std::endl;
+    return true;
+}
+
+// Job system for the render thread's per-frame loops. Each thread has its
+// own deque of jobs: it pushes and pops at the back of its own and, when
+// that runs dry, steals from the front of another's. A thread that starts a
+// parallel loop works on it too until the loop is done. Workers start on
+// first use and stop in shutdownScene. Jobs must not touch GL.
+struct Job {
+    void (*run)(void* context, int begin, int end);
+    void* context;
+    int begin, end;
+    std::atomic<int>* pending;
+};
+
+// A double-ended queue over a circular array that only grows, and only
+// when a parallelFor queues more chunks than any before it.
+struct JobQueue {
+    std::mutex mutex;
+    std::vector<Job> ring;
+    size_t head;      // Front job
+    size_t count;
+};
+
+void pushJob(JobQueue& q, const Job& job) {
+    if (q.count == q.ring.size()) {
+        std::vector<Job> bigger(std::max<size_t>(64, q.ring.size() * 2));
+        for (size_t i = 0; i < q.count; ++i)
+            bigger[i] = q.ring[(q.head + i) % q.ring.size()];
+        q.ring.swap(bigger);
+        q.head = 0;
+    }
+    q.ring[(q.head + q.count) % q.ring.size()] = job;
+    q.count++;
+}
+
+Job popJobBack(JobQueue& q) {
+    q.count--;
+    return q.ring[(q.head + q.count) % q.ring.size()];
+}
+
+Job popJobFront(JobQueue& q) {
+    Job job = q.ring[q.head];
+    q.head = (q.head + 1) % q.ring.size();
+    q.count--;
+    return job;
+}
+
+struct JobSystem {
+    std::vector<std::thread> workers;
+    std::unique_ptr<JobQueue[]> queues;  // [0] is the render thread's, then one per worker
+    int threads;                         // Workers plus the render thread
+    std::atomic<int> queued;
+    std::atomic<bool> running;
+    std::mutex sleepMutex;
+    std::condition_variable wake;
+};
+
+int jobThreads = 0;                   // --jobs; 0 = one per core
+JobSystem jobs;
+thread_local int jobThreadIndex = 0;
+
+bool takeJob(int self, Job& job) {
+    for (int k = 0; k < jobs.threads; ++k) {
+        int victim = (self + k) % jobs.threads;
+        JobQueue& q = jobs.queues[victim];
+        std::lock_guard<std::mutex> lock(q.mutex);
+        if (q.count == 0)
+            continue;
+        job = k == 0 ? popJobBack(q) : popJobFront(q);
+        jobs.queued--;
+        return true;
+    }
+    return false;
+}
+
+void runJob(const Job& job) {
+    job.run(job.context, job.begin, job.end);
+    job.pending->fetch_sub(1, std::memory_order_release);
+}
+
+void jobWorker(int index) {
+    jobThreadIndex = index;
+    Job job;
+    while (jobs.running) {
+        if (takeJob(index, job)) {
+            runJob(job);
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(jobs.sleepMutex);
+        jobs.wake.wait(lock, [] { return jobs.queued > 0 || !jobs.running; });
+    }
+}
+
+void startJobSystem() {
+    int threads = jobThreads > 0 ? jobThreads : (int)std::thread::hardware_concurrency();
+    jobs.threads = std::max(1, threads);
+    jobs.queues.reset(new JobQueue[jobs.threads]);
+    for (int i = 0; i < jobs.threads; ++i) {
+        jobs.queues[i].ring.resize(64);
+        jobs.queues[i].head = jobs.queues[i].count = 0;
+    }
+    jobs.queued = 0;
+    jobs.running = true;
+    for (int i = 1; i < jobs.threads; ++i)
+        jobs.workers.push_back(std::thread(jobWorker, i));
+}
+
+void stopJobSystem() {
+    {
+        std::lock_guard<std::mutex> lock(jobs.sleepMutex);
+        jobs.running = false;
+    }
+    jobs.wake.notify_all();
+    for (size_t i = 0; i < jobs.workers.size(); ++i)
+        jobs.workers[i].join();
+    jobs.workers.clear();
+    jobs.queues.reset();
+    jobs.threads = 0;
+}
+
+// Calls body(begin, end) over [0, count) in chunks of grain, on every
+// thread, and returns when all chunks are done. Chunk k always covers
+// [k * grain, (k + 1) * grain), so results written per chunk come out the
+// same however the chunks were shared out.
+template <typename Body>
+void parallelFor(int count, int grain, Body body) {
+    if (count <= 0)
+        return;
+    if (!jobs.running)
+        startJobSystem();
+    int chunks = (count + grain - 1) / grain;
+    if (jobs.threads <= 1 || chunks == 1) {
+        for (int begin = 0; begin < count; begin += grain)
+            body(begin, std::min(count, begin + grain));
+        return;
+    }
+    struct Trampoline {
+        static void run(void* context, int begin, int end) {
+            (*(Body*)context)(begin, end);
+        }
+    };
+    std::atomic<int> pending(chunks);
+    JobQueue& own = jobs.queues[jobThreadIndex];
+    {
+        std::lock_guard<std::mutex> lock(own.mutex);
+        for (int k = chunks - 1; k >= 0; --k) {
+            Job job = { Trampoline::run, &body, k * grain, std::min(count, (k + 1) * grain), &pending };
+            pushJob(own, job);
+        }
+        jobs.queued += chunks;
+    }
+    {
+        std::lock_guard<std::mutex> lock(jobs.sleepMutex);
+    }
+    jobs.wake.notify_all();
+    Job job;
+    while (pending.load(std::memory_order_acquire) > 0) {
+        if (takeJob(jobThreadIndex, job))
+            runJob(job);
+        else
+            std::this_thread::yield();
+    }
+}
+
+// Static collision: the houses with their roofs and chimneys, the tree
+// trunks and canopies and the ponds are colliders binned into a uniform grid on the
+// ground plane. A query only looks at the colliders in the cells it
+// touches, so its cost stays flat as trees are added. Rain falls straight
+// down, so a drop's landing height is looked up once when it spawns and
+// the kernels just compare y against it.
+enum ColliderShape {
+    COLLIDER_BOX,
+    COLLIDER_ROOF,      // Gable over its bounds, ridge along z through the centre
+    COLLIDER_SPHERE,
+    COLLIDER_CYLINDER,  // Upright, between minY and maxY
+    COLLIDER_POND       // Flat disc at maxY that spheres can't enter
+};
+
+struct Collider {
+    ColliderShape shape;
+    float minX, minY, minZ;
+    float maxX, maxY, maxZ;
+    float x, y, z;      // Centre; the axis for cylinders and the pond
+    float radius;
+};
+
+struct CollisionGrid {
+    std::vector<Collider> colliders;
+    float originX, originZ;     // Corner of cell (0, 0)
+    float cellSize;
+    int width, depth;
+    std::vector<int> cellStart; // Cell c holds items[cellStart[c]] .. items[cellStart[c + 1] - 1]
+    std::vector<int> items;     // Collider indices
+    std::vector<float> cellTop; // Highest collider point in each cell
+};
+
+const float COLLISION_CELL_SIZE = 1.0f;
+CollisionGrid collision = {};
+
+Collider boxCollider(float x, float y, float z, float w, float h, float d) {
+    Collider c = { COLLIDER_BOX, x - w * 0.5f, y - h * 0.5f, z - d * 0.5f,
+                   x + w * 0.5f, y + h * 0.5f, z + d * 0.5f, x, y, z, 0.0f };
+    return c;
+}
+
+Collider sphereCollider(float x, float y, float z, float r) {
+    Collider c = { COLLIDER_SPHERE, x - r, y - r, z - r, x + r, y + r, z + r, x, y, z, r };
+    return c;
+}
+
+// Upright cylinder standing on (x, y, z).
+Collider cylinderCollider(float x, float y, float z, float r, float h) {
+    Collider c = { COLLIDER_CYLINDER, x - r, y, z - r, x + r, y + h, z + r, x, y, z, r };
+    return c;
+}
+
+// Same shapes as drawHouse and the tree batches. Each fills 'out' and
+// returns how many colliders it wrote.
+const int HOUSE_COLLIDERS = 3;
+const int TREE_COLLIDERS = 4;
+
+int houseColliders(const SceneHouse& h, Collider* out) {
+    out[0] = boxCollider(h.x, h.y, h.z, 2.0f, 1.5f, 2.0f);
+    out[1] = boxCollider(h.x, h.y + 1.25f, h.z, 2.0f, 1.0f, 2.0f);
+    out[1].shape = COLLIDER_ROOF;
+    out[2] = boxCollider(h.x + 0.6f, h.y + 1.2f, h.z - 0.3f, 0.3f, 0.6f, 0.3f);
+    return HOUSE_COLLIDERS;
+}
+
+int treeColliders(const TreePlacement& t, Collider* out) {
+    out[0] = cylinderCollider(t.x, t.y + 0.5f, t.z, 0.15f, 1.0f);
+    out[1] = sphereCollider(t.x, t.y + 1.5f, t.z, 0.5f);
+    out[2] = sphereCollider(t.x, t.y + 1.8f, t.z, 0.4f);
+    out[3] = sphereCollider(t.x, t.y + 2.1f, t.z, 0.3f);
+    return TREE_COLLIDERS;
+}
+
+Collider pondCollider(const ScenePond& p) {
+    Collider pond = cylinderCollider(p.x, p.y, p.z, p.radius, 0.0f);
+    pond.shape = COLLIDER_POND;
+    return pond;
+}
+
+void addSceneColliders(std::vector<Collider>& out) {
+    Collider c[TREE_COLLIDERS];
+    for (uint32_t i = 0; i < scene.header->houseCount; ++i)
+        out.insert(out.end(), c, c + houseColliders(scene.houses[i], c));
+    for (int i = 0; i < treeCount; ++i)
+        out.insert(out.end(), c, c + treeColliders(trees[i], c));
+    for (uint32_t i = 0; i < scene.header->pondCount; ++i)
+        out.push_back(pondCollider(scene.ponds[i]));
+}
+
+int collisionCellX(float x) {
+    return (int)floorf((x - collision.originX) / collision.cellSize);
+}
+
+int collisionCellZ(float z) {
+    return (int)floorf((z - collision.originZ) / collision.cellSize);
+}
+
+// initTrees rebuilds it whenever the trees change. Cells are stored flat: a counting
+// pass sizes each cell, then a second pass fills one shared index array.
+void buildCollisionGrid() {
+    CollisionGrid& g = collision;
+    g.colliders.clear();
+    addSceneColliders(g.colliders);
+    g.items.clear();
+    if (g.colliders.empty())
+        return;
+
+    float minX = g.colliders[0].minX, maxX = g.colliders[0].maxX;
+    float minZ = g.colliders[0].minZ, maxZ = g.colliders[0].maxZ;
+    for (size_t i = 1; i < g.colliders.size(); ++i) {
+        minX = std::min(minX, g.colliders[i].minX);
+        maxX = std::max(maxX, g.colliders[i].maxX);
+        minZ = std::min(minZ, g.colliders[i].minZ);
+        maxZ = std::max(maxZ, g.colliders[i].maxZ);
+    }
+    g.cellSize = COLLISION_CELL_SIZE;
+    g.originX = floorf(minX);
+    g.originZ = floorf(minZ);
+    g.width = collisionCellX(maxX) + 1;
+    g.depth = collisionCellZ(maxZ) + 1;
+
+    int cells = g.width * g.depth;
+    g.cellStart.assign(cells + 1, 0);
+    g.cellTop.assign(cells, 0.0f);
+    for (int pass = 0; pass < 2; ++pass) {
+        std::vector<int> fill(g.cellStart.begin(), g.cellStart.end() - 1);
+        for (size_t i = 0; i < g.colliders.size(); ++i) {
+            const Collider& c = g.colliders[i];
+            for (int cz = collisionCellZ(c.minZ); cz <= collisionCellZ(c.maxZ); ++cz) {
+                for (int cx = collisionCellX(c.minX); cx <= collisionCellX(c.maxX); ++cx) {
+                    int cell = cz * g.width + cx;
+                    if (pass == 0) {
+                        g.cellStart[cell + 1]++;
+                        g.cellTop[cell] = std::max(g.cellTop[cell], c.maxY);
+                    } else {
+                        g.items[fill[cell]++] = (int)i;
+                    }
+                }
+            }
+        }
+        if (pass == 0) {
+            for (int c = 0; c < cells; ++c)
+                g.cellStart[c + 1] += g.cellStart[c];
+            g.items.resize(g.cellStart[cells]);
+        }
+    }
+}
+
+// Height of the highest surface straight below (x, z), 0 being the ground.
+// hit gets the collider it belongs to, or -1 for the ground.
+float surfaceHeight(float x, float z, int* hit) {
+    const CollisionGrid& g = collision;
+    float top = 0.0f;
+    int best = -1;
+    int cx = collisionCellX(x), cz = collisionCellZ(z);
+    if (!g.items.empty() && cx >= 0 && cx < g.width && cz >= 0 && cz < g.depth) {
+        int cell = cz * g.width + cx;
+        for (int k = g.cellStart[cell]; k < g.cellStart[cell + 1]; ++k) {
+            const Collider& c = g.colliders[g.items[k]];
+            if (c.maxY <= top || x < c.minX || x > c.maxX || z < c.minZ || z > c.maxZ)
+                continue;
+            float dx = x - c.x, dz = z - c.z;
+            float y = c.maxY;
+            if (c.shape == COLLIDER_ROOF) {
+                y -= (c.maxY - c.minY) * fabsf(dx) / (c.maxX - c.x);
+            } else if (c.shape != COLLIDER_BOX) {
+                float d2 = dx * dx + dz * dz;
+                if (d2 >= c.radius * c.radius)
+                    continue;
+                if (c.shape == COLLIDER_SPHERE)
+                    y = c.y + sqrtf(c.radius * c.radius - d2);
+            }
+            if (y > top) {
+                top = y;
+                best = g.items[k];
+            }
+        }
+    }
+    if (hit)
+        *hit = best;
+    return top;
+}
+
+// Whether a sphere centred at (x, y, z) overlaps the collider. The roof is
+// tested as its bounding box.
+bool sphereHitsCollider(const Collider& c, float x, float y, float z, float r) {
+    float dx, dy, dz, reach;
+    if (c.shape == COLLIDER_BOX || c.shape == COLLIDER_ROOF) {
+        dx = x - std::max(c.minX, std::min(x, c.maxX));
+        dy = y - std::max(c.minY, std::min(y, c.maxY));
+        dz = z - std::max(c.minZ, std::min(z, c.maxZ));
+        reach = r;
+    } else if (c.shape == COLLIDER_SPHERE) {
+        dx = x - c.x;
+        dy = y - c.y;
+        dz = z - c.z;
+        reach = r + c.radius;
+    } else {
+        if (c.shape == COLLIDER_CYLINDER && (y + r < c.minY || y - r > c.maxY))
+            return false;
+        dx = x - c.x;
+        dy = 0.0f;
+        dz = z - c.z;
+        reach = r + c.radius;
+    }
+    return dx * dx + dy * dy + dz * dz < reach * reach;
+}
+
+// Whether a sphere overlaps any of the scene's colliders.
+bool sphereHitsScene(float x, float y, float z, float r) {
+    const CollisionGrid& g = collision;
+    if (g.items.empty())
+        return false;
+    int x0 = std::max(collisionCellX(x - r), 0), x1 = std::min(collisionCellX(x + r), g.width - 1);
+    int z0 = std::max(collisionCellZ(z - r), 0), z1 = std::min(collisionCellZ(z + r), g.depth - 1);
+    for (int cz = z0; cz <= z1; ++cz) {
+        for (int cx = x0; cx <= x1; ++cx) {
+            int cell = cz * g.width + cx;
+            if (g.cellTop[cell] < y - r)
+                continue;
+            for (int k = g.cellStart[cell]; k < g.cellStart[cell + 1]; ++k) {
+                if (sphereHitsCollider(g.colliders[g.items[k]], x, y, z, r))
+                    return true;
+            }
+        }
+    }
+    return false;
+}
+
+// A drop landed in a pond: start a ripple there, sized so it stays on the
+// water. Impacts while all numRipples ripples are live are dropped.
+void spawnRipple(const Collider& pond, float x, float z) {
+    float dx = x - pond.x, dz = z - pond.z;
+    float room = pond.radius - sqrtf(dx * dx + dz * dz);
+    if (room < 0.1f)
+        return;
+    Ripple* r = ripples.acquire();
+    if (!r)
+        return;
+    Ripple ripple = { x, pond.maxY + 0.02f, z, 0.0f, std::min(rngRange(rippleRng, 0.5f, 1.0f), room),
+                      rngRange(rippleRng, 0.01f, 0.02f), 0.8f };
+    *r = ripple;
+}
+
+float* allocParticleArray(int capacity) {
+    void* p = nullptr;
+#ifdef _WIN32
+    p = _aligned_malloc(capacity * sizeof(float), 32);
+#else
+    if (posix_memalign(&p, 32, capacity * sizeof(float)) != 0)
+        p = nullptr;
+#endif
+    if (!p) {
+        std::cerr << "Out of memory allocating " << capacity << " particles" << std::endl;
+        exit(-1);
+    }
+    return (float*)p;
+}
+
+void freeParticleArray(float* p) {
+#ifdef _WIN32
+    _aligned_free(p);
+#else
+    free(p);
+#endif
+}
+
+void freeParticleStore(ParticleStore& store) {
+    if (store.capacity) {
+        freeParticleArray(store.x);
+        freeParticleArray(store.y);
+        freeParticleArray(store.z);
+        freeParticleArray(store.speed);
+        freeParticleArray(store.landY);
+    }
+    store = ParticleStore();
+}
+
+void allocParticleStore(ParticleStore& store, int count) {
+    freeParticleStore(store);
+    store.count = count;
+    store.capacity = (count + PARTICLE_LANES - 1) / PARTICLE_LANES * PARTICLE_LANES;
+    if (store.capacity == 0)
+        return;
+    store.x = allocParticleArray(store.capacity);
+    store.y = allocParticleArray(store.capacity);
+    store.z = allocParticleArray(store.capacity);
+    store.speed = allocParticleArray(store.capacity);
+    store.landY = allocParticleArray(store.capacity);
+    for (int i = count; i < store.capacity; ++i) {
+        store.x[i] = store.z[i] = 0.0f;
+        store.y[i] = 1.0e30f;
+        store.speed[i] = 0.0f;
+        store.landY[i] = 0.0f;
+    }
+}
+
+void initParticleStore(ParticleStore& store, int count) {
+    allocParticleStore(store, count);
+    Rng rng = rngStream(RNG_PARTICLE_INIT);
+    store.tick = 0;
+    store.respawnKey = rngStream(RNG_PARTICLE_RESPAWN).key;
+    for (int i = 0; i < count; ++i) {
+        store.x[i] = rngRange(rng, -2.0f, 2.0f);
+        store.y[i] = rngRange(rng, 2.0f, 12.0f);
+        store.z[i] = rngRange(rng, -2.0f, 2.0f);
+        store.speed[i] = rngRange(rng, 0.02f, 0.04f);
+        store.landY[i] = surfaceHeight(store.x[i], store.z[i], nullptr);
+    }
+}
+
+// Quality governor (--budget MS): holds the frame time near a budget on
+// hosts where the full scene cannot keep up. It averages the measured
+// frame-to-frame time over windows of frames and walks a ladder of quality
+// levels: one step down as soon as a window runs over budget, one step up
+// only after several windows in a row with plenty of room, so it settles
+// instead of flapping between two levels. A level thins out what is drawn,
+// never what is simulated, so ticks, recordings and checksums are the same
+// at every level. Level 0 is the full scene, the only one without --budget.
+const int GOVERNOR_WINDOW = 30;            // Frames averaged per decision
+const double GOVERNOR_OVER = 1.10;         // Step down above budget * this
+const double GOVERNOR_UNDER = 0.70;        // Step up below budget * this...
+const int GOVERNOR_UP_WINDOWS = 4;         // ...for this many windows in a row
+
+struct QualityLevel {
+    float rain;      // Share of the rain drops drawn
+    int puffs;       // Puffs drawn per cloud
+    int lodBias;     // Sphere LODs coarser than the projected size asks for
+    float ripples;   // Share of the ripple slots drawn
+};
+
+const QualityLevel qualityLevels[] = {
+    { 1.00f, PUFFS_PER_CLOUD, 0, 1.00f },
+    { 0.75f, 5, 0, 0.75f },
+    { 0.50f, 4, 1, 0.50f },
+    { 0.35f, 3, 1, 0.35f },
+    { 0.25f, 2, 2, 0.25f },
+    { 0.15f, 1, 2, 0.10f },
+};
+const int QUALITY_LEVELS = sizeof(qualityLevels) / sizeof(qualityLevels[0]);
+
+struct QualityGovernor {
+    bool enabled;
+    double budgetMs;
+    int level;           // Index into qualityLevels; 0 is full quality
+    double lastFrame;    // When the previous frame started, 0 before the first
+    double windowSum;    // Frame times in the current window, ms
+    int windowFrames;
+    int upWindows;       // Consecutive windows under GOVERNOR_UNDER
+    double lastMeanMs;   // Mean of the last finished window
+    int changes;         // Level changes so far
+};
+
+QualityGovernor governor = {};
+
+// What the governor currently has the renderer doing.
+struct QualityStats {
+    int level, levels;
+    double frameMs, budgetMs;   // Last window's mean frame time and the target
+    int drops, puffs, lodBias, ripples;
+    int changes;
+};
+
+const QualityLevel& qualityLevel() {
+    return qualityLevels[governor.level];
+}
+
+int visibleDrops(int count) {
+    return governor.level == 0 ? count : (int)(count * qualityLevel().rain);
+}
+
+int visibleRipples(size_t count) {
+    return governor.level == 0 ? (int)count : (int)(count * qualityLevel().ripples);
+}
+
+int visiblePuffs() {
+    return std::min(qualityLevel().puffs, PUFFS_PER_CLOUD);
+}
+
+void setQualityLevel(int level) {
+    governor.level = std::max(0, std::min(level, QUALITY_LEVELS - 1));
+    governor.windowSum = 0.0;
+    governor.windowFrames = 0;
+    governor.upWindows = 0;
+}
+
+// Called once at the start of every frame with the current time.
+void governFrame(double now) {
+    if (!governor.enabled)
+        return;
+    double last = governor.lastFrame;
+    governor.lastFrame = now;
+    if (last == 0.0)
+        return;
+    governor.windowSum += (now - last) * 1000.0;
+    if (++governor.windowFrames < GOVERNOR_WINDOW)
+        return;
+
+    double mean = governor.windowSum / governor.windowFrames;
+    governor.lastMeanMs = mean;
+    governor.windowSum = 0.0;
+    governor.windowFrames = 0;
+    int level = governor.level;
+    if (mean > governor.budgetMs * GOVERNOR_OVER) {
+        governor.upWindows = 0;
+        level++;
+    } else if (mean < governor.budgetMs * GOVERNOR_UNDER) {
+        if (++governor.upWindows >= GOVERNOR_UP_WINDOWS)
+            level--;
+    } else {
+        governor.upWindows = 0;
+    }
+    level = std::max(0, std::min(level, QUALITY_LEVELS - 1));
+    if (level != governor.level) {
+        LOG(LOG_INFO, "Quality level %d -> %d: %.2f ms/frame against a %.2f ms budget",
+            governor.level, level, mean, governor.budgetMs);
+        setQualityLevel(level);
+        governor.changes++;
+    }
+}
+
+QualityStats qualityStats() {
+    QualityStats stats;
+    stats.level = governor.level;
+    stats.levels = QUALITY_LEVELS;
+    stats.frameMs = governor.lastMeanMs;
+    stats.budgetMs = governor.budgetMs;
+    stats.drops = visibleDrops(numParticles);
+    stats.puffs = visiblePuffs();
+    stats.lodBias = qualityLevel().lodBias;
+    stats.ripples = visibleRipples(ripples.size());
+    stats.changes = governor.changes;
+    return stats;
+}
+
+void printQualityStats() {
+    QualityStats q = qualityStats();
+    printf("Quality: level %d of %d, %.2f ms/frame against a %.2f ms budget, %d changes; "
+           "drawing %d drops, %d puffs per cloud, LOD bias %d, %d ripples\n",
+           q.level, q.levels - 1, q.frameMs, q.budgetMs, q.changes, q.drops, q.puffs, q.lodBias, q.ripples);
+}
+
+// GPU rain (--gpu-rain): drops live in buffer objects as (x, y, z, previous
+// y) and a vertex shader steps them with transform feedback, one GL_POINTS
+// pass per simulation tick, ping-ponging between two state buffers. Fall
+// speeds never change and sit in a third, static buffer. Each drop is
+// written twice in a row, so the newest state buffer doubles as the vertex
+// array of one GL_LINES draw: the draw shader interpolates y between the
+// two ticks and moves every odd vertex to the streak's lower end. No rain
+// data crosses from the CPU after startup. Respawns use a 32-bit hash of
+// (tick, drop), a different stream than the CPU kernels, so the two modes
+// do not match drop for drop.
+const char* rainStepVertexShader =
+    "#version 130\n"
+    "in float speed;\n"
+    "uniform uint tick;\n"
+    "uniform uint key;\n"
+    "uniform sampler2D landHeights;\n"
+    "out vec4 nextState;\n"
+    "out vec4 nextStateCopy;\n"
+    "uint hash(uint x) {\n"
+    "    x ^= x >> 16u; x *= 0x7feb352du;\n"
+    "    x ^= x >> 15u; x *= 0x846ca68bu;\n"
+    "    return x ^ (x >> 16u);\n"
+    "}\n"
+    "float unit(uint h) {\n"
+    "    return float(h >> 8u) * (1.0 / 16777216.0);\n"
+    "}\n"
+    "void main() {\n"
+    "    vec4 s = vec4(gl_Vertex.x, gl_Vertex.y - speed, gl_Vertex.z, gl_Vertex.y);\n"
+    "    float land = textureLod(landHeights, (s.xz + 4.0) / 12.0, 0.0).r;\n"
+    "    if (s.y < land) { // Respawned drops start fresh at the top\n"
+    "        uint h = hash(uint(gl_VertexID) ^ hash(tick ^ key));\n"
+    "        s = vec4(-4.0 + 12.0 * unit(h), 5.0, -4.0 + 12.0 * unit(hash(h)), 5.0);\n"
+    "    }\n"
+    "    nextState = s;\n"
+    "    nextStateCopy = s + vec4(0.1, -0.05, 0.0, -0.05);\n"
+    "    gl_Position = vec4(0.0); // Rasterizer discard is on\n"
+    "}\n";
+
+const char* rainDrawVertexShader =
+    "#version 130\n"
+    "uniform float alpha;\n"
+    "void main() {\n"
+    "    vec3 p = vec3(gl_Vertex.x, mix(gl_Vertex.w, gl_Vertex.y, alpha), gl_Vertex.z);\n"
+    "    gl_Position = gl_ModelViewProjectionMatrix * vec4(p, 1.0);\n"
+    "}\n";
+
+const char* rainDrawFragmentShader =
+    "#version 130\n"
+    "void main() {\n"
+    "    gl_FragColor = vec4(0.7, 0.7, 1.0, 1.0);\n"
+    "}\n";
+
+const int RAIN_STATE_STRIDE = 8 * sizeof(float);    // Two copies of (x, y, z, previous y)
+const int RAIN_HEIGHT_TEXELS = 256;                  // Landing heights across the respawn area, per side
+
+struct GpuRain {
+    GLuint stepProgram, drawProgram;
+    GLint tickLocation, keyLocation, alphaLocation;
+    GLuint state[2];    // Ping-pong drop state; state[current] is the newest tick
+    GLuint speeds;
+    GLuint heights;     // surfaceHeight over the respawn area, sampled by the step shader
+    int current;
+    int count;
+    uint64_t tick;      // Simulation tick state[current] holds
+    uint32_t key;
+};
+
+GpuRain gpuRain = {};
+
+bool gpuRainActive() {
+    return gpuRain.stepProgram != 0;
+}
+
+void initGpuRain() {
+    if (!useGpuRain || gpuRainActive())
+        return;
+    if (!gl.hasTransformFeedback) {
+        std::cout << "Transform feedback unavailable, simulating rain on the CPU" << std::endl;
+        return;
+    }
+    const char* attribs[] = { "speed" };
+    const char* varyings[] = { "nextState", "nextStateCopy" };
+    gpuRain.stepProgram = linkProgram(rainStepVertexShader, nullptr, attribs, 1, varyings, 2);
+    gpuRain.drawProgram = linkProgram(rainDrawVertexShader, rainDrawFragmentShader, nullptr, 0);
+    if (!gpuRain.stepProgram || !gpuRain.drawProgram) {
+        if (gpuRain.stepProgram) gl.DeleteProgram(gpuRain.stepProgram);
+        if (gpuRain.drawProgram) gl.DeleteProgram(gpuRain.drawProgram);
+        gpuRain = GpuRain();
+        std::cout << "GPU rain shaders failed, simulating rain on the CPU" << std::endl;
+        return;
+    }
+    gpuRain.tickLocation = gl.GetUniformLocation(gpuRain.stepProgram, "tick");
+    gpuRain.keyLocation = gl.GetUniformLocation(gpuRain.stepProgram, "key");
+    gpuRain.alphaLocation = gl.GetUniformLocation(gpuRain.drawProgram, "alpha");
+    gl.GenBuffers(2, gpuRain.state);
+    gl.GenBuffers(1, &gpuRain.speeds);
+    glGenTextures(1, &gpuRain.heights);
+}
+
+// The drops' landing heights, looked up through the collision grid at each
+// texel's center, so GPU drops stop on the roof, the canopies and the pond
+// like CPU ones do. The area matches the respawn range, -4 to 8 on x and z.
+void bakeRainHeights() {
+    std::vector<float> heights(RAIN_HEIGHT_TEXELS * RAIN_HEIGHT_TEXELS);
+    const float texel = 12.0f / RAIN_HEIGHT_TEXELS;
+    for (int z = 0; z < RAIN_HEIGHT_TEXELS; ++z) {
+        for (int x = 0; x < RAIN_HEIGHT_TEXELS; ++x)
+            heights[z * RAIN_HEIGHT_TEXELS + x] = surfaceHeight(-4.0f + (x + 0.5f) * texel, -4.0f + (z + 0.5f) * texel, nullptr);
+    }
+    glBindTexture(GL_TEXTURE_2D, gpuRain.heights);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, RAIN_HEIGHT_TEXELS, RAIN_HEIGHT_TEXELS, 0, GL_RED, GL_FLOAT,
+                 heights.data());
+    glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+// Uploads the same starting drops the CPU path would use.
+void seedGpuRain(int count) {
+    ParticleStore store = {};
+    initParticleStore(store, count);
+    std::vector<float> state(count * 8);
+    for (int i = 0; i < count; ++i) {
+        for (int copy = 0; copy < 2; ++copy) {
+            float* v = &state[i * 8 + copy * 4];
+            v[0] = store.x[i];
+            v[1] = store.y[i];
+            v[2] = store.z[i];
+            v[3] = store.y[i];
+            if (copy) { // Lower end of the streak
+                v[0] += 0.1f;
+                v[1] -= 0.05f;
+                v[3] -= 0.05f;
+            }
+        }
+    }
+    gl.BindBuffer(GL_ARRAY_BUFFER, gpuRain.speeds);
+    gl.BufferData(GL_ARRAY_BUFFER, count * sizeof(float), store.speed, GL_STATIC_DRAW);
+    for (int b = 0; b < 2; ++b) {
+        gl.BindBuffer(GL_ARRAY_BUFFER, gpuRain.state[b]);
+        gl.BufferData(GL_ARRAY_BUFFER, state.size() * sizeof(float), state.empty() ? nullptr : state.data(),
+                      GL_DYNAMIC_COPY);
+    }
+    gl.BindBuffer(GL_ARRAY_BUFFER, 0);
+    gpuRain.key = (uint32_t)(store.respawnKey ^ (store.respawnKey >> 32));
+    freeParticleStore(store);
+    gpuRain.count = count;
+    gpuRain.current = 0;
+    gpuRain.tick = 0;
+    bakeRainHeights();
+}
+
+// Steps the drops up to simulation tick 'tick'. A backlog longer than the
+// simulation itself would catch up on is skipped rather than replayed.
+void stepGpuRain(uint64_t tick) {
+    if (tick <= gpuRain.tick || gpuRain.count == 0) {
+        gpuRain.tick = std::max(gpuRain.tick, tick);
+        return;
+    }
+    const uint64_t maxSteps = (uint64_t)(SIM_TICK_RATE / 4);
+    if (tick - gpuRain.tick > maxSteps)
+        gpuRain.tick = tick - maxSteps;
+
+    gl.UseProgram(gpuRain.stepProgram);
+    gl.Uniform1ui(gpuRain.keyLocation, gpuRain.key);
+    gl.BindBuffer(GL_ARRAY_BUFFER, gpuRain.speeds);
+    gl.VertexAttribPointer(1, 1, GL_FLOAT, GL_FALSE, 0, (const void*)0);
+    gl.EnableVertexAttribArray(1);
+    glBindTexture(GL_TEXTURE_2D, gpuRain.heights);
+    glEnable(GL_RASTERIZER_DISCARD);
+    while (gpuRain.tick < tick) {
+        ++gpuRain.tick;
+        int src = gpuRain.current, dst = 1 - gpuRain.current;
+        gl.Uniform1ui(gpuRain.tickLocation, (GLuint)gpuRain.tick);
+        gl.BindBuffer(GL_ARRAY_BUFFER, gpuRain.state[src]);
+        glVertexPointer(4, GL_FLOAT, RAIN_STATE_STRIDE, nullptr);
+        gl.BindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, gpuRain.state[dst]);
+        gl.BeginTransformFeedback(GL_POINTS);
+        glDrawArrays(GL_POINTS, 0, gpuRain.count);
+        gl.EndTransformFeedback();
+        gpuRain.current = dst;
+    }
+    glDisable(GL_RASTERIZER_DISCARD);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    gl.DisableVertexAttribArray(1);
+    gl.BindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, 0);
+    gl.BindBuffer(GL_ARRAY_BUFFER, 0);
+    gl.UseProgram(0);
+}
+
+void drawGpuRain(float alpha) {
+    if (gpuRain.count == 0)
+        return;
+    gl.BindBuffer(GL_ARRAY_BUFFER, gpuRain.state[gpuRain.current]);
+    glVertexPointer(4, GL_FLOAT, 0, nullptr);
+    gl.UseProgram(gpuRain.drawProgram);
+    gl.Uniform1f(gpuRain.alphaLocation, alpha);
+    const int drops = visibleDrops(gpuRain.count);
+    glDrawArrays(GL_LINES, 0, 2 * drops);
+    gl.UseProgram(0);
+    gl.BindBuffer(GL_ARRAY_BUFFER, 0);
+
+    renderStats.drawCalls++;
+    renderStats.vertices += 2 * drops;
+}
+
+void destroyGpuRain() {
+    if (!gpuRainActive())
+        return;
+    gl.DeleteBuffers(2, gpuRain.state);
+    gl.DeleteBuffers(1, &gpuRain.speeds);
+    glDeleteTextures(1, &gpuRain.heights);
+    gl.DeleteProgram(gpuRain.stepProgram);
+    gl.DeleteProgram(gpuRain.drawProgram);
+    gpuRain = GpuRain();
+}
+
+void initParticles() {
+    if (gpuRainActive()) {
+        seedGpuRain(numParticles);
+        initParticleStore(particles, 0);
+        return;
+    }
+    initParticleStore(particles, numParticles);
+    particles.makesRipples = true;
+}
+
+void initClouds() {
+    placementGeneration++;
+    cloudRng = rngStream(RNG_CLOUDS);
+    clouds.assign(numClouds, Cloud());
+    int listed = std::min(numClouds, (int)scene.header->cloudCount);
+    for (int i = 0; i < listed; ++i) {
+        const SceneCloud& c = scene.clouds[i];
+        clouds[i].x = c.x;
+        clouds[i].y = c.y;
+        clouds[i].z = c.z;
+        clouds[i].speed = c.speed;
+        clouds[i].width = c.width;
+    }
+    
+    for (int i = listed; i < numClouds; ++i) {
+        clouds[i].x = rngRange(cloudRng, -15.0f, 15.0f);
+        clouds[i].y = rngRange(cloudRng, 4.0f, 8.0f);
+        clouds[i].z = rngRange(cloudRng, -15.0f, 15.0f);
+        clouds[i].speed = rngRange(cloudRng, 0.0f, 0.004f);
+        clouds[i].width = rngRange(cloudRng, 1.5f, 2.5f);
+    }
+    
+    for (int i = 0; i < numClouds; ++i) {
+        for (int j = 0; j < PUFFS_PER_CLOUD; ++j) {
+            clouds[i].puffs[j].x = rngRange(cloudRng, -0.5f, 0.5f) * clouds[i].width * 0.5f;
+            clouds[i].puffs[j].y = rngRange(cloudRng, -0.25f, 0.25f) * 0.5f;
+            clouds[i].puffs[j].z = rngRange(cloudRng, -0.5f, 0.5f) * clouds[i].width * 0.5f;
+            clouds[i].puffs[j].size = rngRange(cloudRng, 0.5f, 1.0f);
+            clouds[i].puffs[j].alpha = rngRange(cloudRng, 0.8f, 1.0f);
+        }
+    }
+}
+
+// Starts ripple i at a random spot on pond i, cycling through the ponds,
+// already grown by up to 'grown'.
+void startPondRipple(size_t i, float grown) {
+    const ScenePond& pond = scene.ponds[i % scene.header->pondCount];
+    ripples[i].x = pond.x + rngRange(rippleRng, -0.5f, 0.5f) * 0.75f * pond.radius;
+    ripples[i].y = pond.y + 0.02f;
+    ripples[i].z = pond.z + rngRange(rippleRng, -0.5f, 0.5f) * 0.75f * pond.radius;
+    ripples[i].radius = rngRange(rippleRng, 0.0f, grown);
+    ripples[i].maxRadius = rngRange(rippleRng, 0.5f, 1.0f);
+    ripples[i].speed = rngRange(rippleRng, 0.01f, 0.02f);
+    ripples[i].alpha = 0.8f;
+}
+
+void initRipples() {
+    rippleRng = rngStream(RNG_RIPPLES);
+    uint32_t ponds = scene.header->pondCount;
+    ripples.reserve(ponds ? numRipples : 0);
+    while (ripples.acquire()) {
+    }
+    for (size_t i = 0; i < ripples.size(); ++i)
+        startPondRipple(i, 0.1f);
+}
+
+// The kernels only do the fall step and find which lanes went below their
+// landing height; the rare respawns then handle the impact and pick new x/z
+// one particle at a time. The counter is (tick, index), so every kernel and
+// any split of the array across threads respawns a particle at the same
+// place.
+void respawnParticle(ParticleStore& p, int i) {
+    if (p.makesRipples && p.landY[i] > 0.0f) {
+        int hit;
+        surfaceHeight(p.x[i], p.z[i], &hit);
+        if (hit >= 0 && collision.colliders[hit].shape == COLLIDER_POND)
+            spawnRipple(collision.colliders[hit], p.x[i], p.z[i]);
+    }
+    uint64_t counter = (((uint64_t)p.tick << 32) | (uint32_t)i) * 2;
+    p.x[i] = -4.0f + 12.0f * rngUnit(rngAt(p.respawnKey, counter));
+    p.z[i] = -4.0f + 12.0f * rngUnit(rngAt(p.respawnKey, counter + 1));
+    p.landY[i] = surfaceHeight(p.x[i], p.z[i], nullptr);
+}
+
+void updateParticlesScalar(ParticleStore& p) {
+    for (int i = 0; i < p.count; ++i) {
+        p.y[i] -= p.speed[i];
+        if (p.y[i] < p.landY[i]) {
+            p.y[i] = 5.0f;
+            respawnParticle(p, i);
+        }
+    }
+}
+
+#ifdef RAIN_SSE
+void updateParticlesSSE(ParticleStore& p) {
+    float* py = p.y;
+    const float* speed = p.speed;
+    const float* landY = p.landY;
+    const int n = p.capacity;
+    const __m128 top = _mm_set1_ps(5.0f);
+    for (int i = 0; i < n; i += 4) {
+        __m128 y = _mm_sub_ps(_mm_load_ps(py + i), _mm_load_ps(speed + i));
+        __m128 fell = _mm_cmplt_ps(y, _mm_load_ps(landY + i));
+        y = _mm_or_ps(_mm_and_ps(fell, top), _mm_andnot_ps(fell, y));
+        _mm_store_ps(py + i, y);
+        int mask = _mm_movemask_ps(fell);
+        while (mask) {
+            int lane = __builtin_ctz(mask);
+            respawnParticle(p, i + lane);
+            mask &= mask - 1;
+        }
+    }
+}
+#endif
+
+#ifdef RAIN_AVX2
+__attribute__((target("avx2")))
+void updateParticlesAVX2(ParticleStore& p) {
+    float* py = p.y;
+    const float* speed = p.speed;
+    const float* landY = p.landY;
+    const int n = p.capacity;
+    const __m256 top = _mm256_set1_ps(5.0f);
+    for (int i = 0; i < n; i += 8) {
+        __m256 y = _mm256_sub_ps(_mm256_load_ps(py + i), _mm256_load_ps(speed + i));
+        __m256 fell = _mm256_cmp_ps(y, _mm256_load_ps(landY + i), _CMP_LT_OQ);
+        y = _mm256_blendv_ps(y, top, fell);
+        _mm256_store_ps(py + i, y);
+        int mask = _mm256_movemask_ps(fell);
+        if (mask)
+            _mm256_zeroupper(); // respawnParticle is SSE code
+        while (mask) {
+            int lane = __builtin_ctz(mask);
+            respawnParticle(p, i + lane);
+            mask &= mask - 1;
+        }
+    }
+}
+#endif
+
+bool particleKernelSupported(ParticleKernel kernel) {
+    switch (kernel) {
+    case KERNEL_SCALAR:
+        return true;
+#ifdef RAIN_SSE
+    case KERNEL_SSE:
+        return true;
+#endif
+#ifdef RAIN_AVX2
+    case KERNEL_AVX2:
+        return __builtin_cpu_supports("avx2");
+#endif
+    default:
+        return false;
+    }
+}
+
+ParticleKernel bestParticleKernel() {
+    for (int k = KERNEL_COUNT - 1; k > KERNEL_SCALAR; --k) {
+        if (particleKernelSupported((ParticleKernel)k))
+            return (ParticleKernel)k;
+    }
+    return KERNEL_SCALAR;
+}
+
+// --kernel NAME; false if the kernel is unknown or this CPU lacks it.
+bool selectParticleKernel(const char* name) {
+    int k = 0;
+    while (k < KERNEL_COUNT && strcmp(name, particleKernelNames[k]) != 0)
+        ++k;
+    if (k == KERNEL_COUNT || !particleKernelSupported((ParticleKernel)k)) {
+        std::cerr << "Particle kernel not available: " << name << std::endl;
+        return false;
+    }
+    particleKernel = (ParticleKernel)k;
+    return true;
+}
+
+void runParticleKernel(ParticleKernel kernel, ParticleStore& p) {
+    p.tick++;
+    switch (kernel) {
+#ifdef RAIN_SSE
+    case KERNEL_SSE:
+        updateParticlesSSE(p);
+        return;
+#endif
+#ifdef RAIN_AVX2
+    case KERNEL_AVX2:
+        updateParticlesAVX2(p);
+        return;
+#endif
+    default:
+        updateParticlesScalar(p);
+        return;
+    }
+}
+
+void updateParticles() {
+    runParticleKernel(particleKernel, particles);
+}
+
+// Times every kernel this CPU supports on the same particle set and prints
+// particles updated per second.
+void runParticleBenchmark(int count) {
+    ParticleStore store = {};
+    std::cout << "kernel  particles  Mparticles/s" << std::endl;
+    for (int k = 0; k < KERNEL_COUNT; ++k) {
+        ParticleKernel kernel = (ParticleKernel)k;
+        if (!particleKernelSupported(kernel))
+            continue;
+        initParticleStore(store, count);
+        runParticleKernel(kernel, store);
+
+        long updated = 0;
+        double start = nowSeconds(), elapsed = 0.0;
+        do {
+            for (int i = 0; i < 10; ++i)
+                runParticleKernel(kernel, store);
+            updated += 10L * count;
+            elapsed = nowSeconds() - start;
+        } while (elapsed < 1.0);
+        printf("%-6s  %9d  %12.1f\n", particleKernelNames[k], count, updated / elapsed / 1.0e6);
+    }
+    freeParticleStore(store);
+}
+
+void updateClouds() {
+    for (int i = 0; i < numClouds; ++i) {
+        clouds[i].x += clouds[i].speed;
+        if (clouds[i].x > 15.0f) {
+            clouds[i].x = -15.0f;
+            clouds[i].y = rngRange(cloudRng, 8.0f, 12.0f);
+            clouds[i].z = rngRange(cloudRng, -5.0f, 5.0f);
+        }
+    }
+}
+
+// With CPU rain, finished ripples go back to the pool, which keeps the live
+// ones packed, and drops hitting a pond start new ones. GPU drops never
+// report their impacts back, so with --gpu-rain a finished ripple starts
+// again at random on its pond instead.
+void updateRipples() {
+    const bool recycle = !particles.makesRipples;
+    for (size_t i = 0; i < ripples.size();) {
+        Ripple& r = ripples[i];
+        r.radius += r.speed;
+        r.alpha = 0.8f * (1.0f - r.radius / r.maxRadius);
+        if (r.radius >= r.maxRadius || r.alpha <= 0.1f) {
+            if (recycle) {
+                startPondRipple(i, 0.0f);
+                ++i;
+            } else {
+                ripples.release(i);
+            }
+        } else {
+            ++i;
+        }
+    }
+}
+
+bool sphereHitsTiles(float x, float y, float z, float r);  // With the world tiles, further down
+
+bool isValidSpherePosition(float newX, float newZ) {
+    float y = sphere.y + sphere.radius;
+    return !sphereHitsScene(newX, y, newZ, sphere.radius) && !sphereHitsTiles(newX, y, newZ, sphere.radius);
+}
+
+// The scene's own trees are used in place. Past those, trees are scattered
+// around the first house, kept clear of everything already standing.
+void initTrees() {
+    placementGeneration++;
+    int listed = std::min(numTrees, (int)scene.header->treeCount);
+    trees = scene.trees;
+    treeCount = listed;
+    treeStorage.clear();
+    buildCollisionGrid();
+    if (numTrees <= listed)
+        return;
+
+    treeStorage.assign(scene.trees, scene.trees + listed);
+    Rng rng = rngStream(RNG_TREES);
+    float cx, cy, cz;
+    sceneFocus(cx, cy, cz);
+    float range = 6.0f + sqrtf((float)numTrees);
+    while ((int)treeStorage.size() < numTrees) {
+        float x = cx + rngRange(rng, -range, range);
+        float z = cz + rngRange(rng, -range, range);
+        if (sphereHitsScene(x, 0.0f, z, 0.6f))
+            continue;
+        TreePlacement tree = { x, -0.5f, z }; // The trunk starts 0.5 above the placement
+        treeStorage.push_back(tree);
+    }
+    trees = treeStorage.data();
+    treeCount = (int)treeStorage.size();
+    buildCollisionGrid();
+}
+
+// The simulation owns particles, clouds, ripples, the sphere and the door,
+// and advances them in fixed ticks. After every tick it publishes a
+// snapshot; the renderer draws between the two newest snapshots it has, so
+// motion speed no longer depends on frame rate and the two can run on
+// different cores.
+struct SimSnapshot {
+    uint64_t tick;
+    double time;                 // When this tick was due, in nowSeconds() time
+    ParticleStore particles;     // x/y/z only; speed stays with the simulation
+    std::vector<Cloud> clouds;
+    std::vector<Ripple> ripples;
+    Sphere sphere;
+    bool doorOpen;
+};
+
+// Four slots: one the simulation is filling, one waiting in 'latest', and
+// the current and previous ones the renderer interpolates between. Handing
+// a slot over is a single atomic exchange on each side.
+const int SNAPSHOT_FRESH = 4;
+
+struct SnapshotExchange {
+    SimSnapshot slots[4];
+    std::atomic<int> latest;   // Slot index, | SNAPSHOT_FRESH when not yet taken
+    int back;                  // Simulation thread
+    int current, previous;     // Render thread
+};
+
+SnapshotExchange snapshots;
+uint64_t simTick = 0;
+double simNextTick = 0.0;
+std::atomic<bool> simRunning(false);
+std::thread simThread;
+
+// Door and sphere commands, decoupled from GLFW key codes so builds without
+// a window (and anything that injects input) can drive the simulation too.
+enum SimInput {
+    SIM_DOOR_OPEN,
+    SIM_DOOR_CLOSE,
+    SIM_SPHERE_LEFT,
+    SIM_SPHERE_RIGHT,
+    SIM_SPHERE_UP,
+    SIM_SPHERE_DOWN
+};
+
+// Commands travel from the window thread to the simulation through a
+// single-producer, single-consumer ring: the key callback only stores the
+// event and bumps head, and each tick drains up to tail == head. Neither
+// side locks or waits; a press that finds the ring full is dropped.
+const uint32_t SIM_INPUT_SLOTS = 256;  // Power of two
+
+struct SimInputQueue {
+    SimInput events[SIM_INPUT_SLOTS];
+    std::atomic<uint32_t> head;  // Written by the producer only
+    std::atomic<uint32_t> tail;  // Written by the consumer only
+};
+
+SimInputQueue simInputs;
+
+bool queueSimKey(SimInput input) {
+    uint32_t head = simInputs.head.load(std::memory_order_relaxed);
+    if (head - simInputs.tail.load(std::memory_order_acquire) == SIM_INPUT_SLOTS) {
+        LOG(LOG_WARN, "Input queue full, key dropped");
+        return false;
+    }
+    simInputs.events[head % SIM_INPUT_SLOTS] = input;
+    simInputs.head.store(head + 1, std::memory_order_release);
+    return true;
+}
+
+bool takeSimKey(SimInput* input) {
+    uint32_t tail = simInputs.tail.load(std::memory_order_relaxed);
+    if (tail == simInputs.head.load(std::memory_order_acquire))
+        return false;
+    *input = simInputs.events[tail % SIM_INPUT_SLOTS];
+    simInputs.tail.store(tail + 1, std::memory_order_release);
+    return true;
+}
+
+void applySimKey(SimInput key) {
+    if (key == SIM_DOOR_OPEN) {
+        doorOpen = true;
+        LOG(LOG_INFO, "O key pressed: Door set to OPEN");
+    } else if (key == SIM_DOOR_CLOSE) {
+        doorOpen = false;
+        LOG(LOG_INFO, "C key pressed: Door set to CLOSED");
+    } else if (key == SIM_SPHERE_LEFT) {
+        float newX = sphere.x - sphere.speed;
+        if (isValidSpherePosition(newX, sphere.z)) {
+            sphere.x = newX;
+            LOG(LOG_INFO, "Left key pressed: Sphere moved to (%g, %g)", sphere.x, sphere.z);
+        }
+    } else if (key == SIM_SPHERE_RIGHT) {
+        float newX = sphere.x + sphere.speed;
+        if (isValidSpherePosition(newX, sphere.z)) {
+            sphere.x = newX;
+            LOG(LOG_INFO, "Right key pressed: Sphere moved to (%g, %g)", sphere.x, sphere.z);
+        }
+    } else if (key == SIM_SPHERE_UP) {
+        float newZ = sphere.z - sphere.speed;
+        if (isValidSpherePosition(sphere.x, newZ)) {
+            sphere.z = newZ;
+            LOG(LOG_INFO, "Up key pressed: Sphere moved to (%g, %g)", sphere.x, sphere.z);
+        }
+    } else if (key == SIM_SPHERE_DOWN) {
+        float newZ = sphere.z + sphere.speed;
+        if (isValidSpherePosition(sphere.x, newZ)) {
+            sphere.z = newZ;
+            LOG(LOG_INFO, "Down key pressed: Sphere moved to (%g, %g)", sphere.x, sphere.z);
+        }
+    }
+}
+
+// Recording and replay. --record writes the seed, the scene and its counts,
+// every command with the tick it took effect on, and a checksum of the
+// simulation state every RECORD_CHECKSUM_TICKS ticks. --replay runs that
+// back headless, one tick per frame as fast as frames render, and compares
+// the checksums as it goes: the same capture every time, and a check that a
+// faster particle kernel (--kernel) still computes the same rain.
+const char RECORD_MAGIC[4] = { 'R', 'R', 'E', 'C' };
+const uint32_t RECORD_VERSION = 1;
+const uint64_t RECORD_CHECKSUM_TICKS = 60;
+const int RECORD_BUFFER_ENTRIES = 1024;
+
+enum RecordKind {
+    REC_SIM_INPUT,   // value: SimInput, applied at the start of 'tick'
+    REC_VIEW_INPUT,  // value: ViewInput, pressed after 'tick' was drawn
+    REC_CHECKSUM,    // value: simulation state once 'tick' ticks have run
+    REC_END          // tick: ticks simulated in all
+};
+
+enum RecordFlag {
+    REC_FLAG_MESH_CACHE = 1,
+    REC_FLAG_INSTANCING = 2,
+    REC_FLAG_CULLING = 4,
+    REC_FLAG_GPU_RAIN = 8,
+    REC_FLAG_CLOUD_IMPOSTORS = 16,
+    REC_FLAG_WORLD = 32             // The sphere collides with the world tiles
+};
+
+const uint32_t MAX_RECORD_SIZE = 16384;  // Largest recorded window width or height
+
+struct RecordHeader {
+    char magic[4];
+    uint32_t version;
+    uint64_t seed;
+    uint32_t particles, clouds, ripples, trees;
+    uint32_t width, height;
+    uint32_t flags;              // RecordFlag
+    uint32_t scenePathLength;    // The path follows; 0 for the built-in scene
+};
+
+struct RecordEntry {
+    uint32_t tick;
+    uint32_t kind;
+    uint64_t value;
+};
+
+// Entries collect in a fixed buffer and go out a buffer at a time, so
+// recording costs the frame loop no allocations and few writes.
+struct Recorder {
+    FILE* file;
+    std::mutex lock;             // The simulation and window threads both record
+    RecordEntry buffer[RECORD_BUFFER_ENTRIES];
+    int count;
+    bool failed;
+};
+
+struct Replay {
+    bool active;
+    std::vector<RecordEntry> entries;
+    size_t simCursor, viewCursor, checkCursor;
+    uint64_t endTick;
+    int matched, mismatched;
+    uint64_t firstMismatch;
+};
+
+Recorder recorder;
+Replay replay;
+std::string recordPath;  // --record
+std::string scenePath;   // --scene, kept for the recording's header
+
+// FNV-1a over what the simulation produced; equal hashes across builds mean
+// the scenario really was the same work.
+uint64_t hashBytes(uint64_t h, const void* data, size_t bytes) {
+    const unsigned char* p = (const unsigned char*)data;
+    for (size_t i = 0; i < bytes; ++i)
+        h = (h ^ p[i]) * 0x100000001b3ull;
+    return h;
+}
+
+uint64_t hashSimState() {
+    uint64_t h = 0xcbf29ce484222325ull;
+    h = hashBytes(h, particles.x, particles.count * sizeof(float));
+    h = hashBytes(h, particles.y, particles.count * sizeof(float));
+    h = hashBytes(h, particles.z, particles.count * sizeof(float));
+    for (size_t i = 0; i < clouds.size(); ++i)
+        h = hashBytes(h, &clouds[i].x, sizeof(float));
+    for (size_t i = 0; i < ripples.size(); ++i)
+        h = hashBytes(h, &ripples[i], sizeof(Ripple));
+    return h;
+}
+
+// Checkpoints also cover what input moves.
+uint64_t hashCheckpoint() {
+    uint64_t h = hashSimState();
+    h = hashBytes(h, &sphere.x, sizeof(float));
+    h = hashBytes(h, &sphere.z, sizeof(float));
+    unsigned char door = doorOpen ? 1 : 0;
+    return hashBytes(h, &door, 1);
+}
+
+void flushRecording() {
+    if (recorder.count && !recorder.failed &&
+        fwrite(recorder.buffer, sizeof(RecordEntry), recorder.count, recorder.file) != (size_t)recorder.count) {
+        LOG(LOG_ERROR, "Writing %s failed, recording stopped", recordPath.c_str());
+        recorder.failed = true;
+    }
+    recorder.count = 0;
+}
+
+void recordEvent(uint64_t tick, RecordKind kind, uint64_t value) {
+    if (!recorder.file)
+        return;
+    std::lock_guard<std::mutex> hold(recorder.lock);
+    RecordEntry& e = recorder.buffer[recorder.count++];
+    e.tick = (uint32_t)tick;
+    e.kind = kind;
+    e.value = value;
+    if (recorder.count == RECORD_BUFFER_ENTRIES)
+        flushRecording();
+}
+
+bool startRecording(int width, int height) {
+    if (recordPath.empty())
+        return true;
+    FILE* f = fopen(recordPath.c_str(), "wb");
+    if (!f) {
+        std::cerr << "Can't write recording " << recordPath << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    setvbuf(f, nullptr, _IONBF, 0);  // Our buffer is the only one
+    RecordHeader h = {};
+    memcpy(h.magic, RECORD_MAGIC, sizeof(h.magic));
+    h.version = RECORD_VERSION;
+    h.seed = rngSeed;
+    h.particles = numParticles;
+    h.clouds = numClouds;
+    h.ripples = numRipples;
+    h.trees = numTrees;
+    h.width = width;
+    h.height = height;
+    h.flags = (useMeshCache ? REC_FLAG_MESH_CACHE : 0) | (useInstancing ? REC_FLAG_INSTANCING : 0) |
+              (useCulling ? REC_FLAG_CULLING : 0) | (useGpuRain ? REC_FLAG_GPU_RAIN : 0) |
+              (useCloudImpostors ? REC_FLAG_CLOUD_IMPOSTORS : 0) | (useWorld ? REC_FLAG_WORLD : 0);
+    h.scenePathLength = (uint32_t)scenePath.size();
+    if (fwrite(&h, sizeof(h), 1, f) != 1 || fwrite(scenePath.data(), 1, scenePath.size(), f) != scenePath.size()) {
+        std::cerr << "Can't write recording " << recordPath << ": " << strerror(errno) << std::endl;
+        fclose(f);
+        return false;
+    }
+    recorder.count = 0;
+    recorder.failed = false;
+    recorder.file = f;
+    return true;
+}
+
+// After the simulation has stopped, so simTick is the final count.
+void stopRecording() {
+    if (!recorder.file)
+        return;
+    recordEvent(simTick, REC_END, 0);
+    flushRecording();
+    bool ok = !recorder.failed;
+    if (fclose(recorder.file) != 0)
+        ok = false;
+    recorder.file = nullptr;
+    if (ok)
+        std::cout << "Recorded " << simTick << " ticks to " << recordPath << std::endl;
+    else
+        std::cerr << "Recording " << recordPath << " is incomplete" << std::endl;
+}
+
+// Reads a recording and applies its header: seed, scene, counts and
+// toggles. Options after --replay override them, as after --scene.
+bool loadReplay(const char* path, int* width, int* height) {
+    FILE* f = fopen(path, "rb");
+    if (!f) {
+        std::cerr << "Can't open recording " << path << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    RecordHeader h;
+    bool ok = fread(&h, sizeof(h), 1, f) == 1 && memcmp(h.magic, RECORD_MAGIC, sizeof(h.magic)) == 0 &&
+              h.version == RECORD_VERSION && h.scenePathLength < 4096 &&
+              h.particles <= MAX_SCENE_COUNT && h.clouds <= MAX_SCENE_COUNT &&
+              h.ripples <= MAX_SCENE_COUNT && h.trees <= MAX_SCENE_COUNT &&
+              h.width > 0 && h.width <= MAX_RECORD_SIZE && h.height > 0 && h.height <= MAX_RECORD_SIZE;
+    std::string recordedScene(ok ? h.scenePathLength : 0, '\0');
+    ok = ok && fread(&recordedScene[0], 1, recordedScene.size(), f) == recordedScene.size();
+    RecordEntry e;
+    replay.entries.clear();
+    replay.endTick = 0;
+    while (ok && fread(&e, sizeof(e), 1, f) == 1) {
+        if (e.kind == REC_END) {
+            replay.endTick = e.tick;
+            break;
+        }
+        replay.entries.push_back(e);
+    }
+    fclose(f);
+    if (!ok || replay.endTick == 0) {
+        std::cerr << path << " is not a complete recording" << std::endl;
+        return false;
+    }
+    if (!recordedScene.empty()) {
+        if (!loadScene(recordedScene.c_str()))
+            return false;
+        scenePath = recordedScene;
+    }
+    rngSeed = h.seed;
+    numParticles = h.particles;
+    numClouds = h.clouds;
+    numRipples = h.ripples;
+    numTrees = h.trees;
+    useMeshCache = (h.flags & REC_FLAG_MESH_CACHE) != 0;
+    useInstancing = (h.flags & REC_FLAG_INSTANCING) != 0;
+    useCulling = (h.flags & REC_FLAG_CULLING) != 0;
+    useGpuRain = (h.flags & REC_FLAG_GPU_RAIN) != 0;
+    useCloudImpostors = (h.flags & REC_FLAG_CLOUD_IMPOSTORS) != 0;
+    useWorld = (h.flags & REC_FLAG_WORLD) != 0;
+    *width = h.width;
+    *height = h.height;
+    replay.simCursor = replay.viewCursor = replay.checkCursor = 0;
+    replay.matched = replay.mismatched = 0;
+    replay.active = true;
+    std::cout << "Replaying " << path << ": " << replay.endTick << " ticks, seed " << rngSeed << std::endl;
+    return true;
+}
+
+// The next entry of one kind at or after 'cursor', or null.
+const RecordEntry* nextReplayEntry(size_t& cursor, RecordKind kind) {
+    while (cursor < replay.entries.size() && replay.entries[cursor].kind != (uint32_t)kind)
+        cursor++;
+    return cursor < replay.entries.size() ? &replay.entries[cursor] : nullptr;
+}
+
+void replaySimInputs() {
+    const RecordEntry* e;
+    while ((e = nextReplayEntry(replay.simCursor, REC_SIM_INPUT)) && e->tick <= simTick) {
+        applySimKey((SimInput)e->value);
+        replay.simCursor++;
+    }
+}
+
+void checkpointSimState() {
+    if (!recorder.file && !replay.active)
+        return;
+    uint64_t hash = hashCheckpoint();
+    recordEvent(simTick, REC_CHECKSUM, hash);
+    const RecordEntry* e;
+    while (replay.active && (e = nextReplayEntry(replay.checkCursor, REC_CHECKSUM)) && e->tick <= simTick) {
+        replay.checkCursor++;
+        if (e->tick < simTick)
+            continue;
+        if (e->value == hash) {
+            replay.matched++;
+        } else if (!replay.mismatched++) {
+            replay.firstMismatch = simTick;
+            LOG(LOG_WARN, "Replay diverged from the recording at tick %llu", (unsigned long long)simTick);
+        }
+    }
+}
+
+// Reports how the replay went; false if the state ever diverged.
+bool finishReplay() {
+    if (!replay.active)
+        return true;
+    replay.active = false;
+    std::cout << "Replay checksums: " << replay.matched << " matched, " << replay.mismatched << " mismatched";
+    if (replay.mismatched)
+        std::cout << " (first at tick " << replay.firstMismatch << ")";
+    std::cout << std::endl;
+    return replay.mismatched == 0;
+}
+
+void stepSimulation() {
+    {
+        PROFILE_STAGE(LANE_SIM, STAGE_SIM_INPUT);
+        SimInput key;
+        if (replay.active) {
+            replaySimInputs();
+        } else {
+            while (takeSimKey(&key)) {
+                recordEvent(simTick, REC_SIM_INPUT, key);
+                applySimKey(key);
+            }
+        }
+    }
+    {
+        PROFILE_STAGE(LANE_SIM, STAGE_SIM_CLOUDS);
+        updateClouds();
+    }
+    {
+        PROFILE_STAGE(LANE_SIM, STAGE_SIM_PARTICLES);
+        updateParticles();
+    }
+    {
+        PROFILE_STAGE(LANE_SIM, STAGE_SIM_RIPPLES);
+        updateRipples();
+    }
+    simTick++;
+    if (simTick % RECORD_CHECKSUM_TICKS == 0)
+        checkpointSimState();
+}
+
+void writeSnapshot(SimSnapshot& snap, double time) {
+    snap.tick = simTick;
+    snap.time = time;
+    if (snap.particles.capacity != particles.capacity)
+        allocParticleStore(snap.particles, particles.count);
+    size_t bytes = particles.capacity * sizeof(float);
+    if (bytes) {
+        memcpy(snap.particles.x, particles.x, bytes);
+        memcpy(snap.particles.y, particles.y, bytes);
+        memcpy(snap.particles.z, particles.z, bytes);
+    }
+    snap.clouds = clouds;
+    // Room for a full pool, so a rise in live ripples never reallocates
+    if (snap.ripples.capacity() < ripples.slots.size())
+        snap.ripples.reserve(ripples.slots.size());
+    snap.ripples.assign(ripples.begin(), ripples.end());
+    snap.sphere = sphere;
+    snap.doorOpen = doorOpen;
+}
+
+void publishSnapshot(double time) {
+    PROFILE_STAGE(LANE_SIM, STAGE_SIM_PUBLISH);
+    writeSnapshot(snapshots.slots[snapshots.back], time);
+    snapshots.back = snapshots.latest.exchange(snapshots.back | SNAPSHOT_FRESH) & ~SNAPSHOT_FRESH;
+}
+
+// Render thread: swaps in the newest snapshot if there is one.
+bool acquireSnapshot() {
+    if (!(snapshots.latest.load() & SNAPSHOT_FRESH))
+        return false;
+    int fresh = snapshots.latest.exchange(snapshots.previous) & ~SNAPSHOT_FRESH;
+    snapshots.previous = snapshots.current;
+    snapshots.current = fresh;
+    return true;
+}
+
+void initSnapshots(double now) {
+    for (int i = 0; i < 4; ++i)
+        writeSnapshot(snapshots.slots[i], now);
+    snapshots.back = 0;
+    snapshots.latest = 1;
+    snapshots.current = 2;
+    snapshots.previous = 3;
+    simTick = 0;
+    simNextTick = now;
+}
+
+void freeSnapshots() {
+    for (int i = 0; i < 4; ++i)
+        freeParticleStore(snapshots.slots[i].particles);
+}
+
+// Runs every tick that is due by 'now'. After a stall of more than a
+// quarter second the backlog is dropped instead of simulated at once.
+void runDueTicks(double now) {
+    const double dt = 1.0 / SIM_TICK_RATE;
+    if (now - simNextTick > 0.25)
+        simNextTick = now;
+    while (simNextTick <= now) {
+        profileBeginFrame(LANE_SIM);
+        stepSimulation();
+        simNextTick += dt;
+        publishSnapshot(simNextTick);
+        profileEndFrame(LANE_SIM);
+    }
+}
+
+// One tick right now regardless of the clock, for fixed-frame runs that
+// advance exactly one tick per rendered frame.
+void runSingleTick() {
+    profileBeginFrame(LANE_SIM);
+    stepSimulation();
+    publishSnapshot(nowSeconds());
+    profileEndFrame(LANE_SIM);
+}
+
+void simulationLoop() {
+    while (simRunning.load()) {
+        runDueTicks(nowSeconds());
+        double wait = simNextTick - nowSeconds();
+        if (wait > 0.0)
+            std::this_thread::sleep_for(std::chrono::duration<double>(wait));
+    }
+}
+
+void startSimulation() {
+    initSnapshots(nowSeconds());
+    if (useSimThread) {
+        simRunning = true;
+        simThread = std::thread(simulationLoop);
+    }
+}
+
+void stopSimulation() {
+    if (simThread.joinable()) {
+        simRunning = false;
+        simThread.join();
+    }
+}
+
+// What the renderer draws this frame: the snapshot pair and everything
+// that is cheap to interpolate up front. Particles are interpolated while
+// their vertices are emitted.
+struct RenderView {
+    const SimSnapshot* prev;
+    const SimSnapshot* cur;
+    float alpha;
+    std::vector<Cloud> clouds;
+    std::vector<Ripple> ripples;
+    Sphere sphere;
+    bool doorOpen;
+};
+
+RenderView renderView;
+
+inline float lerp(float a, float b, float t) {
+    return a + (b - a) * t;
+}
+
+void buildRenderView(double renderTime) {
+    PROFILE_STAGE(LANE_RENDER, STAGE_VIEW);
+    acquireSnapshot();
+    const SimSnapshot& prev = snapshots.slots[snapshots.previous];
+    const SimSnapshot& cur = snapshots.slots[snapshots.current];
+    float t = 1.0f;
+    if (cur.time > prev.time)
+        t = (float)std::min(1.0, std::max(0.0, (renderTime - prev.time) / (cur.time - prev.time)));
+
+    renderView.prev = &prev;
+    renderView.cur = &cur;
+    renderView.alpha = t;
+
+    renderView.clouds = cur.clouds;
+    if (prev.clouds.size() == cur.clouds.size()) {
+        for (size_t i = 0; i < cur.clouds.size(); ++i) {
+            // A cloud that wrapped around jumps; don't sweep it across the sky
+            if (cur.clouds[i].x < prev.clouds[i].x)
+                continue;
+            renderView.clouds[i].x = lerp(prev.clouds[i].x, cur.clouds[i].x, t);
+        }
+    }
+
+    // Ripples grow at a constant speed, so the newest snapshot alone says
+    // where they were a fraction of a tick earlier; no need to pair them up
+    // with the previous one, whose order retiring has shuffled.
+    if (renderView.ripples.capacity() < cur.ripples.capacity())
+        renderView.ripples.reserve(cur.ripples.capacity());
+    renderView.ripples = cur.ripples;
+    for (size_t i = 0; i < renderView.ripples.size(); ++i) {
+        Ripple& r = renderView.ripples[i];
+        r.radius = std::max(0.0f, r.radius - r.speed * (1.0f - t));
+        r.alpha = 0.8f * (1.0f - r.radius / r.maxRadius);
+    }
+
+    renderView.sphere = cur.sphere;
+    renderView.sphere.x = lerp(prev.sphere.x, cur.sphere.x, t);
+    renderView.sphere.z = lerp(prev.sphere.z, cur.sphere.z, t);
+    renderView.doorOpen = cur.doorOpen;
+}
+
+// With the mesh cache on, rain streaks are written into the stream ring,
+// each drop's two vertices at a fixed place, by chunks on the job system;
+// the render thread then draws them in one call.
+const int RAIN_GRAIN = 16384;
+float* rainVertices = nullptr;   // This frame's streaks while streamFrame writes them
+size_t rainOffset = 0;
+
+void buildRainVertices(int begin, int end) {
+    const ParticleStore& prev = renderView.prev->particles;
+    const ParticleStore& cur = renderView.cur->particles;
+    const float t = renderView.alpha;
+    const float rainLength = 0.1f;
+    float* v = rainVertices + begin * 6;
+    for (int i = begin; i < end; ++i, v += 6) {
+        float y = cur.y[i];
+        if (y <= prev.y[i]) // Respawned drops start fresh at the top
+            y = lerp(prev.y[i], y, t);
+        v[0] = cur.x[i];
+        v[1] = y;
+        v[2] = cur.z[i];
+        v[3] = cur.x[i] + rainLength;
+        v[4] = y - rainLength * 0.5f;
+        v[5] = cur.z[i];
+    }
+}
+
+void drawParticles() {
+    if (gpuRainActive()) {
+        drawGpuRain(renderView.alpha);
+        return;
+    }
+    glColor3f(0.7f, 0.7f, 1.0f);
+    const ParticleStore& prev = renderView.prev->particles;
+    const ParticleStore& cur = renderView.cur->particles;
+    const int drops = visibleDrops(cur.count);
+    if (useMeshCache) {
+        glVertexPointer(3, GL_FLOAT, 0, streamPointer(rainOffset));
+        glDrawArrays(GL_LINES, 0, 2 * drops);
+        if (gl.hasBuffers)
+            gl.BindBuffer(GL_ARRAY_BUFFER, 0);
+    } else {
+        glBegin(GL_LINES);
+        const float t = renderView.alpha;
+        for (int i = 0; i < drops; ++i) {
+            float rainLength = 0.1f;
+            float y = cur.y[i];
+            if (y <= prev.y[i]) // Respawned drops start fresh at the top
+                y = lerp(prev.y[i], y, t);
+            glVertex3f(cur.x[i], y, cur.z[i]);
+            glVertex3f(cur.x[i] + rainLength, y - rainLength * 0.5f, cur.z[i]);
+        }
+        glEnd();
+    }
+    renderStats.drawCalls++;
+    renderStats.vertices += 2 * drops;
+}
+
+void drawSphereImmediate(float radius, int slices, int stacks) {
+    float* strips = tessellationBuffer(sphereStripFloats(slices, stacks));
+    sphereStrips(strips, radius, slices, stacks);
+    const float* v = strips;
+    for (int i = 0; i < stacks; ++i) {
+        glBegin(GL_TRIANGLE_STRIP);
+        for (int j = 0; j <= slices; ++j, v += 6) {
+            glVertex3fv(v);
+            glVertex3fv(v + 3);
+        }
+        glEnd();
+        renderStats.drawCalls++;
+        renderStats.vertices += 2 * (slices + 1);
+    }
+}
+
+void drawSphere(float radius, int slices, int stacks) {
+    if (!useMeshCache) {
+        drawSphereImmediate(radius, slices, stacks);
+        return;
+    }
+    glPushMatrix();
+    glScalef(radius, radius, radius);
+    drawMesh(getMesh(MESH_SPHERE, slices, stacks));
+    glPopMatrix();
+}
+
+// Scratch memory for one frame. Allocations bump an offset through one
+// block, and resetFrameArena rewinds it at the start of the next frame, so
+// per-frame lists cost no heap traffic and need no freeing. A frame that
+// outgrows the block takes overflow blocks from the heap; the next reset
+// replaces them all with one block that holds the whole frame, so the arena
+// settles on the largest frame it has seen. Only the render thread
+// allocates; job threads may write into what it handed out.
+const size_t ARENA_ALIGN = 64;   // Lists filled by different threads never share a cache line
+const size_t ARENA_MIN_BLOCK = 1 << 16;
+
+struct FrameArena {
+    char* block;
+    size_t size;
+    size_t used;
+    std::vector<char*> overflow;
+    size_t overflowBytes;
+};
+
+FrameArena frameArena = {};
+
+void* arenaAllocBytes(size_t bytes) {
+    size_t at = (frameArena.used + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+    if (at + bytes <= frameArena.size) {
+        frameArena.used = at + bytes;
+        return frameArena.block + at;
+    }
+    char* p = (char*)operator new(bytes ? bytes : 1, std::align_val_t(ARENA_ALIGN));
+    frameArena.overflow.push_back(p);
+    frameArena.overflowBytes += bytes + ARENA_ALIGN;
+    return p;
+}
+
+// Uninitialised room for count T; T must be trivially destructible.
+template <typename T>
+T* arenaAlloc(size_t count) {
+    return (T*)arenaAllocBytes(count * sizeof(T));
+}
+
+void freeArenaBlocks() {
+    for (size_t i = 0; i < frameArena.overflow.size(); ++i)
+        operator delete(frameArena.overflow[i], std::align_val_t(ARENA_ALIGN));
+    frameArena.overflow.clear();
+    if (frameArena.block)
+        operator delete(frameArena.block, std::align_val_t(ARENA_ALIGN));
+    frameArena.block = nullptr;
+    frameArena.size = 0;
+}
+
+void resetFrameArena() {
+    if (frameArena.overflowBytes > 0) {
+        size_t size = std::max(frameArena.size, ARENA_MIN_BLOCK);
+        while (size < frameArena.used + frameArena.overflowBytes)
+            size *= 2;
+        freeArenaBlocks();
+        frameArena.block = (char*)operator new(size, std::align_val_t(ARENA_ALIGN));
+        frameArena.size = size;
+        frameArena.overflowBytes = 0;
+    }
+    frameArena.used = 0;
+}
+
+void destroyFrameArena() {
+    freeArenaBlocks();
+    std::vector<char*>().swap(frameArena.overflow);
+    frameArena.used = frameArena.overflowBytes = 0;
+}
+
+// Culling and level of detail. renderFrame builds the view frustum from
+// the projection and its look-at matrix, then cullScene sorts the cloud
+// puffs and tree parts that are in view into per-LOD instance batches, so
+// draw cost follows what is on screen rather than the size of the garden.
+// A sphere's tessellation is picked by its projected radius.
+const float lodPixels[LOD_COUNT - 1] = { 60.0f, 12.0f }; // Projected radius needed for LOD_HIGH, LOD_MEDIUM
+
+struct Frustum {
+    float planes[6][4];     // Inside when a*x + b*y + c*z + d >= 0, with (a, b, c) unit length
+    float eyeX, eyeY, eyeZ;
+    float pixelsPerUnit;    // Projected radius in pixels of a unit sphere at distance 1
+    float right[3], up[3];  // The camera's axes in world space, for billboards
+    float forward[3];
+};
+
+float projectionMatrix[16];  // Set by setProjection
+int viewportHeight = 1;
+Frustum viewFrustum;
+
+// view is the column-major look-at matrix. The planes are sums and
+// differences of the rows of projection * view.
+void buildFrustum(const float* view, float eyeX, float eyeY, float eyeZ) {
+    float clip[16];
+    for (int c = 0; c < 4; ++c) {
+        for (int r = 0; r < 4; ++r) {
+            float sum = 0.0f;
+            for (int k = 0; k < 4; ++k)
+                sum += projectionMatrix[k * 4 + r] * view[c * 4 + k];
+            clip[c * 4 + r] = sum;
+        }
+    }
+    for (int p = 0; p < 6; ++p) {
+        float* plane = viewFrustum.planes[p];
+        float sign = (p & 1) ? -1.0f : 1.0f;
+        for (int c = 0; c < 4; ++c)
+            plane[c] = clip[c * 4 + 3] + sign * clip[c * 4 + p / 2];
+        float len = sqrtf(plane[0] * plane[0] + plane[1] * plane[1] + plane[2] * plane[2]);
+        for (int c = 0; c < 4; ++c)
+            plane[c] /= len;
+    }
+    viewFrustum.eyeX = eyeX;
+    viewFrustum.eyeY = eyeY;
+    viewFrustum.eyeZ = eyeZ;
+    viewFrustum.pixelsPerUnit = projectionMatrix[5] * viewportHeight * 0.5f;
+    for (int c = 0; c < 3; ++c) {
+        viewFrustum.right[c] = view[c * 4];
+        viewFrustum.up[c] = view[c * 4 + 1];
+        viewFrustum.forward[c] = -view[c * 4 + 2];
+    }
+}
+
+bool sphereInView(float x, float y, float z, float r) {
+    if (!useCulling)
+        return true;
+    for (int p = 0; p < 6; ++p) {
+        const float* plane = viewFrustum.planes[p];
+        if (plane[0] * x + plane[1] * y + plane[2] * z + plane[3] < -r)
+            return false;
+    }
+    return true;
+}
+
+int sphereLod(float x, float y, float z, float r) {
+    if (!useCulling)
+        return std::min(LOD_MEDIUM + qualityLevel().lodBias, (int)LOD_LOW);
+    float dx = x - viewFrustum.eyeX, dy = y - viewFrustum.eyeY, dz = z - viewFrustum.eyeZ;
+    float dist = std::max(sqrtf(dx * dx + dy * dy + dz * dz), 0.1f);
+    float pixels = r * viewFrustum.pixelsPerUnit / dist;
+    int lod = LOD_LOW;
+    if (pixels >= lodPixels[LOD_HIGH])
+        lod = LOD_HIGH;
+    else if (pixels >= lodPixels[LOD_MEDIUM])
+        lod = LOD_MEDIUM;
+    return std::min(lod + qualityLevel().lodBias, (int)LOD_LOW);
+}
+
+// Transform hierarchy. Everything placed relative to something else (a
+// house's door, windows and chimney, a cloud's puffs, a tree's trunk and
+// canopy) is a node in one flat array. A node knows only its parent's
+// index, and parents come before their children. Each node keeps a local
+// and a world matrix, both column-major as GL takes them. A pass in index
+// order recomputes the world matrix of nodes whose local matrix changed
+// and of their descendants, and skips the rest. Most of the garden never
+// moves, so only drifting clouds, the sphere and, when it swings, each door
+// are recomputed. The immediate-mode draws load these matrices instead of
+// rebuilding them with nested glTranslatef/glRotatef calls, and culling
+// reads positions from them.
+struct alignas(16) Mat4 {
+    float m[16];
+};
+
+const Mat4 MAT4_IDENTITY = { { 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1 } };
+
+Mat4 mat4Translation(float x, float y, float z) {
+    Mat4 t = MAT4_IDENTITY;
+    t.m[12] = x;
+    t.m[13] = y;
+    t.m[14] = z;
+    return t;
+}
+
+// Translation, then a turn about y, as glTranslatef followed by glRotatef.
+Mat4 mat4TranslationRotationY(float x, float y, float z, float degrees) {
+    Mat4 t = mat4Translation(x, y, z);
+    float r = degrees * (float)M_PI / 180.0f;
+    float c = cosf(r), s = sinf(r);
+    t.m[0] = c;
+    t.m[2] = -s;
+    t.m[8] = s;
+    t.m[10] = c;
+    return t;
+}
+
+// out = a * b. Each column of out sums a's columns weighted by one column
+// of b; the SSE and scalar versions add in the same order, so they agree
+// to the bit.
+void mat4Multiply(Mat4& out, const Mat4& a, const Mat4& b) {
+#ifdef RAIN_SSE
+    __m128 c0 = _mm_load_ps(a.m), c1 = _mm_load_ps(a.m + 4), c2 = _mm_load_ps(a.m + 8), c3 = _mm_load_ps(a.m + 12);
+    for (int j = 0; j < 4; ++j) {
+        const float* col = b.m + j * 4;
+        __m128 r = _mm_mul_ps(c0, _mm_set1_ps(col[0]));
+        r = _mm_add_ps(r, _mm_mul_ps(c1, _mm_set1_ps(col[1])));
+        r = _mm_add_ps(r, _mm_mul_ps(c2, _mm_set1_ps(col[2])));
+        r = _mm_add_ps(r, _mm_mul_ps(c3, _mm_set1_ps(col[3])));
+        _mm_store_ps(out.m + j * 4, r);
+    }
+#else
+    for (int j = 0; j < 4; ++j) {
+        const float* col = b.m + j * 4;
+        for (int i = 0; i < 4; ++i)
+            out.m[j * 4 + i] = a.m[i] * col[0] + a.m[4 + i] * col[1] + a.m[8 + i] * col[2] + a.m[12 + i] * col[3];
+    }
+#endif
+}
+
+void mat4TransformPoint(const Mat4& t, float x, float y, float z, float* out) {
+    for (int i = 0; i < 3; ++i)
+        out[i] = t.m[i] * x + t.m[4 + i] * y + t.m[8 + i] * z + t.m[12 + i];
+}
+
+// Per house: the house, its door hinge, left window, right window, chimney.
+// Per cloud: the cloud, then its puffs. Per tree: the tree, its trunk, then
+// its three canopy spheres. Then the sphere.
+const int HOUSE_NODES = 5;
+const int CLOUD_NODES = 1 + PUFFS_PER_CLOUD;
+const int TREE_NODES = 5;
+
+struct SceneGraph {
+    std::vector<int> parent;        // -1 for roots
+    std::vector<uint8_t> dirty;     // Local matrix changed since the last update
+    std::vector<uint32_t> updated;  // Pass that last recomputed the world matrix
+    std::vector<Mat4> local, world;
+    uint32_t pass;
+    int houseBase, cloudBase, treeBase, sphereNode;
+    int clouds, trees;
+    uint32_t generation;            // placementGeneration the nodes were built from
+    bool doorOpen;
+    bool built;
+    int recomputed;                 // World matrices the last update recomputed
+};
+
+SceneGraph sceneGraph = {};
+
+int addNode(int parent, const Mat4& local) {
+    SceneGraph& g = sceneGraph;
+    g.parent.push_back(parent);
+    g.dirty.push_back(1);
+    g.updated.push_back(0);
+    g.local.push_back(local);
+    g.world.push_back(local);
+    return (int)g.parent.size() - 1;
+}
+
+const float* nodePosition(int node) {
+    return sceneGraph.world[node].m + 12;
+}
+
+void setNodeLocal(int node, const Mat4& local) {
+    sceneGraph.local[node] = local;
+    sceneGraph.dirty[node] = 1;
+}
+
+void buildSceneGraph() {
+    SceneGraph& g = sceneGraph;
+    g.parent.clear();
+    g.dirty.clear();
+    g.updated.clear();
+    g.local.clear();
+    g.world.clear();
+    g.pass = 0;
+
+    g.houseBase = 0;
+    for (uint32_t i = 0; i < scene.header->houseCount; ++i) {
+        const SceneHouse& h = scene.houses[i];
+        int house = addNode(-1, mat4Translation(h.x, h.y, h.z));
+        addNode(house, mat4TranslationRotationY(0.0f, -0.5f, 1.01f, renderView.doorOpen ? -90.0f : 0.0f));
+        addNode(house, mat4Translation(-0.6f, 0.0f, 1.01f));
+        addNode(house, mat4Translation(0.6f, 0.0f, 1.01f));
+        addNode(house, mat4Translation(0.6f, 1.2f, -0.3f));
+    }
+    g.doorOpen = renderView.doorOpen;
+
+    g.cloudBase = (int)g.parent.size();
+    g.clouds = (int)renderView.clouds.size();
+    for (int i = 0; i < g.clouds; ++i) {
+        const Cloud& c = renderView.clouds[i];
+        int cloud = addNode(-1, mat4Translation(c.x, c.y, c.z));
+        for (int j = 0; j < PUFFS_PER_CLOUD; ++j)
+            addNode(cloud, mat4Translation(c.puffs[j].x, c.puffs[j].y, c.puffs[j].z));
+    }
+
+    g.treeBase = (int)g.parent.size();
+    g.trees = treeCount;
+    static const float heights[TREE_NODES - 1] = { 0.5f, 1.5f, 1.8f, 2.1f };
+    for (int i = 0; i < treeCount; ++i) {
+        int tree = addNode(-1, mat4Translation(trees[i].x, trees[i].y, trees[i].z));
+        for (int k = 0; k < TREE_NODES - 1; ++k)
+            addNode(tree, mat4Translation(0.0f, heights[k], 0.0f));
+    }
+
+    const Sphere& s = renderView.sphere;
+    g.sphereNode = addNode(-1, mat4Translation(s.x, s.y + s.radius, s.z));
+    g.generation = placementGeneration;
+    g.built = true;
+    restartAllocWarmup();
+}
+
+// Copies what moved from the render view into local matrices, then brings
+// the world matrices of changed subtrees up to date.
+void updateSceneGraph() {
+    PROFILE_STAGE(LANE_RENDER, STAGE_TRANSFORMS);
+    SceneGraph& g = sceneGraph;
+    if (!g.built || g.generation != placementGeneration || g.clouds != (int)renderView.clouds.size() ||
+        g.trees != treeCount)
+        buildSceneGraph();
+
+    for (int i = 0; i < g.clouds; ++i) {
+        const Cloud& c = renderView.clouds[i];
+        int node = g.cloudBase + i * CLOUD_NODES;
+        const float* t = g.local[node].m + 12;
+        if (t[0] != c.x || t[1] != c.y || t[2] != c.z)
+            setNodeLocal(node, mat4Translation(c.x, c.y, c.z));
+    }
+    if (g.doorOpen != renderView.doorOpen) {
+        g.doorOpen = renderView.doorOpen;
+        for (uint32_t i = 0; i < scene.header->houseCount; ++i)
+            setNodeLocal(g.houseBase + i * HOUSE_NODES + 1,
+                         mat4TranslationRotationY(0.0f, -0.5f, 1.01f, g.doorOpen ? -90.0f : 0.0f));
+    }
+    const Sphere& s = renderView.sphere;
+    const float* st = g.local[g.sphereNode].m + 12;
+    if (st[0] != s.x || st[1] != s.y + s.radius || st[2] != s.z)
+        setNodeLocal(g.sphereNode, mat4Translation(s.x, s.y + s.radius, s.z));
+
+    const uint32_t pass = ++g.pass;
+    int recomputed = 0;
+    const int count = (int)g.parent.size();
+    for (int i = 0; i < count; ++i) {
+        int p = g.parent[i];
+        bool parentMoved = p >= 0 && g.updated[p] == pass;
+        if (!g.dirty[i] && !parentMoved)
+            continue;
+        if (p < 0)
+            g.world[i] = g.local[i];
+        else
+            mat4Multiply(g.world[i], g.world[p], g.local[i]);
+        g.dirty[i] = 0;
+        g.updated[i] = pass;
+        recomputed++;
+    }
+    g.recomputed = recomputed;
+}
+
+// Loads a node's world matrix on top of the view, where nested
+// glTranslatef/glRotatef calls used to build it. Pair with glPopMatrix.
+void pushNodeMatrix(int node) {
+    glPushMatrix();
+    glMultMatrixf(sceneGraph.world[node].m);
+}
+
+// Clouds are tested whole first and then puff by puff; a tree is one
+// bounding sphere and one LOD for all its parts. With culling off every
+// object lands in LOD_MEDIUM, the tessellation used before LODs.
+//
+// Clouds and trees are culled in chunks on the job system. Each chunk
+// sorts what it sees into its own per-LOD lists, which are then appended
+// to the batches in chunk order, so the batches come out the same on any
+// number of threads. The lists come from the frame arena, each with room
+// for everything in its chunk, so their size follows the scene and not the
+// view and turning the camera never allocates.
+const int CULL_GRAIN = 512;
+
+struct CullList {
+    Instance* items;
+    int count;
+};
+
+struct CullChunk {
+    CullList clouds[LOD_COUNT];
+    CullList trunks[LOD_COUNT];
+    CullList canopies[LOD_COUNT];
+};
+
+CullChunk* cullChunks = nullptr;
+int cullChunkCount = 0;   // Chunks the last cullScene filled
+
+CullList cullList(size_t capacity) {
+    CullList list = { arenaAlloc<Instance>(capacity), 0 };
+    return list;
+}
+
+inline void pushCulled(CullList& list, const Instance& inst) {
+    list.items[list.count++] = inst;
+}
+
+void cullClouds(CullChunk& out, int begin, int end) {
+    const std::vector<Cloud>& clouds = renderView.clouds;
+    const int puffs = visiblePuffs();
+    for (int i = begin; i < end; ++i) {
+        const Cloud& cloud = clouds[i];
+        float bound = 0.0f;
+        for (int j = 0; j < PUFFS_PER_CLOUD; ++j) {
+            const CloudPuff& puff = cloud.puffs[j];
+            bound = std::max(bound, sqrtf(puff.x * puff.x + puff.y * puff.y + puff.z * puff.z) + puff.size);
+        }
+        const int node = sceneGraph.cloudBase + i * CLOUD_NODES;
+        const float* c = nodePosition(node);
+        if (!sphereInView(c[0], c[1], c[2], bound))
+            continue;
+        for (int j = 0; j < puffs; ++j) {
+            const CloudPuff& puff = cloud.puffs[j];
+            const float* p = nodePosition(node + 1 + j);
+            Instance inst = { p[0], p[1], p[2], puff.size, 1.0f, 1.0f, 1.0f, puff.alpha };
+            if (!sphereInView(inst.x, inst.y, inst.z, inst.size))
+                continue;
+            // Impostors have no tessellation to pick, so they all share one list
+            int lod = useCloudImpostors ? LOD_HIGH : sphereLod(inst.x, inst.y, inst.z, inst.size);
+            pushCulled(out.clouds[lod], inst);
+        }
+    }
+}
+
+void cullTrees(CullChunk& out, int begin, int end) {
+    for (int i = begin; i < end; ++i) {
+        const int node = sceneGraph.treeBase + i * TREE_NODES;
+        const float* t = nodePosition(node);
+        if (!sphereInView(t[0], t[1] + 1.45f, t[2], 1.0f))
+            continue;
+        const float* base = nodePosition(node + 1);
+        const float* c0 = nodePosition(node + 2);
+        const float* c1 = nodePosition(node + 3);
+        const float* c2 = nodePosition(node + 4);
+        int l = sphereLod(c0[0], c0[1], c0[2], 0.5f);
+        Instance trunk = { base[0], base[1], base[2], 1.0f, 0.5f, 0.3f, 0.1f, 1.0f };
+        Instance canopy[3] = {
+            { c0[0], c0[1], c0[2], 0.5f, 0.1f, 0.5f, 0.1f, 1.0f },
+            { c1[0], c1[1], c1[2], 0.4f, 0.1f, 0.5f, 0.1f, 1.0f },
+            { c2[0], c2[1], c2[2], 0.3f, 0.1f, 0.5f, 0.1f, 1.0f }
+        };
+        pushCulled(out.trunks[l], trunk);
+        for (int j = 0; j < 3; ++j)
+            pushCulled(out.canopies[l], canopy[j]);
+    }
+}
+
+void cullScene() {
+    PROFILE_STAGE(LANE_RENDER, STAGE_CULL);
+    int cloudCount = (int)renderView.clouds.size();
+    int chunks = std::max((cloudCount + CULL_GRAIN - 1) / CULL_GRAIN, (treeCount + CULL_GRAIN - 1) / CULL_GRAIN);
+    cullChunks = arenaAlloc<CullChunk>(chunks);
+    for (int k = 0; k < chunks; ++k) {
+        int first = k * CULL_GRAIN;
+        size_t chunkClouds = std::max(0, std::min(CULL_GRAIN, cloudCount - first));
+        size_t chunkTrees = std::max(0, std::min(CULL_GRAIN, treeCount - first));
+        for (int l = 0; l < LOD_COUNT; ++l) {
+            cullChunks[k].clouds[l] = cullList(chunkClouds * PUFFS_PER_CLOUD);
+            cullChunks[k].trunks[l] = cullList(chunkTrees);
+            cullChunks[k].canopies[l] = cullList(chunkTrees * 3);
+        }
+    }
+
+    parallelFor(cloudCount, CULL_GRAIN, [](int begin, int end) {
+        cullClouds(cullChunks[begin / CULL_GRAIN], begin, end);
+    });
+    parallelFor(treeCount, CULL_GRAIN, [](int begin, int end) {
+        cullTrees(cullChunks[begin / CULL_GRAIN], begin, end);
+    });
+    cullChunkCount = chunks;
+}
+
+// Appends one LOD's list from every chunk to the batch, in chunk order.
+void streamCulled(InstanceBatch& batch, CullList (CullChunk::*lists)[LOD_COUNT], int lod) {
+    int count = 0;
+    for (int k = 0; k < cullChunkCount; ++k)
+        count += (cullChunks[k].*lists)[lod].count;
+    Instance* out = streamInstances(batch, count);
+    for (int k = 0; k < cullChunkCount; ++k) {
+        const CullList& list = (cullChunks[k].*lists)[lod];
+        out = std::copy(list.items, list.items + list.count, out);
+    }
+}
+
+// Cloud impostors (--cloud-impostors). Each puff is one camera-facing quad
+// textured with a soft radial falloff instead of a tessellated sphere, so a
+// puff costs four vertices at any distance. Blended quads must go out back
+// to front, so the culled puffs are radix sorted on view depth each frame
+// and all of them are drawn from the stream ring in a single call. The
+// quads go out as indexed triangles from a fixed index buffer rather than
+// leaving the driver to split GL_QUADS on every draw. With --immediate the
+// sorted puffs are drawn with glBegin like the rest of that path.
+const int IMPOSTOR_TEXTURE_SIZE = 64;
+const float IMPOSTOR_SCALE = 1.25f;  // Quad half-size per unit of puff size; the falloff fades the corners
+const float IMPOSTOR_FALLOFF = 2.0f; // Opaque out to half the radius, then fading to the rim
+
+struct ImpostorVertex {
+    float x, y, z;
+    float u, v;
+    float r, g, b, a;
+};
+
+GLuint impostorTexture = 0;
+GLuint impostorIndexBuffer = 0;
+std::vector<uint32_t> impostorIndices;  // Two triangles per quad, for as many quads as the scene has puffs
+
+// A white disc, solid in the middle, whose alpha falls smoothly to zero at the rim.
+void initCloudImpostors() {
+    if (!useCloudImpostors || impostorTexture)
+        return;
+    std::vector<unsigned char> alpha(IMPOSTOR_TEXTURE_SIZE * IMPOSTOR_TEXTURE_SIZE);
+    for (int y = 0; y < IMPOSTOR_TEXTURE_SIZE; ++y) {
+        for (int x = 0; x < IMPOSTOR_TEXTURE_SIZE; ++x) {
+            float dx = (x + 0.5f) / IMPOSTOR_TEXTURE_SIZE * 2.0f - 1.0f;
+            float dy = (y + 0.5f) / IMPOSTOR_TEXTURE_SIZE * 2.0f - 1.0f;
+            float t = std::min(1.0f, std::max(0.0f, (1.0f - sqrtf(dx * dx + dy * dy)) * IMPOSTOR_FALLOFF));
+            alpha[y * IMPOSTOR_TEXTURE_SIZE + x] = (unsigned char)(t * t * (3.0f - 2.0f * t) * 255.0f + 0.5f);
+        }
+    }
+    glGenTextures(1, &impostorTexture);
+    glBindTexture(GL_TEXTURE_2D, impostorTexture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_ALPHA, IMPOSTOR_TEXTURE_SIZE, IMPOSTOR_TEXTURE_SIZE, 0, GL_ALPHA,
+                 GL_UNSIGNED_BYTE, alpha.data());
+    glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+// Grows the index buffer to cover 'quads'; sized for the scene, not the view.
+void reserveImpostorIndices(size_t quads) {
+    if (impostorIndices.size() >= quads * 6)
+        return;
+    impostorIndices.resize(quads * 6);
+    for (size_t q = 0; q < quads; ++q) {
+        uint32_t v = (uint32_t)(q * 4);
+        uint32_t* i = &impostorIndices[q * 6];
+        i[0] = v; i[1] = v + 1; i[2] = v + 2;
+        i[3] = v; i[4] = v + 2; i[5] = v + 3;
+    }
+    if (!gl.hasBuffers)
+        return;
+    if (!impostorIndexBuffer)
+        gl.GenBuffers(1, &impostorIndexBuffer);
+    gl.BindBuffer(GL_ELEMENT_ARRAY_BUFFER, impostorIndexBuffer);
+    gl.BufferData(GL_ELEMENT_ARRAY_BUFFER, impostorIndices.size() * sizeof(uint32_t), impostorIndices.data(),
+                  GL_STATIC_DRAW);
+    gl.BindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+}
+
+void destroyCloudImpostors() {
+    if (impostorTexture)
+        glDeleteTextures(1, &impostorTexture);
+    impostorTexture = 0;
+    if (impostorIndexBuffer)
+        gl.DeleteBuffers(1, &impostorIndexBuffer);
+    impostorIndexBuffer = 0;
+    std::vector<uint32_t>().swap(impostorIndices);
+}
+
+// Larger depths give smaller keys, so an ascending sort is back to front.
+// Flipping the sign bit of positive floats and every bit of negative ones
+// makes their bit patterns order like the values.
+inline uint32_t backToFrontKey(float depth) {
+    uint32_t bits;
+    memcpy(&bits, &depth, sizeof(bits));
+    bits ^= (bits & 0x80000000u) ? 0xffffffffu : 0x80000000u;
+    return ~bits;
+}
+
+// Stable LSD radix sort of 'values' by 'keys', a byte per pass, ping-ponging
+// with the scratch arrays. Passes where every key has the same byte are
+// skipped. Returns whichever array holds the sorted values.
+const uint32_t* radixSort(uint32_t* keys, uint32_t* values, uint32_t* keyScratch, uint32_t* valueScratch, int count) {
+    for (int shift = 0; shift < 32; shift += 8) {
+        int offsets[257] = {};
+        for (int i = 0; i < count; ++i)
+            offsets[((keys[i] >> shift) & 0xff) + 1]++;
+        if (offsets[((keys[0] >> shift) & 0xff) + 1] == count)
+            continue;
+        for (int b = 0; b < 256; ++b)
+            offsets[b + 1] += offsets[b];
+        for (int i = 0; i < count; ++i) {
+            int at = offsets[(keys[i] >> shift) & 0xff]++;
+            keyScratch[at] = keys[i];
+            valueScratch[at] = values[i];
+        }
+        std::swap(keys, keyScratch);
+        std::swap(values, valueScratch);
+    }
+    return values;
+}
+
+const float IMPOSTOR_CORNERS[4][2] = { { -1, -1 }, { 1, -1 }, { 1, 1 }, { -1, 1 } };
+
+// The four corners of a puff's quad, facing the camera of viewFrustum.
+void impostorQuad(const Instance& puff, ImpostorVertex* out) {
+    const Frustum& f = viewFrustum;
+    float s = puff.size * IMPOSTOR_SCALE;
+    for (int c = 0; c < 4; ++c) {
+        float a = IMPOSTOR_CORNERS[c][0] * s, b = IMPOSTOR_CORNERS[c][1] * s;
+        ImpostorVertex v = {
+            puff.x + a * f.right[0] + b * f.up[0],
+            puff.y + a * f.right[1] + b * f.up[1],
+            puff.z + a * f.right[2] + b * f.up[2],
+            IMPOSTOR_CORNERS[c][0] * 0.5f + 0.5f, IMPOSTOR_CORNERS[c][1] * 0.5f + 0.5f,
+            puff.r, puff.g, puff.b, puff.a
+        };
+        out[c] = v;
+    }
+}
+
+// The culled puffs of every chunk, sorted back to front and expanded into
+// quads in the stream ring, or copied in order for the immediate path.
+void streamCloudImpostors() {
+    int count = 0;
+    for (int k = 0; k < cullChunkCount; ++k)
+        count += cullChunks[k].clouds[LOD_HIGH].count;
+    viewBatches->impostorCount = count;
+
+    // Sized for the whole scene like the cull lists, so the arena doesn't
+    // grow as clouds drift into view
+    size_t capacity = renderView.clouds.size() * PUFFS_PER_CLOUD;
+    const Instance** puffs = arenaAlloc<const Instance*>(capacity);
+    uint32_t* keys = arenaAlloc<uint32_t>(capacity * 4);
+    uint32_t* values = keys + count;
+    Instance* sorted = useMeshCache ? nullptr : arenaAlloc<Instance>(capacity);
+    ImpostorVertex* out = nullptr;
+    if (useMeshCache)
+        out = (ImpostorVertex*)streamAlloc(count * 4 * sizeof(ImpostorVertex), &viewBatches->impostorOffset);
+    viewBatches->impostorPuffs = sorted;
+    if (count == 0)
+        return;
+
+    const Frustum& f = viewFrustum;
+    int n = 0;
+    for (int k = 0; k < cullChunkCount; ++k) {
+        const CullList& list = cullChunks[k].clouds[LOD_HIGH];
+        for (int i = 0; i < list.count; ++i, ++n) {
+            const Instance& puff = list.items[i];
+            float depth = (puff.x - f.eyeX) * f.forward[0] + (puff.y - f.eyeY) * f.forward[1] +
+                          (puff.z - f.eyeZ) * f.forward[2];
+            puffs[n] = &puff;
+            keys[n] = backToFrontKey(depth);
+            values[n] = n;
+        }
+    }
+    const uint32_t* order = radixSort(keys, values, values + count, values + 2 * count, count);
+    for (int i = 0; i < count; ++i) {
+        if (out)
+            impostorQuad(*puffs[order[i]], out + i * 4);
+        else
+            sorted[i] = *puffs[order[i]];
+    }
+}
+
+// Room in the stream ring for one camera's culled clouds and trees with the
+// whole scene in view, so the ring is sized once.
+size_t viewStreamBytes() {
+    size_t bytes = 0;
+    if (instancingActive()) {
+        size_t instances = renderView.clouds.size() * PUFFS_PER_CLOUD + treeCount * 4;
+        bytes += instances * sizeof(Instance) + 3 * LOD_COUNT * STREAM_ALIGN;
+    }
+    if (useCloudImpostors && useMeshCache)
+        bytes += renderView.clouds.size() * PUFFS_PER_CLOUD * 4 * sizeof(ImpostorVertex) + STREAM_ALIGN;
+    return bytes;
+}
+
+// Room for what every camera shares: the ripple rings and the rain streaks.
+size_t sharedStreamBytes() {
+    size_t bytes = 0;
+    if (instancingActive())
+        bytes += renderView.ripples.capacity() * sizeof(Instance) + STREAM_ALIGN;
+    if (useMeshCache && !gpuRainActive())
+        bytes += renderView.cur->particles.count * 6 * sizeof(float) + STREAM_ALIGN;
+    return bytes;
+}
+
+// The last cullScene's lists, into the current camera's batches.
+void streamViewBatches() {
+    // Without instancing the batches are client arrays. Any LOD may get the
+    // whole scene as the camera moves, so each is sized for it once
+    if (!instancingActive()) {
+        for (int l = 0; l < LOD_COUNT; ++l) {
+            viewBatches->clouds[l].instances.reserve(renderView.clouds.size() * PUFFS_PER_CLOUD);
+            viewBatches->trunks[l].instances.reserve(treeCount);
+            viewBatches->canopies[l].instances.reserve(treeCount * 3);
+        }
+    }
+    if (useCloudImpostors)
+        streamCloudImpostors();
+    for (int l = 0; l < LOD_COUNT; ++l) {
+        if (!useCloudImpostors)
+            streamCulled(viewBatches->clouds[l], &CullChunk::clouds, l);
+        streamCulled(viewBatches->trunks[l], &CullChunk::trunks, l);
+        streamCulled(viewBatches->canopies[l], &CullChunk::canopies, l);
+    }
+}
+
+void streamSharedGeometry() {
+    if (instancingActive()) {
+        const int shown = visibleRipples(renderView.ripples.size());
+        int live = 0;
+        for (int i = 0; i < shown; ++i)
+            live += renderView.ripples[i].radius > 0.01f;
+        Instance* out = streamInstances(rippleBatch, live);
+        for (int i = 0; i < shown; ++i) {
+            const Ripple& ripple = renderView.ripples[i];
+            if (ripple.radius > 0.01f) {
+                Instance inst = { ripple.x, ripple.y, ripple.z, ripple.radius, 1.0f, 1.0f, 1.0f, ripple.alpha * 0.3f };
+                *out++ = inst;
+            }
+        }
+    }
+
+    if (useMeshCache && !gpuRainActive()) {
+        const int drops = visibleDrops(renderView.cur->particles.count);
+        rainVertices = (float*)streamAlloc(drops * 6 * sizeof(float), &rainOffset);
+        parallelFor(drops, RAIN_GRAIN, buildRainVertices);
+        rainVertices = nullptr;
+    }
+}
+
+// Writes what the frame draws from the stream ring: the culled clouds and
+// trees, the ripple rings and the rain streaks.
+void streamFrame() {
+    PROFILE_STAGE(LANE_RENDER, STAGE_STREAM);
+    beginStreamWrites(viewStreamBytes() + sharedStreamBytes());
+    streamViewBatches();
+    streamSharedGeometry();
+    endStreamWrites();
+}
+
+// Without instancing, the batches are drawn one sphere at a time.
+void drawSphereBatch(const InstanceBatch& batch, int slices) {
+    for (size_t i = 0; i < batch.instances.size(); ++i) {
+        const Instance& inst = batch.instances[i];
+        glColor4f(inst.r, inst.g, inst.b, inst.a);
+        glPushMatrix();
+        glTranslatef(inst.x, inst.y, inst.z);
+        drawSphere(inst.size, slices, slices);
+        glPopMatrix();
+    }
+}
+
+// One draw for every puff, textured and blended but not depth written, so
+// the sorted quads overlap softly.
+void drawCloudImpostors() {
+    const int count = viewBatches->impostorCount;
+    if (useMeshCache)
+        reserveImpostorIndices(renderView.clouds.size() * PUFFS_PER_CLOUD);
+    if (count == 0)
+        return;
+    glEnable(GL_TEXTURE_2D);
+    glBindTexture(GL_TEXTURE_2D, impostorTexture);
+    glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
+    glDepthMask(GL_FALSE);
+
+    if (useMeshCache) {
+        const char* data = (const char*)streamPointer(viewBatches->impostorOffset);
+        glVertexPointer(3, GL_FLOAT, sizeof(ImpostorVertex), data);
+        glTexCoordPointer(2, GL_FLOAT, sizeof(ImpostorVertex), data + offsetof(ImpostorVertex, u));
+        glColorPointer(4, GL_FLOAT, sizeof(ImpostorVertex), data + offsetof(ImpostorVertex, r));
+        glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+        glEnableClientState(GL_COLOR_ARRAY);
+        if (impostorIndexBuffer) {
+            gl.BindBuffer(GL_ELEMENT_ARRAY_BUFFER, impostorIndexBuffer);
+            glDrawElements(GL_TRIANGLES, 6 * count, GL_UNSIGNED_INT, nullptr);
+            gl.BindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+        } else {
+            glDrawElements(GL_TRIANGLES, 6 * count, GL_UNSIGNED_INT, impostorIndices.data());
+        }
+        glDisableClientState(GL_COLOR_ARRAY);
+        glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+        if (gl.hasBuffers)
+            gl.BindBuffer(GL_ARRAY_BUFFER, 0);
+    } else {
+        glBegin(GL_QUADS);
+        for (int i = 0; i < count; ++i) {
+            ImpostorVertex quad[4];
+            impostorQuad(viewBatches->impostorPuffs[i], quad);
+            for (int c = 0; c < 4; ++c) {
+                glColor4f(quad[c].r, quad[c].g, quad[c].b, quad[c].a);
+                glTexCoord2f(quad[c].u, quad[c].v);
+                glVertex3f(quad[c].x, quad[c].y, quad[c].z);
+            }
+        }
+        glEnd();
+    }
+
+    glDepthMask(GL_TRUE);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glDisable(GL_TEXTURE_2D);
+    renderStats.drawCalls++;
+    renderStats.vertices += 4 * count;
+}
+
+void drawClouds() {
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    if (useCloudImpostors) {
+        drawCloudImpostors();
+        glDisable(GL_BLEND);
+        return;
+    }
+    for (int l = 0; l < LOD_COUNT; ++l) {
+        if (instancingActive())
+            drawInstanced(getMesh(MESH_SPHERE, lodSlices[l], lodSlices[l]), viewBatches->clouds[l], 1.0f, 1.0f, 1.0f);
+        else
+            drawSphereBatch(viewBatches->clouds[l], lodSlices[l]);
+    }
+    glDisable(GL_BLEND);
+}
+
+// Camera and render toggles. These belong to the render thread, which
+// applies them as they are pressed; a recording stamps them with the tick
+// drawn last, so a replay can apply them before the tick after it.
+enum ViewInput {
+    VIEW_ZOOM_IN,
+    VIEW_ZOOM_OUT,
+    VIEW_ROTATE_LEFT,
+    VIEW_ROTATE_RIGHT,
+    VIEW_TILT_UP,
+    VIEW_TILT_DOWN,
+    VIEW_TOGGLE_MESH_CACHE,
+    VIEW_TOGGLE_INSTANCING,
+    VIEW_TOGGLE_CULLING,
+    VIEW_PAN_FORWARD,
+    VIEW_PAN_BACK,
+    VIEW_PAN_LEFT,
+    VIEW_PAN_RIGHT
+};
+
+const float WORLD_PAN_STEP = 1.0f;  // Focus movement per T/F/G/H press
+
+// Moves the camera's focus over the ground, relative to where it faces.
+void panFocus(float forward, float right) {
+    float radX = cameraAngleX * M_PI / 180.0f;
+    float fx = -sinf(radX), fz = -cosf(radX);
+    worldFocusX += (forward * fx - right * fz) * WORLD_PAN_STEP;
+    worldFocusZ += (forward * fz + right * fx) * WORLD_PAN_STEP;
+}
+
+void applyViewKey(ViewInput key) {
+    if (key == VIEW_TOGGLE_MESH_CACHE) {
+        useMeshCache = !useMeshCache;
+        restartAllocWarmup();
+        LOG(LOG_INFO, "M key pressed: Geometry path set to %s", useMeshCache ? "MESH CACHE" : "IMMEDIATE");
+    } else if (key == VIEW_TOGGLE_INSTANCING) {
+        useInstancing = !useInstancing;
+        restartAllocWarmup();
+        LOG(LOG_INFO, "N key pressed: Instancing %s", useInstancing ? "ON" : "OFF");
+    } else if (key == VIEW_TOGGLE_CULLING) {
+        useCulling = !useCulling;
+        restartAllocWarmup();
+        LOG(LOG_INFO, "L key pressed: Culling and LOD %s", useCulling ? "ON" : "OFF");
+    } else if (key == VIEW_ZOOM_IN) {
+        cameraDistance = std::max(2.0f, cameraDistance - cameraSpeed);
+        LOG(LOG_INFO, "W key pressed: Zoom in");
+    } else if (key == VIEW_ZOOM_OUT) {
+        cameraDistance = std::min(20.0f, cameraDistance + cameraSpeed);
+        LOG(LOG_INFO, "S key pressed: Zoom out");
+    } else if (key == VIEW_ROTATE_LEFT) {
+        cameraAngleX += angleSpeed;
+        LOG(LOG_INFO, "A key pressed: Rotate left");
+    } else if (key == VIEW_ROTATE_RIGHT) {
+        cameraAngleX -= angleSpeed;
+        LOG(LOG_INFO, "D key pressed: Rotate right");
+    } else if (key == VIEW_TILT_UP) {
+        cameraAngleY = std::min(80.0f, cameraAngleY + angleSpeed);
+        LOG(LOG_INFO, "Q key pressed: Tilt up");
+    } else if (key == VIEW_TILT_DOWN) {
+        cameraAngleY = std::max(10.0f, cameraAngleY - angleSpeed);
+        LOG(LOG_INFO, "E key pressed: Tilt down");
+    } else if (key >= VIEW_PAN_FORWARD && key <= VIEW_PAN_RIGHT && useWorld) {
+        panFocus(key == VIEW_PAN_FORWARD ? 1.0f : key == VIEW_PAN_BACK ? -1.0f : 0.0f,
+                 key == VIEW_PAN_RIGHT ? 1.0f : key == VIEW_PAN_LEFT ? -1.0f : 0.0f);
+        LOG(LOG_INFO, "Pan: focus at (%g, %g)", worldFocusX, worldFocusZ);
+    }
+}
+
+void pressViewKey(ViewInput key) {
+    recordEvent(renderView.cur ? renderView.cur->tick : 0, REC_VIEW_INPUT, key);
+    applyViewKey(key);
+}
+
+// Everything pressed before 'tick' was drawn in the recording.
+void replayViewInputs(uint64_t tick) {
+    const RecordEntry* e;
+    while ((e = nextReplayEntry(replay.viewCursor, REC_VIEW_INPUT)) && e->tick < tick) {
+        applyViewKey((ViewInput)e->value);
+        replay.viewCursor++;
+    }
+}
+
+#if HAVE_GLFW
+void keyCallback(GLFWwindow* window, int key, int scancode, int action, int mods) {
+    if (action == GLFW_PRESS || action == GLFW_REPEAT) {
+        if (key == GLFW_KEY_O) {
+            queueSimKey(SIM_DOOR_OPEN);
+        } else if (key == GLFW_KEY_C) {
+            queueSimKey(SIM_DOOR_CLOSE);
+        } else if (key == GLFW_KEY_LEFT) {
+            queueSimKey(SIM_SPHERE_LEFT);
+        } else if (key == GLFW_KEY_RIGHT) {
+            queueSimKey(SIM_SPHERE_RIGHT);
+        } else if (key == GLFW_KEY_UP) {
+            queueSimKey(SIM_SPHERE_UP);
+        } else if (key == GLFW_KEY_DOWN) {
+            queueSimKey(SIM_SPHERE_DOWN);
+        } else if (key == GLFW_KEY_M && action == GLFW_PRESS) {
+            pressViewKey(VIEW_TOGGLE_MESH_CACHE);
+        } else if (key == GLFW_KEY_N && action == GLFW_PRESS) {
+            pressViewKey(VIEW_TOGGLE_INSTANCING);
+        } else if (key == GLFW_KEY_L && action == GLFW_PRESS) {
+            pressViewKey(VIEW_TOGGLE_CULLING);
+        } else if (key == GLFW_KEY_W) {
+            pressViewKey(VIEW_ZOOM_IN);
+        } else if (key == GLFW_KEY_S) {
+            pressViewKey(VIEW_ZOOM_OUT);
+        } else if (key == GLFW_KEY_A) {
+            pressViewKey(VIEW_ROTATE_LEFT);
+        } else if (key == GLFW_KEY_D) {
+            pressViewKey(VIEW_ROTATE_RIGHT);
+        } else if (key == GLFW_KEY_Q) {
+            pressViewKey(VIEW_TILT_UP);
+        } else if (key == GLFW_KEY_E) {
+            pressViewKey(VIEW_TILT_DOWN);
+        } else if (key == GLFW_KEY_T) {
+            pressViewKey(VIEW_PAN_FORWARD);
+        } else if (key == GLFW_KEY_G) {
+            pressViewKey(VIEW_PAN_BACK);
+        } else if (key == GLFW_KEY_F) {
+            pressViewKey(VIEW_PAN_LEFT);
+        } else if (key == GLFW_KEY_H) {
+            pressViewKey(VIEW_PAN_RIGHT);
+        }
+    }
+}
+#endif
+
+void drawCubeImmediate(float x, float y, float z, float w, float h, float d) {
+    float hw = w / 2.0f, hh = h / 2.0f, hd = d / 2.0f;
+
+    glPushMatrix();
+    glTranslatef(x, y, z);
+    glBegin(GL_QUADS);
+
+    glVertex3f(-hw, -hh, hd);
+    glVertex3f(hw, -hh, hd);
+    glVertex3f(hw, hh, hd);
+    glVertex3f(-hw, hh, hd);
+
+    glVertex3f(-hw, -hh, -hd);
+    glVertex3f(hw, -hh, -hd);
+    glVertex3f(hw, hh, -hd);
+    glVertex3f(-hw, hh, -hd);
+
+    glVertex3f(-hw, -hh, -hd);
+    glVertex3f(-hw, -hh, hd);
+    glVertex3f(-hw, hh, hd);
+    glVertex3f(-hw, hh, -hd);
+
+    glVertex3f(hw, -hh, -hd);
+    glVertex3f(hw, -hh, hd);
+    glVertex3f(hw, hh, hd);
+    glVertex3f(hw, hh, -hd);
+
+    glVertex3f(-hw, hh, -hd);
+    glVertex3f(hw, hh, -hd);
+    glVertex3f(hw, hh, hd);
+    glVertex3f(-hw, hh, hd);
+
+    glVertex3f(-hw, -hh, -hd);
+    glVertex3f(hw, -hh, -hd);
+    glVertex3f(hw, -hh, hd);
+    glVertex3f(-hw, -hh, hd);
+
+    glEnd();
+    glPopMatrix();
+    renderStats.drawCalls++;
+    renderStats.vertices += 24;
+}
+
+void drawCube(float x, float y, float z, float w, float h, float d) {
+    if (!useMeshCache) {
+        drawCubeImmediate(x, y, z, w, h, d);
+        return;
+    }
+    glPushMatrix();
+    glTranslatef(x, y, z);
+    glScalef(w, h, d);
+    drawMesh(getMesh(MESH_CUBE));
+    glPopMatrix();
+}
+
+void drawCylinderImmediate(float baseRadius, float topRadius, float height, int slices) {
+    float* circle = tessellationBuffer((slices + 1) * 2);
+    circlePoints(circle, 1.0f, slices);
+    
+    glBegin(GL_TRIANGLE_STRIP);
+    for (int i = 0; i <= slices; ++i) {
+        float c = circle[i * 2], s = circle[i * 2 + 1];
+        glVertex3f(c * baseRadius, 0.0f, s * baseRadius);
+        glVertex3f(c * topRadius, height, s * topRadius);
+    }
+    glEnd();
+    
     glBegin(GL_TRIANGLE_FAN);
     glVertex3f(0.0f, height, 0.0f);
-    for (int i = 0; i <= slices; ++i) {
-        angle = i * sliceAngle;
-        x1 = cos(angle) * topRadius;
-        y1 = sin(angle) * topRadius;
-        glVertex3f(x1, height, y1);
+    for (int i = 0; i <= slices; ++i)
+        glVertex3f(circle[i * 2] * topRadius, height, circle[i * 2 + 1] * topRadius);
+    glEnd();
+    
+    glBegin(GL_TRIANGLE_FAN);
+    glVertex3f(0.0f, 0.0f, 0.0f);
+    for (int i = slices; i >= 0; --i)
+        glVertex3f(circle[i * 2] * baseRadius, 0.0f, circle[i * 2 + 1] * baseRadius);
+    glEnd();
+    renderStats.drawCalls += 3;
+    renderStats.vertices += 4 * (slices + 1) + 2;
+}
+
+void drawCylinder(float baseRadius, float topRadius, float height, int slices) {
+    if (!useMeshCache) {
+        drawCylinderImmediate(baseRadius, topRadius, height, slices);
+        return;
+    }
+    glPushMatrix();
+    glScalef(baseRadius, height, baseRadius);
+    drawMesh(getMesh(MESH_CYLINDER, slices, 0, topRadius / baseRadius));
+    glPopMatrix();
+}
+
+void drawTrees() {
+    for (int l = 0; l < LOD_COUNT; ++l) {
+        int slices = lodSlices[l];
+        if (instancingActive()) {
+            drawInstanced(getMesh(MESH_CYLINDER, slices, 0, 0.1f / 0.15f), viewBatches->trunks[l], 0.15f, 1.0f, 0.15f);
+            drawInstanced(getMesh(MESH_SPHERE, slices, slices), viewBatches->canopies[l], 1.0f, 1.0f, 1.0f);
+            continue;
+        }
+        const std::vector<Instance>& trunks = viewBatches->trunks[l].instances;
+        glColor3f(0.5f, 0.3f, 0.1f);
+        for (size_t i = 0; i < trunks.size(); ++i) {
+            glPushMatrix();
+            glTranslatef(trunks[i].x, trunks[i].y, trunks[i].z);
+            drawCylinder(0.15f, 0.1f, 1.0f, slices);
+            glPopMatrix();
+        }
+        drawSphereBatch(viewBatches->canopies[l], slices);
+    }
+}
+
+// node is the house's first node in the scene graph.
+void drawHouseImmediate(int node) {
+    pushNodeMatrix(node);
+
+    glColor3f(0.8f, 0.8f, 0.8f);
+    drawCube(0, 0.0f, 0, 2, 1.5, 2);
+
+    glColor3f(0.6f, 0.3f, 0.1f);
+    
+    glBegin(GL_TRIANGLES);
+    glVertex3f(-1.0f, 0.75f, 1.0f);
+    glVertex3f(1.0f, 0.75f, 1.0f);
+    glVertex3f(0.0f, 1.75f, 1.0f);
+    glEnd();
+    
+    glBegin(GL_TRIANGLES);
+    glVertex3f(-1.0f, 0.75f, -1.0f);
+    glVertex3f(1.0f, 0.75f, -1.0f);
+    glVertex3f(0.0f, 1.75f, -1.0f);
+    glEnd();
+
+    glBegin(GL_QUADS);
+    glVertex3f(-1.0f, 0.75f, 1.0f);
+    glVertex3f(-1.0f, 0.75f, -1.0f);
+    glVertex3f(0.0f, 1.75f, -1.0f);
+    glVertex3f(0.0f, 1.75f, 1.0f);
+
+    glVertex3f(1.0f, 0.75f, 1.0f);
+    glVertex3f(1.0f, 0.75f, -1.0f);
+    glVertex3f(0.0f, 1.75f, -1.0f);
+    glVertex3f(0.0f, 1.75f, 1.0f);
+    glEnd();
+
+    glPopMatrix();
+
+    glColor3f(0.4f, 0.2f, 0.0f);
+    pushNodeMatrix(node + 1);
+    glBegin(GL_QUADS);
+    glVertex3f(-0.25f, 0.0f, 0.0f);
+    glVertex3f(0.25f, 0.0f, 0.0f);
+    glVertex3f(0.25f, 0.75f, 0.0f);
+    glVertex3f(-0.25f, 0.75f, 0.0f);
+    glEnd();
+    glPopMatrix();
+
+    glColor3f(0.9f, 0.9f, 1.0f);
+    pushNodeMatrix(node + 2);
+    glBegin(GL_QUADS);
+    glVertex3f(-0.25f, -0.25f, 0.0f);
+    glVertex3f(0.25f, -0.25f, 0.0f);
+    glVertex3f(0.25f, 0.25f, 0.0f);
+    glVertex3f(-0.25f, 0.25f, 0.0f);
+    glEnd();
+    
+    glColor3f(0.0f, 0.0f, 0.0f);
+    glBegin(GL_LINES);
+    glVertex3f(-0.25f, 0.0f, 0.01f);
+    glVertex3f(0.25f, 0.0f, 0.01f);
+    glVertex3f(0.0f, -0.25f, 0.01f);
+    glVertex3f(0.0f, 0.25f, 0.01f);
+    glEnd();
+    glPopMatrix();
+    
+    glColor3f(0.9f, 0.9f, 1.0f);
+    pushNodeMatrix(node + 3);
+    glBegin(GL_QUADS);
+    glVertex3f(-0.25f, -0.25f, 0.0f);
+    glVertex3f(0.25f, -0.25f, 0.0f);
+    glVertex3f(0.25f, 0.25f, 0.0f);
+    glVertex3f(-0.25f, 0.25f, 0.0f);
+    glEnd();
+    
+    glColor3f(0.0f, 0.0f, 0.0f);
+    glBegin(GL_LINES);
+    glVertex3f(-0.25f, 0.0f, 0.01f);
+    glVertex3f(0.25f, 0.0f, 0.01f);
+    glVertex3f(0.0f, -0.25f, 0.01f);
+    glVertex3f(0.0f, 0.25f, 0.01f);
+    glEnd();
+    glPopMatrix();
+
+    glColor3f(0.5f, 0.3f, 0.3f);
+    pushNodeMatrix(node + 4);
+    drawCube(0.0f, 0.0f, 0.0f, 0.3f, 0.6f, 0.3f);
+    glPopMatrix();
+}
+
+void drawHousesImmediate() {
+    for (uint32_t i = 0; i < scene.header->houseCount; ++i)
+        drawHouseImmediate(sceneGraph.houseBase + i * HOUSE_NODES);
+}
+
+const int POND_SEGMENTS = 36;
+
+void drawDisc(float radius, int segments) {
+    if (useMeshCache) {
+        glPushMatrix();
+        glScalef(radius, 1.0f, radius);
+        drawMesh(getMesh(MESH_DISC, segments));
+        glPopMatrix();
+        return;
+    }
+    float* circle = tessellationBuffer((segments + 1) * 2);
+    circlePoints(circle, radius, segments);
+    glBegin(GL_TRIANGLE_FAN);
+    glVertex3f(0.0f, 0.0f, 0.0f);
+    for (int i = 0; i <= segments; ++i)
+        glVertex3f(circle[i * 2], 0.0f, circle[i * 2 + 1]);
+    glEnd();
+    renderStats.drawCalls++;
+    renderStats.vertices += segments + 2;
+}
+
+void drawPondRim(float radius, int segments) {
+    if (useMeshCache) {
+        glPushMatrix();
+        glScalef(radius, 1.0f, radius);
+        drawMesh(getMesh(MESH_POND_RIM, segments));
+        glPopMatrix();
+        return;
+    }
+    float* circle = tessellationBuffer((segments + 1) * 2);
+    circlePoints(circle, radius, segments);
+    glBegin(GL_TRIANGLE_STRIP);
+    for (int i = 0; i <= segments; ++i) {
+        float x = circle[i * 2], z = circle[i * 2 + 1];
+        glVertex3f(x * 1.1f, 0.05f, z * 1.1f);
+        glVertex3f(x, 0.01f, z);
+    }
+    glEnd();
+    renderStats.drawCalls++;
+    renderStats.vertices += 2 * (segments + 1);
+}
+
+void drawRing(float cx, float y, float cz, float radius, int segments) {
+    if (useMeshCache) {
+        glPushMatrix();
+        glTranslatef(cx, y, cz);
+        glScalef(radius, 1.0f, radius);
+        drawMesh(getMesh(MESH_RING, segments));
+        glPopMatrix();
+        return;
+    }
+    float* circle = tessellationBuffer((segments + 1) * 2);
+    circlePoints(circle, radius, segments);
+    glBegin(GL_LINE_LOOP);
+    for (int j = 0; j < segments; ++j)
+        glVertex3f(cx + circle[j * 2], y, cz + circle[j * 2 + 1]);
+    glEnd();
+    renderStats.drawCalls++;
+    renderStats.vertices += segments;
+}
+
+void drawPond() {
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    
+    int segments = POND_SEGMENTS;
+    for (uint32_t i = 0; i < scene.header->pondCount; ++i) {
+        const ScenePond& pond = scene.ponds[i];
+        if (!sphereInView(pond.x, pond.y, pond.z, pond.radius * 1.1f))
+            continue;
+        glPushMatrix();
+        glTranslatef(pond.x, pond.y, pond.z);
+        glColor4f(0.2f, 0.4f, 0.8f, 0.8f);
+        drawDisc(pond.radius, segments);
+        glColor3f(0.6f, 0.5f, 0.3f);
+        drawPondRim(pond.radius, segments);
+        glPopMatrix();
+    }
+    
+    if (instancingActive()) {
+        drawInstanced(getMesh(MESH_RING, segments), rippleBatch, 1.0f, 1.0f, 1.0f);
+    } else {
+        const int shown = visibleRipples(renderView.ripples.size());
+        for (int i = 0; i < shown; ++i) {
+            const Ripple* ripple = &renderView.ripples[i];
+            if (ripple->radius > 0.01f) {
+                glColor4f(1.0f, 1.0f, 1.0f, ripple->alpha * 0.3f);
+                drawRing(ripple->x, ripple->y, ripple->z, ripple->radius, segments);
+            }
+        }
+    }
+    
+    glDisable(GL_BLEND);
+}
+
+// Builds every mesh a frame can ask for, at every LOD, so moving the camera
+// never creates one mid-run.
+void warmMeshCache() {
+    for (int l = 0; l < LOD_COUNT; ++l) {
+        getMesh(MESH_SPHERE, lodSlices[l], lodSlices[l]);
+        getMesh(MESH_CYLINDER, lodSlices[l], 0, 0.1f / 0.15f);
+    }
+    getMesh(MESH_CUBE);
+    getMesh(MESH_DISC, POND_SEGMENTS);
+    getMesh(MESH_POND_RIM, POND_SEGMENTS);
+    getMesh(MESH_RING, POND_SEGMENTS);
+}
+
+void drawSkyImmediate() {
+    glColor3f(0.4f, 0.6f, 0.9f);
+    glPushMatrix();
+    glTranslatef(0.0f, 0.0f, 0.0f);
+    
+    float radius = scene.header->groundSize;
+    float* circle = tessellationBuffer((SKY_SEGMENTS + 1) * 2);
+    circlePoints(circle, radius, SKY_SEGMENTS);
+    
+    glBegin(GL_TRIANGLE_FAN);
+    glVertex3f(0.0f, radius, 0.0f);
+    for (int i = 0; i <= SKY_SEGMENTS; i++)
+        glVertex3f(circle[i * 2], 0.0f, circle[i * 2 + 1]);
+    glEnd();
+    
+    glPopMatrix();
+}
+
+// Grass tufts stay off the houses and out of the ponds.
+bool isGrassSpot(float x, float z) {
+    for (uint32_t i = 0; i < scene.header->houseCount; ++i) {
+        const SceneHouse& h = scene.houses[i];
+        if (fabsf(x - h.x) < 1.5f && fabsf(z - h.z) < 1.5f)
+            return false;
+    }
+    for (uint32_t i = 0; i < scene.header->pondCount; ++i) {
+        const ScenePond& p = scene.ponds[i];
+        float dx = x - p.x, dz = z - p.z, r = p.radius + 0.2f;
+        if (dx * dx + dz * dz < r * r)
+            return false;
+    }
+    return true;
+}
+
+void drawGroundImmediate() {
+    float size = scene.header->groundSize;
+    glColor3f(0.3f, 0.6f, 0.3f);
+    glBegin(GL_QUADS);
+    glVertex3f(-size, 0.0f, -size);
+    glVertex3f(-size, 0.0f, size);
+    glVertex3f(size, 0.0f, size);
+    glVertex3f(size, 0.0f, -size);
+    glEnd();
+    
+    glColor3f(0.2f, 0.5f, 0.2f);
+    glBegin(GL_LINES);
+    for (float x = -10.0f; x <= 10.0f; x += 1.0f) {
+        for (float z = -10.0f; z <= 10.0f; z += 1.0f) {
+            if (!isGrassSpot(x, z))
+                continue;
+            glVertex3f(x - 0.1f, 0.01f, z - 0.1f);
+            glVertex3f(x + 0.1f, 0.01f, z + 0.1f);
+            glVertex3f(x - 0.1f, 0.01f, z + 0.1f);
+            glVertex3f(x + 0.1f, 0.01f, z - 0.1f);
+        }
+    }
+    glEnd();
+}
+
+// Sky, ground, grass and the house never change, so with the mesh cache on
+// they are baked once into a single vertex buffer with one draw range per
+// colour and primitive: a constant handful of draw calls however detailed
+// they get. The door is the one moving part; its quad is the last range
+// and is rewritten in place when doorOpen flips.
+struct StaticBatch {
+    GLenum mode;
+    float r, g, b;
+    GLint first;
+    GLsizei count;
+    std::vector<float> vertices; // Only while baking
+};
+
+struct StaticScene {
+    GLuint vbo;
+    std::vector<float> vertices; // Kept for the client-array path and door updates
+    std::vector<StaticBatch> batches;
+    int doorBatch;
+    bool doorOpen;
+    bool baked;
+};
+
+StaticScene staticScene = { 0, {}, {}, -1, false, false };
+
+StaticBatch& staticBatch(std::vector<StaticBatch>& batches, GLenum mode, float r, float g, float b) {
+    for (size_t i = 0; i < batches.size(); ++i) {
+        if (batches[i].mode == mode && batches[i].r == r && batches[i].g == g && batches[i].b == b)
+            return batches[i];
+    }
+    StaticBatch batch = { mode, r, g, b, 0, 0 };
+    batches.push_back(batch);
+    return batches.back();
+}
+
+// Corners in drawing order; becomes two triangles.
+void bakeQuad(StaticBatch& batch, float ox, float oy, float oz, const float q[4][3]) {
+    static const int corners[6] = { 0, 1, 2, 0, 2, 3 };
+    for (int c = 0; c < 6; ++c)
+        pushVertex(batch.vertices, ox + q[corners[c]][0], oy + q[corners[c]][1], oz + q[corners[c]][2]);
+}
+
+Mesh cubeMesh() {
+    Mesh cube = {};
+    buildCubeMesh(cube);
+    return cube;
+}
+
+// Also called on the tile loader thread, so the unit cube is built once.
+void bakeCube(StaticBatch& batch, float x, float y, float z, float w, float h, float d) {
+    static const Mesh cube = cubeMesh();
+    for (size_t i = 0; i < cube.vertices.size(); i += 3)
+        pushVertex(batch.vertices, x + cube.vertices[i] * w, y + cube.vertices[i + 1] * h, z + cube.vertices[i + 2] * d);
+}
+
+void bakeSky(std::vector<StaticBatch>& batches) {
+    StaticBatch& sky = staticBatch(batches, GL_TRIANGLES, 0.4f, 0.6f, 0.9f);
+    const float radius = scene.header->groundSize;
+    float* circle = tessellationBuffer((SKY_SEGMENTS + 1) * 2);
+    circlePoints(circle, radius, SKY_SEGMENTS);
+    for (int i = 0; i < SKY_SEGMENTS; i++) {
+        pushVertex(sky.vertices, 0.0f, radius, 0.0f);
+        pushVertex(sky.vertices, circle[i * 2], 0.0f, circle[i * 2 + 1]);
+        pushVertex(sky.vertices, circle[i * 2 + 2], 0.0f, circle[i * 2 + 3]);
     }
-    glEnd();
-    
-    glBegin(GL_TRIANGLE_FAN);
-    glVertex3f(0.0f, 0.0f, 0.0f);
-    for (int i = slices; i >= 0; --i) {
-        angle = i * sliceAngle;
-        x1 = cos(angle) * baseRadius;
-        y1 = sin(angle) * baseRadius;
-        glVertex3f(x1, 0.0f, y1);
+}
+
+void bakeGround(std::vector<StaticBatch>& batches) {
+    const float size = scene.header->groundSize;
+    const float ground[4][3] = {
+        { -size, 0.0f, -size }, { -size, 0.0f, size }, { size, 0.0f, size }, { size, 0.0f, -size }
+    };
+    bakeQuad(staticBatch(batches, GL_TRIANGLES, 0.3f, 0.6f, 0.3f), 0.0f, 0.0f, 0.0f, ground);
+
+    StaticBatch& grass = staticBatch(batches, GL_LINES, 0.2f, 0.5f, 0.2f);
+    for (float x = -10.0f; x <= 10.0f; x += 1.0f) {
+        for (float z = -10.0f; z <= 10.0f; z += 1.0f) {
+            if (!isGrassSpot(x, z))
+                continue;
+            pushVertex(grass.vertices, x - 0.1f, 0.01f, z - 0.1f);
+            pushVertex(grass.vertices, x + 0.1f, 0.01f, z + 0.1f);
+            pushVertex(grass.vertices, x - 0.1f, 0.01f, z + 0.1f);
+            pushVertex(grass.vertices, x + 0.1f, 0.01f, z - 0.1f);
+        }
+    }
+}
+
+void bakeHouse(std::vector<StaticBatch>& batches, const SceneHouse& house) {
+    const float hx = house.x, hy = house.y, hz = house.z;
+    bakeCube(staticBatch(batches, GL_TRIANGLES, 0.8f, 0.8f, 0.8f), hx, hy, hz, 2.0f, 1.5f, 2.0f);
+
+    StaticBatch& roof = staticBatch(batches, GL_TRIANGLES, 0.6f, 0.3f, 0.1f);
+    for (int side = 0; side < 2; ++side) {
+        float z = side ? -1.0f : 1.0f;
+        pushVertex(roof.vertices, hx - 1.0f, hy + 0.75f, hz + z);
+        pushVertex(roof.vertices, hx + 1.0f, hy + 0.75f, hz + z);
+        pushVertex(roof.vertices, hx, hy + 1.75f, hz + z);
+    }
+    static const float slopes[2][4][3] = {
+        { { -1.0f, 0.75f, 1.0f }, { -1.0f, 0.75f, -1.0f }, { 0.0f, 1.75f, -1.0f }, { 0.0f, 1.75f, 1.0f } },
+        { {  1.0f, 0.75f, 1.0f }, {  1.0f, 0.75f, -1.0f }, { 0.0f, 1.75f, -1.0f }, { 0.0f, 1.75f, 1.0f } }
+    };
+    bakeQuad(roof, hx, hy, hz, slopes[0]);
+    bakeQuad(roof, hx, hy, hz, slopes[1]);
+
+    static const float pane[4][3] = {
+        { -0.25f, -0.25f, 0.0f }, { 0.25f, -0.25f, 0.0f }, { 0.25f, 0.25f, 0.0f }, { -0.25f, 0.25f, 0.0f }
+    };
+    StaticBatch& glass = staticBatch(batches, GL_TRIANGLES, 0.9f, 0.9f, 1.0f);
+    StaticBatch& frames = staticBatch(batches, GL_LINES, 0.0f, 0.0f, 0.0f);
+    for (int side = 0; side < 2; ++side) {
+        float wx = hx + (side ? 0.6f : -0.6f), wy = hy, wz = hz + 1.01f;
+        bakeQuad(glass, wx, wy, wz, pane);
+        pushVertex(frames.vertices, wx - 0.25f, wy, wz + 0.01f);
+        pushVertex(frames.vertices, wx + 0.25f, wy, wz + 0.01f);
+        pushVertex(frames.vertices, wx, wy - 0.25f, wz + 0.01f);
+        pushVertex(frames.vertices, wx, wy + 0.25f, wz + 0.01f);
+    }
+
+    bakeCube(staticBatch(batches, GL_TRIANGLES, 0.5f, 0.3f, 0.3f), hx + 0.6f, hy + 1.2f, hz - 0.3f, 0.3f, 0.6f, 0.3f);
+}
+
+// The door quads, placed by each house's door hinge node; every house's
+// door opens and closes together.
+void bakeDoor(bool open) {
+    static const float door[4][2] = { { -0.25f, 0.0f }, { 0.25f, 0.0f }, { 0.25f, 0.75f }, { -0.25f, 0.75f } };
+    static const int corners[6] = { 0, 1, 2, 0, 2, 3 };
+    const StaticBatch& batch = staticScene.batches[staticScene.doorBatch];
+    float* v = staticScene.vertices.data() + batch.first * 3;
+    for (uint32_t i = 0; i < scene.header->houseCount; ++i) {
+        const Mat4& hinge = sceneGraph.world[sceneGraph.houseBase + i * HOUSE_NODES + 1];
+        for (int c = 0; c < 6; ++c, v += 3)
+            mat4TransformPoint(hinge, door[corners[c]][0], door[corners[c]][1], 0.0f, v);
+    }
+    if (staticScene.vbo && batch.count > 0) {
+        gl.BindBuffer(GL_ARRAY_BUFFER, staticScene.vbo);
+        gl.BufferSubData(GL_ARRAY_BUFFER, batch.first * 3 * sizeof(float), batch.count * 3 * sizeof(float),
+                         staticScene.vertices.data() + batch.first * 3);
+        gl.BindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+    staticScene.doorOpen = open;
+}
+
+void bakeStaticScene() {
+    std::vector<StaticBatch> batches;
+    if (!useWorld) { // The tiles are the ground, and the clear colour is the sky
+        bakeSky(batches);
+        bakeGround(batches);
+    }
+    for (uint32_t i = 0; i < scene.header->houseCount; ++i)
+        bakeHouse(batches, scene.houses[i]);
+    StaticBatch door = { GL_TRIANGLES, 0.4f, 0.2f, 0.0f, 0, 0 };
+    door.vertices.resize(18 * scene.header->houseCount);
+    batches.push_back(door);
+
+    staticScene.vertices.clear();
+    for (size_t i = 0; i < batches.size(); ++i) {
+        batches[i].first = (GLint)(staticScene.vertices.size() / 3);
+        batches[i].count = (GLsizei)(batches[i].vertices.size() / 3);
+        staticScene.vertices.insert(staticScene.vertices.end(), batches[i].vertices.begin(), batches[i].vertices.end());
+        std::vector<float>().swap(batches[i].vertices);
+    }
+    staticScene.batches.swap(batches);
+    staticScene.doorBatch = (int)staticScene.batches.size() - 1;
+
+    if (gl.hasBuffers) {
+        gl.GenBuffers(1, &staticScene.vbo);
+        gl.BindBuffer(GL_ARRAY_BUFFER, staticScene.vbo);
+        gl.BufferData(GL_ARRAY_BUFFER, staticScene.vertices.size() * sizeof(float), staticScene.vertices.data(),
+                      GL_STATIC_DRAW);
+        gl.BindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+    bakeDoor(renderView.doorOpen);
+    staticScene.baked = true;
+}
+
+void drawStaticScene() {
+    if (!staticScene.baked)
+        bakeStaticScene();
+    if (staticScene.doorOpen != renderView.doorOpen)
+        bakeDoor(renderView.doorOpen);
+
+    if (staticScene.vbo) {
+        gl.BindBuffer(GL_ARRAY_BUFFER, staticScene.vbo);
+        glVertexPointer(3, GL_FLOAT, 0, nullptr);
+    } else {
+        glVertexPointer(3, GL_FLOAT, 0, staticScene.vertices.data());
+    }
+    for (size_t i = 0; i < staticScene.batches.size(); ++i) {
+        const StaticBatch& batch = staticScene.batches[i];
+        glColor3f(batch.r, batch.g, batch.b);
+        glDrawArrays(batch.mode, batch.first, batch.count);
+        renderStats.drawCalls++;
+        renderStats.vertices += batch.count;
+    }
+    if (staticScene.vbo)
+        gl.BindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void destroyStaticScene() {
+    if (staticScene.vbo)
+        gl.DeleteBuffers(1, &staticScene.vbo);
+    staticScene = StaticScene();
+    staticScene.doorBatch = -1;
+}
+
+// World tiles (--world): the garden sits in the middle of an endless ground
+// cut into TILE_SIZE squares. Each tile has its own houses, ponds, trees,
+// grass and a slice of clouds. The tile clouds are baked with the rest of
+// the tile and stay put while the garden's own clouds drift. Tiles come from
+// DIR/tile_X_Z.rscn, a binary scene in tile-local coordinates, when
+// --world-dir holds one, and are otherwise generated from the tile
+// coordinate and --seed, so a seed always grows the same world.
+//
+// The tiles within TILE_RADIUS of the camera are kept loaded. A loader
+// thread fills one of a fixed set of slots with a tile's vertices, and the
+// render thread uploads at most TILE_UPLOADS_PER_FRAME finished tiles a
+// frame into the slot's own buffer. Tiles that end up more than a tile
+// outside the radius give their slot back. Slots, their vertex arrays and
+// their buffers are sized once for the fullest tile a file or the
+// generator can produce. Memory and frame cost therefore stay the same
+// however far the camera goes, and neither thread touches the heap once
+// the world is running.
+const float TILE_SIZE = 32.0f;
+const int TILE_RADIUS = 2;                  // Tiles loaded on each side of the camera's
+const int TILE_KEEP = TILE_RADIUS + 1;      // Tiles further than this are dropped
+const int TILE_SPAN = 2 * TILE_RADIUS + 1;
+const int TILE_SLOTS = (2 * TILE_KEEP + 1) * (2 * TILE_KEEP + 1);
+const int TILE_UPLOADS_PER_FRAME = 2;
+const int TILE_MAX_HOUSES = 2;
+const int TILE_MAX_PONDS = 2;
+const int TILE_MAX_TREES = 12;
+const int TILE_MAX_CLOUDS = 3;
+const float TILE_GRASS_STEP = 2.0f;
+const float TILE_HOME = 12.0f;              // Generated objects keep at least this far from the garden's centre
+
+struct TileContent {
+    int houses, ponds, trees, clouds;
+    SceneHouse house[TILE_MAX_HOUSES];
+    ScenePond pond[TILE_MAX_PONDS];
+    TreePlacement tree[TILE_MAX_TREES];
+    SceneCloud cloud[TILE_MAX_CLOUDS];
+    CloudPuff puffs[TILE_MAX_CLOUDS][PUFFS_PER_CLOUD];
+};
+
+enum TileState {
+    TILE_FREE,
+    TILE_LOADING,   // Owned by the loader thread
+    TILE_READY,     // Vertices built, not yet uploaded
+    TILE_RESIDENT
+};
+
+struct TileSlot {
+    int tx, tz;
+    std::atomic<int> state;
+    bool fromFile;
+    TileContent content;
+    std::vector<StaticBatch> batches;   // Same order in every slot; firsts are fixed offsets into vbo
+    GLuint vbo;
+};
+
+struct World {
+    bool running;
+    bool primed;                        // The first frame's tiles are loaded before it is drawn
+    TileSlot slots[TILE_SLOTS];
+    int order[TILE_SPAN * TILE_SPAN][2]; // Tile offsets around the camera's, nearest first
+    int cloudBatch;                      // Index of the blended batch, drawn with the clouds
+    Mesh canopy, trunk;                  // LOD_LOW templates, scaled into place by the loader
+    float pondCircle[(POND_SEGMENTS + 1) * 2];
+    std::thread loader;
+    std::mutex lock;
+    std::condition_variable wake;
+    int queue[TILE_SLOTS];
+    int queueHead, queueCount;
+    bool stop;
+    float home;                          // Half-width of the square around the garden left to it
+    int uploads, unloads, fileTiles;
+};
+
+World world;
+
+Rng tileRng(int tx, int tz) {
+    Rng rng = { rngMix(rngStream(RNG_TILES).key ^ rngMix(((uint64_t)(uint32_t)tx << 32) | (uint32_t)tz)), 0 };
+    return rng;
+}
+
+// Whether something of radius r at (x, z) keeps clear of what the tile
+// already holds.
+bool tileSpotFree(const TileContent& c, float x, float z, float r) {
+    for (int i = 0; i < c.houses; ++i) {
+        if (fabsf(x - c.house[i].x) < 1.5f + r && fabsf(z - c.house[i].z) < 1.5f + r)
+            return false;
+    }
+    for (int i = 0; i < c.ponds; ++i) {
+        float dx = x - c.pond[i].x, dz = z - c.pond[i].z, d = c.pond[i].radius + 0.2f + r;
+        if (dx * dx + dz * dz < d * d)
+            return false;
+    }
+    return true;
+}
+
+void tilePuffs(TileContent& c, Rng& rng) {
+    for (int i = 0; i < c.clouds; ++i) {
+        float width = c.cloud[i].width;
+        for (int j = 0; j < PUFFS_PER_CLOUD; ++j) {
+            CloudPuff& puff = c.puffs[i][j];
+            puff.x = rngRange(rng, -0.5f, 0.5f) * width * 0.5f;
+            puff.y = rngRange(rng, -0.25f, 0.25f) * 0.5f;
+            puff.z = rngRange(rng, -0.5f, 0.5f) * width * 0.5f;
+            puff.size = rngRange(rng, 0.5f, 1.0f);
+            puff.alpha = 1.0f;
+        }
+    }
+}
+
+// Up to the tile maxima, each placed a few times before it is given up.
+// full asks for every maximum, placed anywhere; it sizes the slots.
+void generateTile(TileContent& c, int tx, int tz, bool full) {
+    Rng rng = tileRng(tx, tz);
+    const float ox = tx * TILE_SIZE, oz = tz * TILE_SIZE, margin = 3.0f;
+    const int wanted[4] = {
+        full ? TILE_MAX_HOUSES : (int)rngRange(rng, 0.0f, TILE_MAX_HOUSES + 0.99f),
+        full ? TILE_MAX_PONDS : (int)rngRange(rng, 0.0f, TILE_MAX_PONDS + 0.99f),
+        full ? TILE_MAX_TREES : (int)rngRange(rng, 2.0f, TILE_MAX_TREES + 0.99f),
+        full ? TILE_MAX_CLOUDS : (int)rngRange(rng, 0.0f, TILE_MAX_CLOUDS + 0.99f)
+    };
+    c.houses = c.ponds = c.trees = c.clouds = 0;
+    for (int kind = 0; kind < 3; ++kind) {
+        for (int n = 0; n < wanted[kind]; ++n) {
+            for (int attempt = 0; attempt < 8; ++attempt) {
+                float x = ox + rngRange(rng, margin, TILE_SIZE - margin);
+                float z = oz + rngRange(rng, margin, TILE_SIZE - margin);
+                float radius = kind == 1 ? rngRange(rng, 1.0f, 2.5f) : 0.6f;
+                bool home = fabsf(x) < world.home && fabsf(z) < world.home;
+                if (!full && (home || !tileSpotFree(c, x, z, kind == 0 ? 1.5f : radius)))
+                    continue;
+                if (kind == 0) {
+                    SceneHouse house = { x, 0.75f, z };
+                    c.house[c.houses++] = house;
+                } else if (kind == 1) {
+                    ScenePond pond = { x, 0.01f, z, radius };
+                    c.pond[c.ponds++] = pond;
+                } else {
+                    TreePlacement tree = { x, -0.5f, z }; // The trunk starts 0.5 above the placement
+                    c.tree[c.trees++] = tree;
+                }
+                break;
+            }
+        }
+    }
+    for (int n = 0; n < wanted[3]; ++n) {
+        SceneCloud cloud = { ox + rngRange(rng, 0.0f, TILE_SIZE), rngRange(rng, 4.0f, 8.0f),
+                             oz + rngRange(rng, 0.0f, TILE_SIZE), 0.0f, rngRange(rng, 1.5f, 2.5f) };
+        c.cloud[c.clouds++] = cloud;
+    }
+    tilePuffs(c, rng);
+}
+
+// DIR/tile_X_Z.rscn, if there is one. Counts past the tile maxima are
+// dropped. Everything here stays off operator new: the loader runs while
+// frames are checked for heap allocations.
+bool loadTileFile(TileContent& c, int tx, int tz) {
+#ifdef _WIN32
+    return false;
+#else
+    if (worldDir.empty())
+        return false;
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/tile_%d_%d.rscn", worldDir.c_str(), tx, tz);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    void* map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(SceneHeader))
+        map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return false;
+    const SceneHeader* h = (const SceneHeader*)map;
+    const char* base = (const char*)map;
+    size_t size = st.st_size;
+    bool ok = memcmp(h->magic, SCENE_MAGIC, sizeof(h->magic)) == 0 && h->version == SCENE_VERSION &&
+              sceneArrayFits(size, h->houseOffset, h->houseCount, sizeof(SceneHouse)) &&
+              sceneArrayFits(size, h->pondOffset, h->pondCount, sizeof(ScenePond)) &&
+              sceneArrayFits(size, h->treeOffset, h->treeCount, sizeof(TreePlacement)) &&
+              sceneArrayFits(size, h->cloudOffset, h->cloudCount, sizeof(SceneCloud));
+    if (ok) {
+        const float ox = tx * TILE_SIZE, oz = tz * TILE_SIZE;
+        c.houses = std::min((int)h->houseCount, TILE_MAX_HOUSES);
+        c.ponds = std::min((int)h->pondCount, TILE_MAX_PONDS);
+        c.trees = std::min((int)h->treeCount, TILE_MAX_TREES);
+        c.clouds = std::min((int)h->cloudCount, TILE_MAX_CLOUDS);
+        memcpy(c.house, base + h->houseOffset, c.houses * sizeof(SceneHouse));
+        memcpy(c.pond, base + h->pondOffset, c.ponds * sizeof(ScenePond));
+        memcpy(c.tree, base + h->treeOffset, c.trees * sizeof(TreePlacement));
+        memcpy(c.cloud, base + h->cloudOffset, c.clouds * sizeof(SceneCloud));
+        for (int i = 0; i < c.houses; ++i) { c.house[i].x += ox; c.house[i].z += oz; }
+        for (int i = 0; i < c.ponds; ++i) { c.pond[i].x += ox; c.pond[i].z += oz; }
+        for (int i = 0; i < c.trees; ++i) { c.tree[i].x += ox; c.tree[i].z += oz; }
+        for (int i = 0; i < c.clouds; ++i) { c.cloud[i].x += ox; c.cloud[i].z += oz; }
+        Rng rng = tileRng(tx, tz);
+        tilePuffs(c, rng);
+    }
+    munmap(map, size);
+    return ok;
+#endif
+}
+
+// The sphere can roll out of the garden onto the tiles. A tile's contents
+// follow from its coordinate alone, so the simulation builds colliders for
+// the tiles under the sphere itself rather than using the slots the render
+// thread has loaded. That way a replay doesn't depend on the loader's
+// timing. The few tiles the sphere touches are kept in a small cache that
+// initWorld clears.
+const int TILE_MAX_COLLIDERS = TILE_MAX_HOUSES * HOUSE_COLLIDERS + TILE_MAX_TREES * TREE_COLLIDERS + TILE_MAX_PONDS;
+const int TILE_COLLIDER_CACHE = 4;  // A sphere smaller than a tile touches at most four
+
+struct TileColliders {
+    bool used;
+    int tx, tz;
+    int count;
+    Collider colliders[TILE_MAX_COLLIDERS];
+};
+
+TileColliders tileColliderCache[TILE_COLLIDER_CACHE];
+int tileColliderNext = 0;   // Entry the next miss replaces
+
+const TileColliders& tileColliders(int tx, int tz) {
+    for (int i = 0; i < TILE_COLLIDER_CACHE; ++i) {
+        const TileColliders& t = tileColliderCache[i];
+        if (t.used && t.tx == tx && t.tz == tz)
+            return t;
+    }
+    TileColliders& t = tileColliderCache[tileColliderNext];
+    tileColliderNext = (tileColliderNext + 1) % TILE_COLLIDER_CACHE;
+    TileContent c;
+    if (!loadTileFile(c, tx, tz))
+        generateTile(c, tx, tz, false);
+    t.used = true;
+    t.tx = tx;
+    t.tz = tz;
+    t.count = 0;
+    for (int i = 0; i < c.houses; ++i)
+        t.count += houseColliders(c.house[i], t.colliders + t.count);
+    for (int i = 0; i < c.trees; ++i)
+        t.count += treeColliders(c.tree[i], t.colliders + t.count);
+    for (int i = 0; i < c.ponds; ++i)
+        t.colliders[t.count++] = pondCollider(c.pond[i]);
+    return t;
+}
+
+bool sphereHitsTiles(float x, float y, float z, float r) {
+    if (!useWorld)
+        return false;
+    const int tx0 = (int)floorf((x - r) / TILE_SIZE), tx1 = (int)floorf((x + r) / TILE_SIZE);
+    const int tz0 = (int)floorf((z - r) / TILE_SIZE), tz1 = (int)floorf((z + r) / TILE_SIZE);
+    for (int tz = tz0; tz <= tz1; ++tz) {
+        for (int tx = tx0; tx <= tx1; ++tx) {
+            const TileColliders& t = tileColliders(tx, tz);
+            for (int i = 0; i < t.count; ++i) {
+                if (sphereHitsCollider(t.colliders[i], x, y, z, r))
+                    return true;
+            }
+        }
+    }
+    return false;
+}
+
+void bakeScaledMesh(StaticBatch& batch, const Mesh& mesh, float x, float y, float z, float sx, float sy, float sz) {
+    const std::vector<float>& v = mesh.vertices;
+    for (size_t i = 0; i < v.size(); i += 3)
+        pushVertex(batch.vertices, x + v[i] * sx, y + v[i + 1] * sy, z + v[i + 2] * sz);
+}
+
+// Every batch a tile can fill, in slot order; bakeHouse finds its own
+// batches among them rather than adding new ones. The blended clouds go last.
+void addTileBatches(std::vector<StaticBatch>& batches) {
+    staticBatch(batches, GL_TRIANGLES, 0.3f, 0.6f, 0.3f);     // Ground
+    staticBatch(batches, GL_LINES, 0.2f, 0.5f, 0.2f);         // Grass
+    staticBatch(batches, GL_TRIANGLES, 0.8f, 0.8f, 0.8f);     // Walls
+    staticBatch(batches, GL_TRIANGLES, 0.6f, 0.3f, 0.1f);     // Roof
+    staticBatch(batches, GL_TRIANGLES, 0.9f, 0.9f, 1.0f);     // Windows
+    staticBatch(batches, GL_LINES, 0.0f, 0.0f, 0.0f);         // Window frames
+    staticBatch(batches, GL_TRIANGLES, 0.5f, 0.3f, 0.3f);     // Chimney
+    staticBatch(batches, GL_TRIANGLES, 0.4f, 0.2f, 0.0f);     // Doors, always closed
+    staticBatch(batches, GL_TRIANGLES, 0.22f, 0.44f, 0.7f);   // Water, as the blended pond looks on grass
+    staticBatch(batches, GL_TRIANGLES, 0.6f, 0.5f, 0.3f);     // Pond banks
+    staticBatch(batches, GL_TRIANGLES, 0.5f, 0.3f, 0.1f);     // Trunks
+    staticBatch(batches, GL_TRIANGLES, 0.1f, 0.5f, 0.1f);     // Canopies
+    staticBatch(batches, GL_TRIANGLES, 1.0f, 1.0f, 1.0f);     // Clouds
+}
+
+// Fills a slot's batches from its content. allGrass puts a tuft on every
+// grass spot, for sizing.
+void bakeTile(TileSlot& slot, bool allGrass) {
+    std::vector<StaticBatch>& b = slot.batches;
+    for (size_t i = 0; i < b.size(); ++i)
+        b[i].vertices.clear();
+    const TileContent& c = slot.content;
+    const float ox = slot.tx * TILE_SIZE, oz = slot.tz * TILE_SIZE;
+
+    const float ground[4][3] = {
+        { 0.0f, 0.0f, 0.0f }, { 0.0f, 0.0f, TILE_SIZE }, { TILE_SIZE, 0.0f, TILE_SIZE }, { TILE_SIZE, 0.0f, 0.0f }
+    };
+    bakeQuad(b[0], ox, 0.0f, oz, ground);
+    for (float x = ox + TILE_GRASS_STEP * 0.5f; x < ox + TILE_SIZE; x += TILE_GRASS_STEP) {
+        for (float z = oz + TILE_GRASS_STEP * 0.5f; z < oz + TILE_SIZE; z += TILE_GRASS_STEP) {
+            if (!allGrass && (!isGrassSpot(x, z) || !tileSpotFree(c, x, z, 0.0f)))
+                continue;
+            pushVertex(b[1].vertices, x - 0.1f, 0.01f, z - 0.1f);
+            pushVertex(b[1].vertices, x + 0.1f, 0.01f, z + 0.1f);
+            pushVertex(b[1].vertices, x - 0.1f, 0.01f, z + 0.1f);
+            pushVertex(b[1].vertices, x + 0.1f, 0.01f, z - 0.1f);
+        }
+    }
+
+    static const float door[4][3] = {
+        { -0.25f, -0.5f, 1.01f }, { 0.25f, -0.5f, 1.01f }, { 0.25f, 0.25f, 1.01f }, { -0.25f, 0.25f, 1.01f }
+    };
+    for (int i = 0; i < c.houses; ++i) {
+        bakeHouse(b, c.house[i]);
+        bakeQuad(b[7], c.house[i].x, c.house[i].y, c.house[i].z, door);
+    }
+
+    const float* circle = world.pondCircle;
+    for (int i = 0; i < c.ponds; ++i) {
+        const ScenePond& p = c.pond[i];
+        for (int j = 0; j < POND_SEGMENTS; ++j) {
+            const float* a = circle + j * 2;
+            const float* n = circle + j * 2 + 2;
+            pushVertex(b[8].vertices, p.x, p.y, p.z);
+            pushVertex(b[8].vertices, p.x + a[0] * p.radius, p.y, p.z + a[1] * p.radius);
+            pushVertex(b[8].vertices, p.x + n[0] * p.radius, p.y, p.z + n[1] * p.radius);
+            // The bank, as buildPondRimMesh's strip
+            float outer = p.radius * 1.1f;
+            const float a0[3] = { p.x + a[0] * outer, p.y + 0.05f, p.z + a[1] * outer };
+            const float b0[3] = { p.x + a[0] * p.radius, p.y + 0.01f, p.z + a[1] * p.radius };
+            const float a1[3] = { p.x + n[0] * outer, p.y + 0.05f, p.z + n[1] * outer };
+            const float b1[3] = { p.x + n[0] * p.radius, p.y + 0.01f, p.z + n[1] * p.radius };
+            pushStripQuad(b[9].vertices, a0, b0, a1, b1);
+        }
+    }
+
+    for (int i = 0; i < c.trees; ++i) {
+        const TreePlacement& t = c.tree[i];
+        bakeScaledMesh(b[10], world.trunk, t.x, t.y + 0.5f, t.z, 0.15f, 1.0f, 0.15f);
+        bakeScaledMesh(b[11], world.canopy, t.x, t.y + 1.5f, t.z, 0.5f, 0.5f, 0.5f);
+        bakeScaledMesh(b[11], world.canopy, t.x, t.y + 1.8f, t.z, 0.4f, 0.4f, 0.4f);
+        bakeScaledMesh(b[11], world.canopy, t.x, t.y + 2.1f, t.z, 0.3f, 0.3f, 0.3f);
+    }
+
+    for (int i = 0; i < c.clouds; ++i) {
+        for (int j = 0; j < PUFFS_PER_CLOUD; ++j) {
+            const CloudPuff& puff = c.puffs[i][j];
+            bakeScaledMesh(b[world.cloudBatch], world.canopy, c.cloud[i].x + puff.x, c.cloud[i].y + puff.y,
+                           c.cloud[i].z + puff.z, puff.size, puff.size, puff.size);
+        }
+    }
+}
+
+void tileLoader() {
+    for (;;) {
+        int s;
+        {
+            std::unique_lock<std::mutex> lock(world.lock);
+            world.wake.wait(lock, [] { return world.stop || world.queueCount > 0; });
+            if (world.stop)
+                return;
+            s = world.queue[world.queueHead];
+            world.queueHead = (world.queueHead + 1) % TILE_SLOTS;
+            world.queueCount--;
+        }
+        TileSlot& slot = world.slots[s];
+        slot.fromFile = loadTileFile(slot.content, slot.tx, slot.tz);
+        if (!slot.fromFile)
+            generateTile(slot.content, slot.tx, slot.tz, false);
+        bakeTile(slot, false);
+        slot.state.store(TILE_READY, std::memory_order_release);
+    }
+}
+
+// Sizes every slot for the fullest tile, makes its buffer and starts the
+// loader. Called from initScene once GL is up.
+void initWorld() {
+    if (!useWorld || world.running)
+        return;
+    buildSphereMesh(world.canopy, lodSlices[LOD_LOW], lodSlices[LOD_LOW]);
+    buildCylinderMesh(world.trunk, 0.1f / 0.15f, lodSlices[LOD_LOW]);
+    circlePoints(world.pondCircle, 1.0f, POND_SEGMENTS);
+    for (int i = 0; i < TILE_COLLIDER_CACHE; ++i)
+        tileColliderCache[i].used = false;
+    world.home = TILE_HOME;
+    for (uint32_t i = 0; i < scene.header->houseCount; ++i)
+        world.home = std::max(world.home, std::max(fabsf(scene.houses[i].x), fabsf(scene.houses[i].z)) + 3.0f);
+    for (uint32_t i = 0; i < scene.header->pondCount; ++i)
+        world.home = std::max(world.home, std::max(fabsf(scene.ponds[i].x), fabsf(scene.ponds[i].z)) +
+                                              scene.ponds[i].radius + 1.0f);
+
+    int n = 0;
+    for (int ring = 0; ring <= TILE_RADIUS; ++ring) {
+        for (int dz = -ring; dz <= ring; ++dz) {
+            for (int dx = -ring; dx <= ring; ++dx) {
+                if (std::max(abs(dx), abs(dz)) != ring)
+                    continue;
+                world.order[n][0] = dx;
+                world.order[n][1] = dz;
+                n++;
+            }
+        }
+    }
+
+    // A full tile, every grass spot taken, gives each batch's capacity
+    TileSlot& sizing = world.slots[0];
+    addTileBatches(sizing.batches);
+    world.cloudBatch = (int)sizing.batches.size() - 1;
+    sizing.tx = sizing.tz = 0;
+    generateTile(sizing.content, 0, 0, true);
+    bakeTile(sizing, true);
+    std::vector<size_t> capacity(sizing.batches.size());
+    size_t floats = 0;
+    for (size_t i = 0; i < capacity.size(); ++i) {
+        capacity[i] = sizing.batches[i].vertices.size();
+        floats += capacity[i];
+    }
+
+    for (int s = 0; s < TILE_SLOTS; ++s) {
+        TileSlot& slot = world.slots[s];
+        if (s > 0)
+            addTileBatches(slot.batches);
+        GLint first = 0;
+        for (size_t i = 0; i < slot.batches.size(); ++i) {
+            slot.batches[i].vertices.clear();
+            slot.batches[i].vertices.reserve(capacity[i]);
+            slot.batches[i].first = first;
+            slot.batches[i].count = 0;
+            first += (GLint)(capacity[i] / 3);
+        }
+        slot.state.store(TILE_FREE);
+        slot.vbo = 0;
+        if (gl.hasBuffers) {
+            gl.GenBuffers(1, &slot.vbo);
+            gl.BindBuffer(GL_ARRAY_BUFFER, slot.vbo);
+            gl.BufferData(GL_ARRAY_BUFFER, floats * sizeof(float), nullptr, GL_STATIC_DRAW);
+        }
+    }
+    if (gl.hasBuffers)
+        gl.BindBuffer(GL_ARRAY_BUFFER, 0);
+
+    world.queueHead = world.queueCount = 0;
+    world.stop = false;
+    world.primed = false;
+    world.uploads = world.unloads = world.fileTiles = 0;
+    world.loader = std::thread(tileLoader);
+    world.running = true;
+    LOG(LOG_INFO, "World: %d tile slots of %zu KB, %d tiles around the camera", TILE_SLOTS,
+        floats * sizeof(float) / 1024, TILE_SPAN * TILE_SPAN);
+}
+
+void destroyWorld() {
+    if (!world.running)
+        return;
+    {
+        std::lock_guard<std::mutex> lock(world.lock);
+        world.stop = true;
+    }
+    world.wake.notify_one();
+    world.loader.join();
+    for (int s = 0; s < TILE_SLOTS; ++s) {
+        TileSlot& slot = world.slots[s];
+        if (slot.vbo)
+            gl.DeleteBuffers(1, &slot.vbo);
+        slot.vbo = 0;
+        std::vector<StaticBatch>().swap(slot.batches);
+        slot.state.store(TILE_FREE);
+    }
+    world.canopy.vertices.clear();
+    world.trunk.vertices.clear();
+    world.running = false;
+}
+
+void uploadTile(TileSlot& slot) {
+    for (size_t i = 0; i < slot.batches.size(); ++i) {
+        StaticBatch& batch = slot.batches[i];
+        batch.count = (GLsizei)(batch.vertices.size() / 3);
+        if (slot.vbo && batch.count > 0) {
+            gl.BindBuffer(GL_ARRAY_BUFFER, slot.vbo);
+            gl.BufferSubData(GL_ARRAY_BUFFER, batch.first * 3 * sizeof(float), batch.vertices.size() * sizeof(float),
+                             batch.vertices.data());
+        }
+    }
+    if (slot.vbo)
+        gl.BindBuffer(GL_ARRAY_BUFFER, 0);
+    slot.state.store(TILE_RESIDENT, std::memory_order_relaxed);
+    world.uploads++;
+    world.fileTiles += slot.fromFile;
+}
+
+// Where the main camera is, from the same orbit lookAtScene builds.
+void cameraGroundPosition(float& x, float& z) {
+    float cx, cy, cz;
+    sceneFocus(cx, cy, cz);
+    float radX = cameraAngleX * M_PI / 180.0f;
+    float radY = cameraAngleY * M_PI / 180.0f;
+    x = cx + worldFocusX + cameraDistance * cos(radY) * sin(radX);
+    z = cz + worldFocusZ + cameraDistance * cos(radY) * cos(radX);
+}
+
+// Once a frame on the render thread: drops tiles that are too far, uploads
+// finished ones and queues the missing ones nearest first. The first call
+// waits for every tile around the camera, so a run starts with the same
+// world on screen whatever the loader's timing.
+void updateWorld() {
+    if (!world.running)
+        return;
+    PROFILE_STAGE(LANE_RENDER, STAGE_WORLD);
+    worldFocusX += worldDrift;
+    float camX, camZ;
+    cameraGroundPosition(camX, camZ);
+    const int cx = (int)floorf(camX / TILE_SIZE), cz = (int)floorf(camZ / TILE_SIZE);
+
+    for (int s = 0; s < TILE_SLOTS; ++s) {
+        TileSlot& slot = world.slots[s];
+        int state = slot.state.load(std::memory_order_acquire);
+        if ((state == TILE_READY || state == TILE_RESIDENT) &&
+            std::max(abs(slot.tx - cx), abs(slot.tz - cz)) > TILE_KEEP) {
+            slot.state.store(TILE_FREE, std::memory_order_relaxed);
+            world.unloads++;
+        }
+    }
+
+    int queued = 0;
+    for (int k = 0; k < TILE_SPAN * TILE_SPAN; ++k) {
+        int tx = cx + world.order[k][0], tz = cz + world.order[k][1];
+        int freeSlot = -1;
+        bool present = false;
+        for (int s = 0; s < TILE_SLOTS && !present; ++s) {
+            const TileSlot& slot = world.slots[s];
+            int state = slot.state.load(std::memory_order_relaxed);
+            if (state == TILE_FREE)
+                freeSlot = freeSlot < 0 ? s : freeSlot;
+            else
+                present = slot.tx == tx && slot.tz == tz;
+        }
+        if (present || freeSlot < 0)
+            continue;
+        TileSlot& slot = world.slots[freeSlot];
+        slot.tx = tx;
+        slot.tz = tz;
+        slot.state.store(TILE_LOADING, std::memory_order_relaxed);
+        {
+            std::lock_guard<std::mutex> lock(world.lock);
+            world.queue[(world.queueHead + world.queueCount) % TILE_SLOTS] = freeSlot;
+            world.queueCount++;
+        }
+        queued++;
+    }
+    if (queued > 0)
+        world.wake.notify_one();
+
+    int uploads = 0;
+    for (int s = 0; s < TILE_SLOTS; ++s) {
+        TileSlot& slot = world.slots[s];
+        if (!world.primed) {
+            while (slot.state.load(std::memory_order_acquire) == TILE_LOADING)
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        if (slot.state.load(std::memory_order_acquire) != TILE_READY)
+            continue;
+        if (world.primed && uploads == TILE_UPLOADS_PER_FRAME)
+            break;
+        uploadTile(slot);
+        uploads++;
+    }
+    world.primed = true;
+}
+
+// The resident tiles in view; clouds selects the blended cloud batch
+// instead of the opaque ones.
+void drawWorldTiles(bool clouds) {
+    if (!world.running)
+        return;
+    if (clouds) {
+        glEnable(GL_BLEND);
+        glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    }
+    const float half = TILE_SIZE * 0.5f;
+    for (int s = 0; s < TILE_SLOTS; ++s) {
+        const TileSlot& slot = world.slots[s];
+        if (slot.state.load(std::memory_order_relaxed) != TILE_RESIDENT)
+            continue;
+        float x = slot.tx * TILE_SIZE + half, z = slot.tz * TILE_SIZE + half;
+        if (!sphereInView(x, clouds ? 6.0f : 1.0f, z, half * 1.5f))
+            continue;
+        if (slot.vbo) {
+            gl.BindBuffer(GL_ARRAY_BUFFER, slot.vbo);
+            glVertexPointer(3, GL_FLOAT, 0, nullptr);
+        }
+        for (size_t i = 0; i < slot.batches.size(); ++i) {
+            if (((int)i == world.cloudBatch) != clouds)
+                continue;
+            const StaticBatch& batch = slot.batches[i];
+            if (batch.count == 0)
+                continue;
+            if (clouds)
+                glColor4f(batch.r, batch.g, batch.b, 0.8f);
+            else
+                glColor3f(batch.r, batch.g, batch.b);
+            if (slot.vbo) {
+                glDrawArrays(batch.mode, batch.first, batch.count);
+            } else {
+                glVertexPointer(3, GL_FLOAT, 0, batch.vertices.data());
+                glDrawArrays(batch.mode, 0, batch.count);
+            }
+            renderStats.drawCalls++;
+            renderStats.vertices += batch.count;
+        }
+    }
+    if (gl.hasBuffers)
+        gl.BindBuffer(GL_ARRAY_BUFFER, 0);
+    if (clouds)
+        glDisable(GL_BLEND);
+}
+
+void printWorldStats() {
+    int resident = 0;
+    for (int s = 0; s < TILE_SLOTS; ++s)
+        resident += world.slots[s].state.load(std::memory_order_relaxed) == TILE_RESIDENT;
+    printf("World: focus (%.1f, %.1f), %d tiles resident, %d uploaded (%d from files), %d dropped\n",
+           worldFocusX, worldFocusZ, resident, world.uploads, world.fileTiles, world.unloads);
+}
+
+void drawControllableSphere() {
+    const Sphere& sphere = renderView.sphere;
+    float y = sphere.y + sphere.radius;
+    if (!sphereInView(sphere.x, y, sphere.z, sphere.radius))
+        return;
+    int slices = lodSlices[sphereLod(sphere.x, y, sphere.z, sphere.radius)];
+    glColor3f(1.0f, 0.5f, 0.0f);
+    pushNodeMatrix(sceneGraph.sphereNode);
+    drawSphere(sphere.radius, slices, slices);
+    glPopMatrix();
+}
+
+// Loads the look-at matrix for a camera orbiting the scene's focus and
+// builds the view frustum from it and the current projection.
+void lookAtScene(float distance, float angleX, float angleY) {
+    glMatrixMode(GL_MODELVIEW);
+    glLoadIdentity();
+
+    float radX = angleX * M_PI / 180.0f;
+    float radY = angleY * M_PI / 180.0f;
+    float centerX, centerY, centerZ;
+    sceneFocus(centerX, centerY, centerZ);
+    centerX += worldFocusX;
+    centerZ += worldFocusZ;
+    float eyeX = centerX + distance * cos(radY) * sin(radX);
+    float eyeY = centerY + distance * sin(radY);
+    float eyeZ = centerZ + distance * cos(radY) * cos(radX);
+    float upX = 0.0f, upY = 1.0f, upZ = 0.0f;
+
+    float fX = centerX - eyeX, fY = centerY - eyeY, fZ = centerZ - eyeZ;
+    float fLen = sqrt(fX * fX + fY * fY + fZ * fZ);
+    fX /= fLen; fY /= fLen; fZ /= fLen;
+
+    float sX = upY * fZ - upZ * fY;
+    float sY = upZ * fX - upX * fZ;
+    float sZ = upX * fY - upY * fX;
+    float sLen = sqrt(sX * sX + sY * sY + sZ * sZ);
+    sX /= sLen; sY /= sLen; sZ /= sLen;
+
+    float uX = fY * sZ - fZ * sY;
+    float uY = fZ * sX - fX * sZ;
+    float uZ = fX * sY - fY * sX;
+
+    float m[16] = {
+        sX, uX, -fX, 0,
+        sY, uY, -fY, 0,
+        sZ, uZ, -fZ, 0,
+        -(sX * eyeX + sY * eyeY + sZ * eyeZ),
+        -(uX * eyeX + uY * eyeY + uZ * eyeZ),
+        (fX * eyeX + fY * eyeY + fZ * eyeZ), 1
+    };
+    glMultMatrixf(m);
+    buildFrustum(m, eyeX, eyeY, eyeZ);
+}
+
+// Everything but the clear, once the frame's geometry has been streamed.
+void drawScene() {
+    // Opaque scenery first, so the blended clouds go over the house
+    if (useMeshCache) {
+        PROFILE_GPU_STAGE(STAGE_STATIC);
+        drawStaticScene();
+    } else {
+        if (!useWorld) {
+            PROFILE_GPU_STAGE(STAGE_SKY);
+            drawSkyImmediate();
+        }
+        if (!useWorld) {
+            PROFILE_GPU_STAGE(STAGE_GROUND);
+            drawGroundImmediate();
+        }
+        {
+            PROFILE_GPU_STAGE(STAGE_HOUSE);
+            drawHousesImmediate();
+        }
+    }
+    if (useWorld) {
+        PROFILE_GPU_STAGE(STAGE_TILES);
+        drawWorldTiles(false);
+    }
+    if (useCloudImpostors) {
+        // Impostors don't write depth, so the opaque trees must be in first
+        PROFILE_GPU_STAGE(STAGE_TREES);
+        drawTrees();
+    }
+    {
+        PROFILE_GPU_STAGE(STAGE_CLOUDS);
+        drawClouds();
+        drawWorldTiles(true);
+    }
+    if (!useCloudImpostors) {
+        PROFILE_GPU_STAGE(STAGE_TREES);
+        drawTrees();
+    }
+    {
+        PROFILE_GPU_STAGE(STAGE_POND);
+        drawPond();
+    }
+    if (gpuRainActive()) {
+        PROFILE_GPU_STAGE(STAGE_RAIN_STEP);
+        stepGpuRain(renderView.cur->tick);
+    }
+    {
+        PROFILE_GPU_STAGE(STAGE_PARTICLES);
+        drawParticles();
+    }
+    {
+        PROFILE_GPU_STAGE(STAGE_SPHERE);
+        drawControllableSphere();
+    }
+}
+
+void renderFrame() {
+    resetFrameArena();
+    renderStats.drawCalls = 0;
+    renderStats.vertices = 0;
+    {
+        PROFILE_GPU_STAGE(STAGE_CLEAR);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    }
+    updateWorld();
+    updateSceneGraph();
+    lookAtScene(cameraDistance, cameraAngleX, cameraAngleY);
+    cullScene();
+    streamFrame();
+
+    glClearColor(0.6f, 0.8f, 1.0f, 1.0f);
+    drawScene();
+    endStreamFrame();
+}
+
+#if HAVE_GLFW
+// Renders the scene at 1x, 10x and 100x the cloud and tree counts with and
+// without instancing, and reports frame time and primitive draw calls.
+void runInstancingBenchmark(GLFWwindow* window, int frames) {
+    const int baseClouds = numClouds, baseTrees = numTrees;
+    const bool baseInstancing = useInstancing;
+    const int scales[] = { 1, 10, 100 };
+
+    std::cout << "scale  clouds  trees  path          ms/frame  draw calls" << std::endl;
+    for (int s = 0; s < 3; ++s) {
+        numClouds = baseClouds * scales[s];
+        numTrees = baseTrees * scales[s];
+        initClouds();
+        initTrees();
+        for (int pass = 0; pass < 2; ++pass) {
+            useInstancing = pass == 1;
+            if (useInstancing && !instancingActive())
+                continue;
+            initSnapshots(nowSeconds());
+            buildRenderView(nowSeconds());
+            for (int i = 0; i < 5; ++i)
+                renderFrame();
+            glFinish();
+            double start = glfwGetTime();
+            long drawCalls = 0;
+            for (int i = 0; i < frames; ++i) {
+                runSingleTick();
+                buildRenderView(nowSeconds());
+                renderFrame();
+                drawCalls += renderStats.drawCalls;
+                glfwSwapBuffers(window);
+                glfwPollEvents();
+            }
+            glFinish();
+            double ms = (glfwGetTime() - start) * 1000.0 / frames;
+            printf("%4dx  %6d  %5d  %-12s  %8.3f  %10ld\n", scales[s], numClouds, numTrees,
+                   useInstancing ? "instanced" : "per-instance", ms, drawCalls / frames);
+        }
+    }
+
+    numClouds = baseClouds;
+    numTrees = baseTrees;
+    useInstancing = baseInstancing;
+}
+#endif
+
+// Sets the viewport and the perspective for a width x height target.
+void setProjection(int width, int height) {
+    glViewport(0, 0, width, height);
+    glMatrixMode(GL_PROJECTION);
+    float aspect = (float)width / height;
+    float fov = 45.0f, near = 0.1f;
+    float far = std::max(100.0f, scene.header ? 2.0f * scene.header->groundSize : 0.0f); // Sees across the ground
+    if (useWorld)
+        far = std::max(far, (TILE_RADIUS + 1) * TILE_SIZE * 1.5f);                     // ...or to the last tiles
+    float top = near * tan(fov * 3.14159f / 360.0f);
+    float right = top * aspect;
+    // glFrustum(-right, right, -top, top, near, far), kept for culling
+    float* p = projectionMatrix;
+    std::fill(p, p + 16, 0.0f);
+    p[0] = near / right;
+    p[5] = near / top;
+    p[10] = -(far + near) / (far - near);
+    p[11] = -1.0f;
+    p[14] = -2.0f * far * near / (far - near);
+    glLoadMatrixf(p);
+    viewportHeight = height;
+}
+
+void initGLState(int width, int height) {
+    glEnableClientState(GL_VERTEX_ARRAY);
+    initInstancing();
+    initStreamRing();
+    warmMeshCache();
+    initGpuRain();
+    initCloudImpostors();
+    initGpuTimers();
+
+    glClearColor(0.6f, 0.8f, 1.0f, 1.0f);
+    glEnable(GL_DEPTH_TEST);
+    glEnable(GL_POINT_SMOOTH);
+    glPointSize(8.0f);
+
+    setProjection(width, height);
+}
+
+void initScene() {
+    if (!scene.header)
+        loadDefaultScene();
+    initTrees();
+    initRipples();
+    initParticles();
+    initClouds();
+    initWorld();
+}
+
+void shutdownScene() {
+    stopSimulation();
+    stopRecording();
+    finishProfiler();
+    destroyInstancing();
+    destroyMeshCache();
+    destroyStaticScene();
+    destroyWorld();
+    destroyGpuRain();
+    destroyCloudImpostors();
+    destroyStreamRing();
+    destroyFrameArena();
+    stopJobSystem();
+    freeSnapshots();
+    freeParticleStore(particles);
+}
+
+// A camera pose and the size to render it at, for batch mode (--view).
+struct CameraView {
+    float distance, angleX, angleY;
+    int width, height;      // 0 takes the --size
+};
+
+// Headless mode renders a fixed number of frames, one simulation tick
+// each, into an offscreen framebuffer and optionally streams them out.
+struct HeadlessOptions {
+    int width, height;
+    int frames;
+    std::string ppmPrefix;  // Writes <prefix>00000.ppm, <prefix>00001.ppm, ...
+    std::string rawPath;    // Packed top-down RGB24 frames; "-" is stdout
+    std::vector<CameraView> views;  // Batch mode: all of them, every frame
+};
+
+// "DISTANCE,ANGLE_X,ANGLE_Y" or "DISTANCE,ANGLE_X,ANGLE_Y,WIDTHxHEIGHT"
+bool parseCameraView(const char* text, CameraView* view) {
+    view->width = view->height = 0;
+    int fields = sscanf(text, "%f,%f,%f,%dx%d", &view->distance, &view->angleX, &view->angleY, &view->width, &view->height);
+    if ((fields != 3 && fields != 5) || view->distance <= 0.0f || (fields == 5 && (view->width <= 0 || view->height <= 0))) {
+        std::cerr << "Bad view, expected DISTANCE,ANGLE_X,ANGLE_Y[,WIDTHxHEIGHT]: " << text << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// --views FILE: one view per line in the --view form; # starts a comment.
+bool loadCameraViews(const char* path, std::vector<CameraView>& views) {
+    FILE* f = fopen(path, "r");
+    if (!f) {
+        std::cerr << "Can't open views " << path << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    char line[256];
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "#\r\n")] = '\0';
+        char* text = line + strspn(line, " \t");
+        if (!*text)
+            continue;
+        CameraView view;
+        ok = parseCameraView(text, &view);
+        if (ok)
+            views.push_back(view);
+    }
+    fclose(f);
+    return ok;
+}
+
+// Frames are read back into a ring of pixel buffer objects and only mapped
+// FRAME_READBACK_DEPTH - 1 frames later, by which time the copy is done and
+// the map does not stall the pipeline.
+const int FRAME_READBACK_DEPTH = 3;
+
+struct FrameWriter {
+    const HeadlessOptions* options;
+    FILE* raw;
+    GLuint pbos[FRAME_READBACK_DEPTH];
+    std::vector<unsigned char> pixels;  // RGBA from GL, or the whole frame without PBOs
+    std::vector<unsigned char> row;     // One RGB output row
+    int pending;                        // Frames read back but not yet written
+};
+
+bool writeFrame(FrameWriter& w, int frame, const unsigned char* rgba) {
+    const int width = w.options->width, height = w.options->height;
+    FILE* ppm = nullptr;
+    if (!w.options->ppmPrefix.empty()) {
+        char name[32];
+        snprintf(name, sizeof(name), "%05d.ppm", frame);
+        std::string path = w.options->ppmPrefix + name;
+        ppm = fopen(path.c_str(), "wb");
+        if (!ppm) {
+            std::cerr << "Cannot write " << path << std::endl;
+            return false;
+        }
+        fprintf(ppm, "P6\n%d %d\n255\n", width, height);
+    }
+    // GL rows run bottom-up; image files run top-down
+    for (int y = height - 1; y >= 0; --y) {
+        const unsigned char* src = rgba + (size_t)y * width * 4;
+        for (int x = 0; x < width; ++x) {
+            w.row[x * 3 + 0] = src[x * 4 + 0];
+            w.row[x * 3 + 1] = src[x * 4 + 1];
+            w.row[x * 3 + 2] = src[x * 4 + 2];
+        }
+        if (ppm)
+            fwrite(w.row.data(), 1, w.row.size(), ppm);
+        if (w.raw)
+            fwrite(w.row.data(), 1, w.row.size(), w.raw);
+    }
+    if (ppm)
+        fclose(ppm);
+    return true;
+}
+
+bool frameWriterActive(const FrameWriter& w) {
+    return !w.options->ppmPrefix.empty() || w.raw;
+}
+
+bool openFrameWriter(FrameWriter& w, const HeadlessOptions& options) {
+    w.options = &options;
+    w.raw = nullptr;
+    w.pending = 0;
+    memset(w.pbos, 0, sizeof(w.pbos));
+    if (!options.rawPath.empty()) {
+        w.raw = options.rawPath == "-" ? stdout : fopen(options.rawPath.c_str(), "wb");
+        if (!w.raw) {
+            std::cerr << "Cannot write " << options.rawPath << std::endl;
+            return false;
+        }
+    }
+    if (!frameWriterActive(w))
+        return true;
+
+    size_t frameBytes = (size_t)options.width * options.height * 4;
+    w.row.resize(options.width * 3);
+    if (gl.hasPixelBuffers) {
+        gl.GenBuffers(FRAME_READBACK_DEPTH, w.pbos);
+        for (int i = 0; i < FRAME_READBACK_DEPTH; ++i) {
+            gl.BindBuffer(GL_PIXEL_PACK_BUFFER, w.pbos[i]);
+            gl.BufferData(GL_PIXEL_PACK_BUFFER, frameBytes, nullptr, GL_STREAM_READ);
+        }
+        gl.BindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    } else {
+        w.pixels.resize(frameBytes);
+    }
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    return true;
+}
+
+bool writeOldestPending(FrameWriter& w, int frame) {
+    int oldest = frame - w.pending + 1;
+    gl.BindBuffer(GL_PIXEL_PACK_BUFFER, w.pbos[oldest % FRAME_READBACK_DEPTH]);
+    const unsigned char* rgba = (const unsigned char*)gl.MapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+    bool ok = rgba && writeFrame(w, oldest, rgba);
+    gl.UnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    gl.BindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    w.pending--;
+    return ok;
+}
+
+// Starts reading back 'frame' and writes out the oldest frame whose copy
+// has had time to finish.
+bool captureFrame(FrameWriter& w, int frame) {
+    if (!frameWriterActive(w))
+        return true;
+    const int width = w.options->width, height = w.options->height;
+    if (!gl.hasPixelBuffers) {
+        glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, w.pixels.data());
+        return writeFrame(w, frame, w.pixels.data());
     }
-    glEnd();
+    gl.BindBuffer(GL_PIXEL_PACK_BUFFER, w.pbos[frame % FRAME_READBACK_DEPTH]);
+    glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+    gl.BindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    w.pending++;
+    if (w.pending < FRAME_READBACK_DEPTH)
+        return true;
+    return writeOldestPending(w, frame);
 }
 
-void drawTree(float x, float y, float z) {
-    glPushMatrix();
-    glTranslatef(x, y, z);
-    
-    glColor3f(0.5f, 0.3f, 0.1f);
-    glPushMatrix();
-    glTranslatef(0.0f, 0.5f, 0.0f);
-    drawCylinder(0.15f, 0.1f, 1.0f, 12);
-    glPopMatrix();
-    
-    glColor3f(0.1f, 0.5f, 0.1f);
-    
-    glPushMatrix();
-    glTranslatef(0.0f, 1.5f, 0.0f);
-    drawSphere(0.5f, 12, 12);
-    glPopMatrix();
-    
-    glPushMatrix();
-    glTranslatef(0.0f, 1.8f, 0.0f);
-    drawSphere(0.4f, 12, 12);
-    glPopMatrix();
-    
-    glPushMatrix();
-    glTranslatef(0.0f, 2.1f, 0.0f);
-    drawSphere(0.3f, 12, 12);
-    glPopMatrix();
-    
-    glPopMatrix();
+bool closeFrameWriter(FrameWriter& w, int lastFrame) {
+    bool ok = true;
+    while (w.pending > 0 && ok)
+        ok = writeOldestPending(w, lastFrame);
+    if (w.pbos[0])
+        gl.DeleteBuffers(FRAME_READBACK_DEPTH, w.pbos);
+    if (w.raw && w.raw != stdout)
+        fclose(w.raw);
+    else if (w.raw)
+        fflush(w.raw);
+    return ok;
 }
 
-void drawHouse() {
-    glPushMatrix();
-    glTranslatef(houseX, houseY, houseZ);
+// Batch mode renders every CameraView from each tick's snapshot. The views
+// share what is uploaded once (meshes, the static scene) and one region of
+// the stream ring: the rain streaks and ripples are written once, each
+// view's culled clouds and trees are appended after them, and only then is
+// anything drawn, each view into its own layer of a 2D texture array sized
+// for the largest of them. An extra view costs its culling and its
+// rasterization.
+struct BatchView {
+    CameraView camera;
+    GLuint fbo;              // Its layer of the color array and the shared depth
+    ViewBatches batches;
+    HeadlessOptions output;  // Its size and PPM prefix, for its FrameWriter
+    FrameWriter writer;
+};
 
-    glColor3f(0.8f, 0.8f, 0.8f);
-    drawCube(0, 0.0f, 0, 2, 1.5, 2);
+struct BatchTargets {
+    std::vector<BatchView> views;
+    GLuint colorArray;
+    GLuint depthBuffer;      // Cleared by each view in turn
+    int width, height;       // The largest view
+};
 
-    glColor3f(0.6f, 0.3f, 0.1f);
-    
-    glBegin(GL_TRIANGLES);
-    glVertex3f(-1.0f, 0.75f, 1.0f);
-    glVertex3f(1.0f, 0.75f, 1.0f);
-    glVertex3f(0.0f, 1.75f, 1.0f);
-    glEnd();
-    
-    glBegin(GL_TRIANGLES);
-    glVertex3f(-1.0f, 0.75f, -1.0f);
-    glVertex3f(1.0f, 0.75f, -1.0f);
-    glVertex3f(0.0f, 1.75f, -1.0f);
-    glEnd();
+BatchTargets batch;
 
-    glBegin(GL_QUADS);
-    glVertex3f(-1.0f, 0.75f, 1.0f);
-    glVertex3f(-1.0f, 0.75f, -1.0f);
-    glVertex3f(0.0f, 1.75f, -1.0f);
-    glVertex3f(0.0f, 1.75f, 1.0f);
+bool openBatchTargets(const HeadlessOptions& options) {
+    if (!gl.hasTextureArrays) {
+        std::cerr << "Batch rendering needs texture arrays (OpenGL 3.0)" << std::endl;
+        return false;
+    }
+    if (!options.rawPath.empty()) {
+        std::cerr << "--raw streams a single view; use --ppm with --view" << std::endl;
+        return false;
+    }
+    batch.views.resize(options.views.size());
+    batch.width = batch.height = 1;
+    for (size_t i = 0; i < batch.views.size(); ++i) {
+        CameraView& camera = batch.views[i].camera;
+        camera = options.views[i];
+        if (camera.width == 0) {
+            camera.width = options.width;
+            camera.height = options.height;
+        }
+        batch.width = std::max(batch.width, camera.width);
+        batch.height = std::max(batch.height, camera.height);
+    }
 
-    glVertex3f(1.0f, 0.75f, 1.0f);
-    glVertex3f(1.0f, 0.75f, -1.0f);
-    glVertex3f(0.0f, 1.75f, -1.0f);
-    glVertex3f(0.0f, 1.75f, 1.0f);
-    glEnd();
+    glGenTextures(1, &batch.colorArray);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, batch.colorArray);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    gl.TexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGBA8, batch.width, batch.height, (GLsizei)batch.views.size(), 0,
+                  GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+    gl.GenRenderbuffers(1, &batch.depthBuffer);
+    gl.BindRenderbuffer(GL_RENDERBUFFER, batch.depthBuffer);
+    gl.RenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, batch.width, batch.height);
 
-    glColor3f(0.4f, 0.2f, 0.0f);
-    glPushMatrix();
-    glTranslatef(0.0f, -0.5f, 1.01f);
-    if (doorOpen)
-        glRotatef(-90, 0.0f, 1.0f, 0.0f);
-    glBegin(GL_QUADS);
-    glVertex3f(-0.25f, 0.0f, 0.0f);
-    glVertex3f(0.25f, 0.0f, 0.0f);
-    glVertex3f(0.25f, 0.75f, 0.0f);
-    glVertex3f(-0.25f, 0.75f, 0.0f);
-    glEnd();
-    glPopMatrix();
+    bool ok = true;
+    for (size_t i = 0; i < batch.views.size(); ++i) {
+        BatchView& view = batch.views[i];
+        gl.GenFramebuffers(1, &view.fbo);
+        gl.BindFramebuffer(GL_FRAMEBUFFER, view.fbo);
+        gl.FramebufferTextureLayer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, batch.colorArray, 0, (GLint)i);
+        gl.FramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, batch.depthBuffer);
+        if (ok && gl.CheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+            std::cerr << "Batch framebuffer for view " << i << " incomplete!" << std::endl;
+            ok = false;
+        }
+        view.output.width = view.camera.width;
+        view.output.height = view.camera.height;
+        view.output.frames = options.frames;
+        if (!options.ppmPrefix.empty()) {
+            char name[32];
+            snprintf(name, sizeof(name), "view%02d_", (int)i);
+            view.output.ppmPrefix = options.ppmPrefix + name;
+        }
+        ok = openFrameWriter(view.writer, view.output) && ok;
+    }
+    return ok;
+}
 
-    glColor3f(0.9f, 0.9f, 1.0f);
-    glPushMatrix();
-    glTranslatef(-0.6f, 0.0f, 1.01f);
-    glBegin(GL_QUADS);
-    glVertex3f(-0.25f, -0.25f, 0.0f);
-    glVertex3f(0.25f, -0.25f, 0.0f);
-    glVertex3f(0.25f, 0.25f, 0.0f);
-    glVertex3f(-0.25f, 0.25f, 0.0f);
-    glEnd();
-    
-    glColor3f(0.0f, 0.0f, 0.0f);
-    glBegin(GL_LINES);
-    glVertex3f(-0.25f, 0.0f, 0.01f);
-    glVertex3f(0.25f, 0.0f, 0.01f);
-    glVertex3f(0.0f, -0.25f, 0.01f);
-    glVertex3f(0.0f, 0.25f, 0.01f);
-    glEnd();
-    glPopMatrix();
-    
-    glColor3f(0.9f, 0.9f, 1.0f);
-    glPushMatrix();
-    glTranslatef(0.6f, 0.0f, 1.01f);
-    glBegin(GL_QUADS);
-    glVertex3f(-0.25f, -0.25f, 0.0f);
-    glVertex3f(0.25f, -0.25f, 0.0f);
-    glVertex3f(0.25f, 0.25f, 0.0f);
-    glVertex3f(-0.25f, 0.25f, 0.0f);
-    glEnd();
-    
-    glColor3f(0.0f, 0.0f, 0.0f);
-    glBegin(GL_LINES);
-    glVertex3f(-0.25f, 0.0f, 0.01f);
-    glVertex3f(0.25f, 0.0f, 0.01f);
-    glVertex3f(0.0f, -0.25f, 0.01f);
-    glVertex3f(0.0f, 0.25f, 0.01f);
-    glEnd();
-    glPopMatrix();
+void renderBatchFrame() {
+    resetFrameArena();
+    renderStats.drawCalls = 0;
+    renderStats.vertices = 0;
+    updateWorld();
+    updateSceneGraph();
 
-    glColor3f(0.5f, 0.3f, 0.3f);
-    glPushMatrix();
-    glTranslatef(0.6f, 1.2f, -0.3f);
-    drawCube(0.0f, 0.0f, 0.0f, 0.3f, 0.6f, 0.3f);
-    glPopMatrix();
+    // A mapped region can't be drawn from while it is being written, so
+    // every view is culled and streamed before the first draw
+    {
+        PROFILE_STAGE(LANE_RENDER, STAGE_STREAM);
+        beginStreamWrites(sharedStreamBytes() + batch.views.size() * viewStreamBytes());
+        streamSharedGeometry();
+    }
+    for (size_t i = 0; i < batch.views.size(); ++i) {
+        BatchView& view = batch.views[i];
+        viewBatches = &view.batches;
+        setProjection(view.camera.width, view.camera.height);
+        lookAtScene(view.camera.distance, view.camera.angleX, view.camera.angleY);
+        cullScene();
+        PROFILE_STAGE(LANE_RENDER, STAGE_STREAM);
+        streamViewBatches();
+    }
+    endStreamWrites();
 
-    drawTree(2.5f, 0.0f, -0.5f);
+    glClearColor(0.6f, 0.8f, 1.0f, 1.0f);
+    for (size_t i = 0; i < batch.views.size(); ++i) {
+        BatchView& view = batch.views[i];
+        viewBatches = &view.batches;
+        gl.BindFramebuffer(GL_FRAMEBUFFER, view.fbo);
+        setProjection(view.camera.width, view.camera.height);
+        {
+            PROFILE_GPU_STAGE(STAGE_CLEAR);
+            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        }
+        lookAtScene(view.camera.distance, view.camera.angleX, view.camera.angleY);
+        drawScene();
+    }
+    endStreamFrame();
+    viewBatches = &mainBatches;
+}
 
-    glPopMatrix();
+bool captureBatchFrame(int frame) {
+    bool ok = true;
+    for (size_t i = 0; i < batch.views.size(); ++i) {
+        gl.BindFramebuffer(GL_FRAMEBUFFER, batch.views[i].fbo);
+        ok = captureFrame(batch.views[i].writer, frame) && ok;
+    }
+    return ok;
 }
 
-void drawPond() {
-    glPushMatrix();
-    glTranslatef(pondX, pondY, pondZ);
-    
-    glEnable(GL_BLEND);
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-    
-    glColor4f(0.2f, 0.4f, 0.8f, 0.8f);
-    
-    float pondRadius = 2.0f;
-    int segments = 36;
-    float angle, x, z;
-    
-    glBegin(GL_TRIANGLE_FAN);
-    glVertex3f(0.0f, 0.0f, 0.0f);
-    for (int i = 0; i <= segments; ++i) {
-        angle = i * 2.0f * M_PI / segments;
-        x = cos(angle) * pondRadius;
-        z = sin(angle) * pondRadius;
-        glVertex3f(x, 0.0f, z);
+bool closeBatchTargets(int lastFrame) {
+    bool ok = true;
+    for (size_t i = 0; i < batch.views.size(); ++i) {
+        BatchView& view = batch.views[i];
+        ok = closeFrameWriter(view.writer, lastFrame) && ok;
+        gl.DeleteFramebuffers(1, &view.fbo);
     }
-    glEnd();
-    
-    glColor3f(0.6f, 0.5f, 0.3f);
-    glBegin(GL_TRIANGLE_STRIP);
-    for (int i = 0; i <= segments; ++i) {
-        angle = i * 2.0f * M_PI / segments;
-        x = cos(angle) * pondRadius;
-        z = sin(angle) * pondRadius;
-        glVertex3f(x * 1.1f, 0.05f, z * 1.1f);
-        glVertex3f(x, 0.01f, z);
+    gl.BindFramebuffer(GL_FRAMEBUFFER, 0);
+    if (batch.depthBuffer)
+        gl.DeleteRenderbuffers(1, &batch.depthBuffer);
+    if (batch.colorArray)
+        glDeleteTextures(1, &batch.colorArray);
+    batch = BatchTargets();
+    return ok;
+}
+
+#ifdef HAVE_EGL
+GLProc eglProcLoader(const char* name) {
+    return (GLProc)eglGetProcAddress(name);
+}
+
+// A surfaceless EGL context (Mesa llvmpipe on machines without a GPU or
+// display) with a framebuffer object to draw into.
+struct HeadlessContext {
+    EGLDisplay display;
+    EGLContext context;
+    GLuint fbo, colorBuffer, depthBuffer;
+};
+
+bool createHeadlessContext(HeadlessContext& hc, int width, int height) {
+    hc.display = EGL_NO_DISPLAY;
+    hc.context = EGL_NO_CONTEXT;
+    hc.fbo = hc.colorBuffer = hc.depthBuffer = 0;
+
+    PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+        (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (getPlatformDisplay)
+        hc.display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+    if (hc.display == EGL_NO_DISPLAY)
+        hc.display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    EGLint major, minor;
+    if (hc.display == EGL_NO_DISPLAY || !eglInitialize(hc.display, &major, &minor)) {
+        std::cerr << "Failed to initialize EGL!" << std::endl;
+        return false;
     }
-    glEnd();
-    
-    updateRipples();
-    
-    for (int i = 0; i < RIPPLES; ++i) {
-        Ripple* ripple = &ripples[i];
-        if (ripple->radius > 0.01f) {
-            glColor4f(1.0f, 1.0f, 1.0f, ripple->alpha * 0.3f);
-            glBegin(GL_LINE_LOOP);
-            for (int j = 0; j < segments; ++j) {
-                angle = j * 2.0f * M_PI / segments;
-                x = ripple->x + cos(angle) * ripple->radius;
-                z = ripple->z + sin(angle) * ripple->radius;
-                glVertex3f(x, 0.02f, z);
-            }
-            glEnd();
-        }
+    if (!eglBindAPI(EGL_OPENGL_API)) {
+        std::cerr << "EGL has no desktop OpenGL!" << std::endl;
+        return false;
     }
-    
-    glDisable(GL_BLEND);
-    glPopMatrix();
+    const EGLint configAttribs[] = { EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE };
+    EGLConfig config = nullptr;
+    EGLint configCount = 0;
+    eglChooseConfig(hc.display, configAttribs, &config, 1, &configCount);
+    hc.context = eglCreateContext(hc.display, configCount ? config : (EGLConfig)0, EGL_NO_CONTEXT, nullptr);
+    if (hc.context == EGL_NO_CONTEXT ||
+        !eglMakeCurrent(hc.display, EGL_NO_SURFACE, EGL_NO_SURFACE, hc.context)) {
+        std::cerr << "Failed to create a surfaceless EGL context!" << std::endl;
+        return false;
+    }
+
+    loadGLFunctions(eglProcLoader);
+    if (!gl.hasFramebuffers) {
+        std::cerr << "Framebuffer objects unavailable, cannot render headless!" << std::endl;
+        return false;
+    }
+    gl.GenFramebuffers(1, &hc.fbo);
+    gl.GenRenderbuffers(1, &hc.colorBuffer);
+    gl.GenRenderbuffers(1, &hc.depthBuffer);
+    gl.BindRenderbuffer(GL_RENDERBUFFER, hc.colorBuffer);
+    gl.RenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+    gl.BindRenderbuffer(GL_RENDERBUFFER, hc.depthBuffer);
+    gl.RenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+    gl.BindFramebuffer(GL_FRAMEBUFFER, hc.fbo);
+    gl.FramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, hc.colorBuffer);
+    gl.FramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, hc.depthBuffer);
+    if (gl.CheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        std::cerr << "Offscreen framebuffer incomplete!" << std::endl;
+        return false;
+    }
+    glReadBuffer(GL_COLOR_ATTACHMENT0);
+    std::cout << "Headless renderer: " << glGetString(GL_RENDERER) << ", OpenGL " << glGetString(GL_VERSION) << std::endl;
+    return true;
 }
 
-void drawSky() {
-    glColor3f(0.4f, 0.6f, 0.9f);
-    glPushMatrix();
-    glTranslatef(0.0f, 0.0f, 0.0f);
-    
-    float radius = 50.0f;
-    int segments = 20;
-    
-    glBegin(GL_TRIANGLE_FAN);
-    glVertex3f(0.0f, radius, 0.0f);
-    for (int i = 0; i <= segments * 2; i++) {
-        float angle = i * M_PI / segments;
-        float x = radius * cos(angle);
-        float z = radius * sin(angle);
-        glVertex3f(x, 0.0f, z);
+void destroyHeadlessContext(HeadlessContext& hc) {
+    if (hc.context != EGL_NO_CONTEXT && gl.hasFramebuffers) {
+        gl.BindFramebuffer(GL_FRAMEBUFFER, 0);
+        gl.DeleteFramebuffers(1, &hc.fbo);
+        gl.DeleteRenderbuffers(1, &hc.colorBuffer);
+        gl.DeleteRenderbuffers(1, &hc.depthBuffer);
+    }
+    if (hc.display != EGL_NO_DISPLAY) {
+        eglMakeCurrent(hc.display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+        if (hc.context != EGL_NO_CONTEXT)
+            eglDestroyContext(hc.display, hc.context);
+        eglTerminate(hc.display);
     }
-    glEnd();
-    
-    glPopMatrix();
 }
 
-void drawGround() {
-    glColor3f(0.3f, 0.6f, 0.3f);
-    glBegin(GL_QUADS);
-    glVertex3f(-50.0f, 0.0f, -50.0f);
-    glVertex3f(-50.0f, 0.0f, 50.0f);
-    glVertex3f(50.0f, 0.0f, 50.0f);
-    glVertex3f(50.0f, 0.0f, -50.0f);
-    glEnd();
-    
-    glColor3f(0.2f, 0.5f, 0.2f);
-    glBegin(GL_LINES);
-    for (float x = -10.0f; x <= 10.0f; x += 1.0f) {
-        for (float z = -10.0f; z <= 10.0f; z += 1.0f) {
-            if (x > -1.5f && x < 1.5f && z > -1.5f && z < 1.5f)
-                continue;
-            float dx = x - pondX;
-            float dz = z - pondZ;
-            float distToPond = sqrt(dx*dx + dz*dz);
-            if (distToPond < 2.2f)
-                continue;
-            glVertex3f(x - 0.1f, 0.01f, z - 0.1f);
-            glVertex3f(x + 0.1f, 0.01f, z + 0.1f);
-            glVertex3f(x - 0.1f, 0.01f, z + 0.1f);
-            glVertex3f(x + 0.1f, 0.01f, z - 0.1f);
+int runHeadless(const HeadlessOptions& options) {
+    HeadlessContext hc;
+    if (!createHeadlessContext(hc, options.width, options.height)) {
+        destroyHeadlessContext(hc);
+        return -1;
+    }
+    initGLState(options.width, options.height);
+    initScene();
+    useSimThread = false;
+    if (!startRecording(options.width, options.height)) {
+        shutdownScene();
+        destroyHeadlessContext(hc);
+        return -1;
+    }
+    startSimulation();
+
+    const bool batched = !options.views.empty();
+    FrameWriter writer;
+    bool ok = batched ? openBatchTargets(options) : openFrameWriter(writer, options);
+    double start = nowSeconds();
+    int frame = 0;
+    for (; ok && frame < options.frames; ++frame) {
+        governFrame(nowSeconds());
+        beginFrameAllocations();
+        runSingleTick();
+        if (replay.active)
+            replayViewInputs(simTick);
+        profileBeginFrame(LANE_RENDER);
+        buildRenderView(nowSeconds());
+        if (batched)
+            renderBatchFrame();
+        else
+            renderFrame();
+        endFrameAllocations();
+        {
+            PROFILE_STAGE(LANE_RENDER, STAGE_PRESENT);
+            ok = batched ? captureBatchFrame(frame) : captureFrame(writer, frame);
         }
+        profileEndFrame(LANE_RENDER);
     }
-    glEnd();
+    ok = (batched ? closeBatchTargets(frame - 1) : closeFrameWriter(writer, frame - 1)) && ok;
+    glFinish();
+    double elapsed = nowSeconds() - start;
+    if (batched)
+        std::cout << "Rendered " << frame << " frames of " << options.views.size() << " views";
+    else
+        std::cout << "Rendered " << frame << " frames at " << options.width << "x" << options.height;
+    std::cout << " in " << elapsed << " s (" << elapsed * 1000.0 / std::max(1, frame) << " ms/frame)" << std::endl;
+    if (governor.enabled)
+        printQualityStats();
+    if (world.running)
+        printWorldStats();
+    ok = finishReplay() && ok;
+
+    shutdownScene();
+    destroyHeadlessContext(hc);
+    return ok ? 0 : -1;
 }
 
-void drawControllableSphere() {
-    glColor3f(1.0f, 0.5f, 0.0f);
-    glPushMatrix();
-    glTranslatef(sphere.x, sphere.y + sphere.radius, sphere.z);
-    drawSphere(sphere.radius, 12, 12);
-    glPopMatrix();
+#if RAIN_SCENE_BENCH
+// scene_bench: the whole scene at 1x to 1000x its default size, from a
+// fixed seed and the default camera, rendered headless for a fixed number
+// of frames. Simulation ticks and rendered frames are timed in separate
+// passes so a regression in one cannot hide behind the other.
+const int BENCH_WARMUP = 5;
+
+struct BenchResult {
+    int scale;
+    double tickMean, tickP95;                // ms
+    double frameMean, frameP50, frameP95;    // ms, including glFinish
+    long drawCalls, vertices;                // Per frame
+    double allocations;                      // Heap allocations per tick and frame
+    uint64_t stateHash;                      // Simulation state after the tick pass
+};
+
+double meanOf(const std::vector<float>& values) {
+    double sum = 0.0;
+    for (size_t i = 0; i < values.size(); ++i)
+        sum += values[i];
+    return values.empty() ? 0.0 : sum / values.size();
 }
 
-int main() {
-    srand(time(0));
+BenchResult runBenchScenario(int scale, int frames) {
+    BenchResult r = {};
+    r.scale = scale;
+    numParticles = scene.header->particles * scale;
+    numClouds = scene.header->clouds * scale;
+    numRipples = scene.header->ripples * scale;
+    numTrees = scene.header->trees * scale;
+    cameraDistance = 15.0f;
+    cameraAngleX = 45.0f;
+    cameraAngleY = 18.0f;
+    std::vector<float> times;
+    times.reserve(frames);
+
+    // Simulation pass: ticks back to back, nothing drawn
+    initScene();
+    initSnapshots(nowSeconds());
+    for (int i = 0; i < BENCH_WARMUP + frames; ++i) {
+        double start = nowSeconds();
+        runSingleTick();
+        if (i >= BENCH_WARMUP)
+            times.push_back((float)((nowSeconds() - start) * 1000.0));
+    }
+    r.stateHash = hashSimState();
+    r.tickMean = meanOf(times);
+    r.tickP95 = percentile(times, 0.95);
+
+    // Render pass from the same starting state; the tick before each frame
+    // is left out of the timing
+    initScene();
+    initSnapshots(nowSeconds());
+    times.clear();
+    uint64_t allocStart = 0;
+    for (int i = 0; i < BENCH_WARMUP + frames; ++i) {
+        if (i == BENCH_WARMUP)
+            allocStart = heapAllocations.load();
+        runSingleTick();
+        glFinish();
+        double start = nowSeconds();
+        profileBeginFrame(LANE_RENDER);
+        buildRenderView(nowSeconds());
+        renderFrame();
+        glFinish();
+        profileEndFrame(LANE_RENDER);
+        if (i < BENCH_WARMUP)
+            continue;
+        times.push_back((float)((nowSeconds() - start) * 1000.0));
+        r.drawCalls += renderStats.drawCalls;
+        r.vertices += renderStats.vertices;
+    }
+    r.allocations = (double)(heapAllocations.load() - allocStart) / frames;
+    r.frameMean = meanOf(times);
+    r.frameP50 = percentile(times, 0.50);
+    r.frameP95 = percentile(times, 0.95);
+    r.drawCalls /= frames;
+    r.vertices /= frames;
+    return r;
+}
+
+int runSceneBench(int argc, char** argv) {
+    HeadlessOptions options = { 800, 600, 100 };
+    std::vector<int> scales = { 1, 10, 100, 1000 };
+    std::string csvPath;
+    rngSeed = 1;
+    particleKernel = bestParticleKernel();
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+            options.frames = std::max(1, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--scales") == 0 && i + 1 < argc) {
+            scales.clear();
+            for (const char* p = argv[++i]; *p; ) {
+                scales.push_back(std::max(1, atoi(p)));
+                p += strcspn(p, ",");
+                if (*p == ',')
+                    ++p;
+            }
+        } else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+            if (sscanf(argv[++i], "%dx%d", &options.width, &options.height) != 2 ||
+                options.width <= 0 || options.height <= 0) {
+                std::cerr << "Bad --size, expected WIDTHxHEIGHT: " << argv[i] << std::endl;
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            rngSeed = strtoull(argv[++i], nullptr, 10);
+        } else if (strcmp(argv[i], "--kernel") == 0 && i + 1 < argc) {
+            if (!selectParticleKernel(argv[++i]))
+                return -1;
+        } else if (strcmp(argv[i], "--csv") == 0 && i + 1 < argc) {
+            csvPath = argv[++i];
+        } else if (strcmp(argv[i], "--gpu-rain") == 0) {
+            useGpuRain = true;
+        } else if (strcmp(argv[i], "--cloud-impostors") == 0) {
+            useCloudImpostors = true;
+        } else if (strcmp(argv[i], "--scene") == 0 && i + 1 < argc) {
+            if (!loadScene(argv[++i]))
+                return -1;
+        } else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) {
+            jobThreads = std::max(1, atoi(argv[++i]));
+        } else {
+            std::cerr << "Unknown option: " << argv[i] << std::endl;
+            std::cerr << "Usage: " << argv[0] << " [--frames N] [--scales 1,10,100,1000] [--size WxH]"
+                      << " [--seed N] [--kernel scalar|sse|avx2] [--gpu-rain] [--cloud-impostors] [--scene FILE] [--jobs N] [--csv FILE]" << std::endl;
+            return -1;
+        }
+    }
+    if (!scene.header)
+        loadDefaultScene();
+
+    HeadlessContext hc;
+    if (!createHeadlessContext(hc, options.width, options.height)) {
+        destroyHeadlessContext(hc);
+        return -1;
+    }
+    initGLState(options.width, options.height);
+    useSimThread = false;
+    std::cout << "seed " << rngSeed << ", " << options.width << "x" << options.height << ", "
+              << options.frames << " ticks and frames per scale, "
+              << (gpuRainActive() ? "GPU rain" : particleKernelNames[particleKernel])
+              << (gpuRainActive() ? "" : " kernel") << std::endl;
+
+    FILE* csv = nullptr;
+    if (!csvPath.empty()) {
+        csv = fopen(csvPath.c_str(), "w");
+        if (!csv) {
+            std::cerr << "Cannot write " << csvPath << std::endl;
+            return -1;
+        }
+        fprintf(csv, "scale,particles,clouds,ripples,trees,tick_mean_ms,tick_p95_ms,particles_per_s,"
+                     "frame_mean_ms,frame_p50_ms,frame_p95_ms,draw_calls,vertices,allocs_per_frame,state_hash\n");
+    }
+
+    printf("                                       | simulation                  | render\n");
+    printf("scale  particles  clouds ripples trees |  ms/tick    p95   Mpart/s   |  ms/frame    p50     p95  draws  vertices  allocs | state\n");
+    for (size_t s = 0; s < scales.size(); ++s) {
+        const SceneHeader* h = scene.header;
+        uint32_t largest = std::max(std::max(h->particles, h->clouds), std::max(h->ripples, h->trees));
+        if ((uint64_t)largest * scales[s] > MAX_SCENE_COUNT) {
+            printf("%4dx  skipped: a count would pass the scene limit of %u\n", scales[s], MAX_SCENE_COUNT);
+            continue;
+        }
+        BenchResult r = runBenchScenario(scales[s], options.frames);
+        // Only drops the CPU steps count; GPU rain is stepped inside the render pass
+        double particlesPerSecond = r.tickMean > 0.0 ? particles.count / (r.tickMean / 1000.0) : 0.0;
+        printf("%4dx  %9d  %6d %7d %5d | %8.3f %7.3f  %8.1f   | %9.3f %7.3f %7.3f %6ld %9ld %7.2f | %016llx\n",
+               r.scale, numParticles, numClouds, numRipples, numTrees, r.tickMean, r.tickP95,
+               particlesPerSecond / 1.0e6, r.frameMean, r.frameP50, r.frameP95, r.drawCalls, r.vertices,
+               r.allocations, (unsigned long long)r.stateHash);
+        fflush(stdout);
+        if (csv)
+            fprintf(csv, "%d,%d,%d,%d,%d,%.4f,%.4f,%.0f,%.4f,%.4f,%.4f,%ld,%ld,%.2f,%016llx\n", r.scale, numParticles,
+                    numClouds, numRipples, numTrees, r.tickMean, r.tickP95, particlesPerSecond, r.frameMean,
+                    r.frameP50, r.frameP95, r.drawCalls, r.vertices, r.allocations, (unsigned long long)r.stateHash);
+    }
+    if (csv)
+        fclose(csv);
+
+    shutdownScene();
+    destroyHeadlessContext(hc);
+    return 0;
+}
+#endif
+#endif
+
+int main(int argc, char** argv) {
+    // Up front, so the first line logged from a frame loop doesn't start a thread there
+    std::call_once(loggerStarted, startLogger);
+#if RAIN_SCENE_BENCH
+    return runSceneBench(argc, argv);
+#endif
+    bool haveSeed = false;
+    bool headless = false;
+    HeadlessOptions headlessOptions = { 800, 600, 100 };
+    int benchFrames = 0;
+    int benchParticles = 0;
+    particleKernel = bestParticleKernel();
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--immediate") == 0) {
+            useMeshCache = false;
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            showStats = true;
+        } else if (strcmp(argv[i], "--budget") == 0 && i + 1 < argc) {
+            governor.budgetMs = atof(argv[++i]);
+            if (governor.budgetMs <= 0.0) {
+                std::cerr << "Bad --budget, expected milliseconds per frame: " << argv[i] << std::endl;
+                return -1;
+            }
+            governor.enabled = true;
+        } else if (strcmp(argv[i], "--no-sim-thread") == 0) {
+            useSimThread = false;
+        } else if (strcmp(argv[i], "--no-instancing") == 0) {
+            useInstancing = false;
+        } else if (strcmp(argv[i], "--no-culling") == 0) {
+            useCulling = false;
+        } else if (strcmp(argv[i], "--no-persistent-map") == 0) {
+            usePersistentMapping = false;
+        } else if (strcmp(argv[i], "--gpu-rain") == 0) {
+            useGpuRain = true;
+        } else if (strcmp(argv[i], "--cloud-impostors") == 0) {
+            useCloudImpostors = true;
+        } else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) {
+            jobThreads = std::max(1, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--world") == 0) {
+            useWorld = true;
+        } else if (strcmp(argv[i], "--world-dir") == 0 && i + 1 < argc) {
+            worldDir = argv[++i];
+            useWorld = true;
+        } else if (strcmp(argv[i], "--world-drift") == 0 && i + 1 < argc) {
+            worldDrift = (float)atof(argv[++i]);
+            useWorld = true;
+        } else if (strcmp(argv[i], "--scene") == 0 && i + 1 < argc) {
+            if (!loadScene(argv[++i]))
+                return -1;
+            scenePath = argv[i];
+            applySceneCounts();
+        } else if (strcmp(argv[i], "--compile-scene") == 0 && i + 2 < argc) {
+            const char* in = argv[++i];
+            const char* out = argv[++i];
+            return compileSceneFile(in, out) ? 0 : -1;
+        } else if (strcmp(argv[i], "--clouds") == 0 && i + 1 < argc) {
+            numClouds = std::max(0, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--trees") == 0 && i + 1 < argc) {
+            numTrees = std::max(0, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--ripples") == 0 && i + 1 < argc) {
+            numRipples = std::max(0, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            rngSeed = strtoull(argv[++i], nullptr, 10);
+            haveSeed = true;
+        } else if (strcmp(argv[i], "--particles") == 0 && i + 1 < argc) {
+            numParticles = std::max(0, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--kernel") == 0 && i + 1 < argc) {
+            if (!selectParticleKernel(argv[++i]))
+                return -1;
+        } else if (strcmp(argv[i], "--bench-tessellation") == 0) {
+            runTessellationBenchmark();
+            return 0;
+        } else if (strcmp(argv[i], "--bench-particles") == 0) {
+            benchParticles = 1000000;
+            if (i + 1 < argc && argv[i + 1][0] != '-')
+                benchParticles = std::max(1, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--profile") == 0) {
+            showProfile = true;
+        } else if (strcmp(argv[i], "--profile-csv") == 0 && i + 1 < argc) {
+            profileCsvPath = argv[++i];
+        } else if (strcmp(argv[i], "--profile-trace") == 0 && i + 1 < argc) {
+            profileTracePath = argv[++i];
+        } else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+            recordPath = argv[++i];
+        } else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+            if (!loadReplay(argv[++i], &headlessOptions.width, &headlessOptions.height))
+                return -1;
+            headlessOptions.frames = (int)replay.endTick;
+            haveSeed = true;
+            headless = true;
+        } else if (strcmp(argv[i], "--headless") == 0) {
+            headless = true;
+        } else if (strcmp(argv[i], "--view") == 0 && i + 1 < argc) {
+            CameraView view;
+            if (!parseCameraView(argv[++i], &view))
+                return -1;
+            headlessOptions.views.push_back(view);
+            headless = true;
+        } else if (strcmp(argv[i], "--views") == 0 && i + 1 < argc) {
+            if (!loadCameraViews(argv[++i], headlessOptions.views))
+                return -1;
+            headless = true;
+        } else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+            headlessOptions.frames = std::max(1, atoi(argv[++i]));
+        } else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+            if (sscanf(argv[++i], "%dx%d", &headlessOptions.width, &headlessOptions.height) != 2 ||
+                headlessOptions.width <= 0 || headlessOptions.height <= 0) {
+                std::cerr << "Bad --size, expected WIDTHxHEIGHT: " << argv[i] << std::endl;
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--ppm") == 0 && i + 1 < argc) {
+            headlessOptions.ppmPrefix = argv[++i];
+        } else if (strcmp(argv[i], "--raw") == 0 && i + 1 < argc) {
+            headlessOptions.rawPath = argv[++i];
+        } else if (strcmp(argv[i], "--bench") == 0) {
+            benchFrames = 60;
+            if (i + 1 < argc && argv[i + 1][0] != '-')
+                benchFrames = std::max(1, atoi(argv[++i]));
+        } else {
+            std::cerr << "Unknown option: " << argv[i] << std::endl;
+            std::cerr << "Usage: " << argv[0] << " [--immediate] [--stats] [--budget MS] [--no-instancing] [--no-culling] [--no-persistent-map] [--no-sim-thread] [--gpu-rain] [--cloud-impostors] [--jobs N]"
+                      << " [--scene FILE] [--compile-scene TEXT BINARY] [--world] [--world-dir DIR] [--world-drift UNITS]"
+                      << " [--seed N] [--clouds N] [--trees N] [--ripples N] [--particles N] [--kernel scalar|sse|avx2]"
+                      << " [--bench [frames]] [--bench-particles [count]] [--bench-tessellation]"
+                      << " [--headless [--frames N] [--size WxH] [--ppm PREFIX] [--raw FILE|-]]"
+                      << " [--view DIST,AX,AY[,WxH] ...] [--views FILE]"
+                      << " [--record FILE] [--replay FILE]"
+                      << " [--profile] [--profile-csv FILE] [--profile-trace FILE]" << std::endl;
+            return -1;
+        }
+    }
+
+    // Raw frames on stdout must not interleave with log lines
+    if (headlessOptions.rawPath == "-")
+        std::cout.rdbuf(std::cerr.rdbuf());
+
+    if (!haveSeed) {
+        rngSeed = (uint64_t)time(0);
+        std::cout << "Random seed " << rngSeed << " (replay with --seed " << rngSeed << ")" << std::endl;
+    }
+
+    if (benchParticles > 0) {
+        runParticleBenchmark(benchParticles);
+        return 0;
+    }
+
+    if (headless) {
+#ifdef HAVE_EGL
+        return runHeadless(headlessOptions);
+#else
+        std::cerr << "Headless mode needs a build with EGL (-DHAVE_EGL)" << std::endl;
+        return -1;
+#endif
+    }
+
+#if HAVE_GLFW
     if (!glfwInit()) {
         std::cerr << "Failed to initialize GLFW!" << std::endl;
         return -1;
@@ -596,77 +7136,83 @@ int main() {
 
     glfwMakeContextCurrent(window);
     glfwSetKeyCallback(window, keyCallback);
+    if (showStats || benchFrames > 0 || governor.enabled)
+        glfwSwapInterval(0); // Measure the scene, not the display refresh
+    loadGLFunctions(glfwGetProcAddress);
+    int fbWidth = 800, fbHeight = 600;
+    glfwGetFramebufferSize(window, &fbWidth, &fbHeight);
+    initGLState(fbWidth, fbHeight);
+    initScene();
 
-    glEnable(GL_DEPTH_TEST);
-    glEnable(GL_POINT_SMOOTH);
-    glPointSize(8.0f);
+    if (benchFrames > 0) {
+        runInstancingBenchmark(window, benchFrames);
+        glfwSetWindowShouldClose(window, 1);
+    }
+    if (!startRecording(fbWidth, fbHeight)) {
+        shutdownScene();
+        glfwDestroyWindow(window);
+        glfwTerminate();
+        return -1;
+    }
 
-    glMatrixMode(GL_PROJECTION);
-    glLoadIdentity();
-    float aspect = 800.0f / 600.0f;
-    float fov = 45.0f, near = 0.1f, far = 100.0f;
-    float top = near * tan(fov * 3.14159f / 360.0f);
-    float right = top * aspect;
-    glFrustum(-right, right, -top, top, near, far);
+    startSimulation();
 
-    initParticles();
-    initClouds();
-    initRipples();
+    double statsStart = glfwGetTime();
+    int statsFrames = 0;
+    long statsDrawCalls = 0, statsVertices = 0;
+
+    double profileReport = nowSeconds();
 
     while (!glfwWindowShouldClose(window)) {
-        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-        glMatrixMode(GL_MODELVIEW);
-        glLoadIdentity();
-
-        float radX = cameraAngleX * M_PI / 180.0f;
-        float radY = cameraAngleY * M_PI / 180.0f;
-        float eyeX = houseX + cameraDistance * cos(radY) * sin(radX);
-        float eyeY = houseY + cameraDistance * sin(radY);
-        float eyeZ = houseZ + cameraDistance * cos(radY) * cos(radX);
-        float centerX = houseX, centerY = houseY, centerZ = houseZ;
-        float upX = 0.0f, upY = 1.0f, upZ = 0.0f;
-
-        float fX = centerX - eyeX, fY = centerY - eyeY, fZ = centerZ - eyeZ;
-        float fLen = sqrt(fX * fX + fY * fY + fZ * fZ);
-        fX /= fLen; fY /= fLen; fZ /= fLen;
-
-        float sX = upY * fZ - upZ * fY;
-        float sY = upZ * fX - upX * fZ;
-        float sZ = upX * fY - upY * fX;
-        float sLen = sqrt(sX * sX + sY * sY + sZ * sZ);
-        sX /= sLen; sY /= sLen; sZ /= sLen;
-
-        float uX = fY * sZ - fZ * sY;
-        float uY = fZ * sX - fX * sZ;
-        float uZ = fX * sY - fY * sX;
-
-        float m[16] = {
-            sX, uX, -fX, 0,
-            sY, uY, -fY, 0,
-            sZ, uZ, -fZ, 0,
-            -(sX * eyeX + sY * eyeY + sZ * eyeZ),
-            -(uX * eyeX + uY * eyeY + uZ * eyeZ),
-            (fX * eyeX + fY * eyeY + fZ * eyeZ), 1
-        };
-        glMultMatrixf(m);
+        double now = nowSeconds();
+        governFrame(now);
+        beginFrameAllocations();
+        if (!useSimThread)
+            runDueTicks(now);
+        profileBeginFrame(LANE_RENDER);
+        // Draw one tick behind so there is a newer snapshot to blend toward
+        buildRenderView(now - 1.0 / SIM_TICK_RATE);
+        renderFrame();
 
-        glClearColor(0.6f, 0.8f, 1.0f, 1.0f);
+        {
+            PROFILE_STAGE(LANE_RENDER, STAGE_PRESENT);
+            glfwSwapBuffers(window);
+            glfwPollEvents();
+        }
+        profileEndFrame(LANE_RENDER);
+        endFrameAllocations();
 
-        drawSky();
-        drawGround();
-        updateClouds();
-        drawClouds();
-        drawHouse();
-        drawPond();
-        updateParticles();
-        drawParticles();
-        drawControllableSphere();
+        if (showProfile && now - profileReport >= 2.0) {
+            glfwSetWindowTitle(window, profileTitle(240).c_str());
+            printProfileSummary(LANE_RENDER, 240);
+            profileReport = now;
+        }
 
-        glfwSwapBuffers(window);
-        glfwPollEvents();
+        if (showStats) {
+            statsFrames++;
+            statsDrawCalls += renderStats.drawCalls;
+            statsVertices += renderStats.vertices;
+            double elapsed = glfwGetTime() - statsStart;
+            if (elapsed >= 2.0) {
+                LOG(LOG_INFO, "%s%s: %g ms/frame, %ld primitive draw calls, %ld vertices, quality level %d",
+                    useMeshCache ? "mesh cache" : "immediate", instancingActive() ? " + instancing" : "",
+                    elapsed * 1000.0 / statsFrames, statsDrawCalls / statsFrames, statsVertices / statsFrames,
+                    governor.level);
+                statsStart = glfwGetTime();
+                statsFrames = 0;
+                statsDrawCalls = statsVertices = 0;
+            }
+        }
     }
 
+    shutdownScene();
     glfwDestroyWindow(window);
     glfwTerminate();
     return 0;
-}
\ No newline at end of file
+#else
+    if (benchFrames > 0)
+        std::cerr << "--bench draws to a window; ";
+    std::cerr << "This build has no window (built without GLFW); use --headless" << std::endl;
+    return -1;
+#endif
+}
@@ -0,0 +1,31 @@
+# Runs scene_bench with the scalar particle kernel and with KERNEL, and
+# fails unless both leave the simulation in the same state. If this CPU
+# lacks KERNEL the test is skipped: the script exits with 77 where CMake
+# can set its exit code (3.29 and later), and otherwise prints a line the
+# test matches with SKIP_REGULAR_EXPRESSION.
+#
+#   cmake -DBENCH=path/to/scene_bench -DKERNEL=sse -P check_kernels.cmake
+
+foreach(kernel scalar ${KERNEL})
+  execute_process(COMMAND ${BENCH} --frames 5 --scales 1 --kernel ${kernel}
+                  OUTPUT_VARIABLE out ERROR_VARIABLE err RESULT_VARIABLE rc)
+  if(err MATCHES "Particle kernel not available")
+    message("Skipping: the ${KERNEL} kernel is not available on this CPU")
+    if(CMAKE_VERSION VERSION_GREATER_EQUAL 3.29)
+      cmake_language(EXIT 77)
+    endif()
+    return()
+  endif()
+  if(NOT rc EQUAL 0)
+    message(FATAL_ERROR "scene_bench --kernel ${kernel} failed (${rc}):\n${out}${err}")
+  endif()
+  if(NOT out MATCHES "\\| ([0-9a-f]+)[ \r\n]*$")
+    message(FATAL_ERROR "No state hash in the scene_bench --kernel ${kernel} output:\n${out}")
+  endif()
+  set(hash_${kernel} ${CMAKE_MATCH_1})
+endforeach()
+
+if(NOT hash_${KERNEL} STREQUAL hash_scalar)
+  message(FATAL_ERROR "${KERNEL} kernel state ${hash_${KERNEL}} differs from scalar ${hash_scalar}")
+endif()
+message(STATUS "${KERNEL} and scalar kernels agree: ${hash_scalar}")